@@ -0,0 +1,62 @@
+#include "arena.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+/// Size of the chunks that are allocated from the heap. Larger objects get a
+/// chunk of their own.
+const size_t chunkSize = 64 * 1024;
+
+/// The arena that nodes are allocated from on this thread
+thread_local Arena *currentArena = nullptr;
+
+} // namespace
+
+Arena::Arena()
+: m_pos(nullptr), m_end(nullptr), m_allocations(0), m_bytes(0) {}
+
+void *Arena::allocate(size_t size, size_t align)
+{
+    uintptr_t pos = (uintptr_t(m_pos) + align - 1) & ~uintptr_t(align - 1);
+    if (!m_pos || pos + size > uintptr_t(m_end)) {
+        size_t length = std::max(chunkSize, size + align);
+        m_chunks.emplace_back(new uint8_t[length]);
+        m_pos = m_chunks.back().get();
+        m_end = m_pos + length;
+        pos = (uintptr_t(m_pos) + align - 1) & ~uintptr_t(align - 1);
+    }
+    m_pos = reinterpret_cast<uint8_t*>(pos + size);
+    ++m_allocations;
+    m_bytes += size;
+    return reinterpret_cast<void*>(pos);
+}
+
+size_t Arena::getAllocations() const
+{
+    return m_allocations;
+}
+
+size_t Arena::getBytes() const
+{
+    return m_bytes;
+}
+
+Arena& Arena::getCurrent()
+{
+    if (!currentArena) {
+        throw std::logic_error("No arena to allocate nodes from");
+    }
+    return *currentArena;
+}
+
+Arena::Scope::Scope(Arena& arena)
+: m_previous(currentArena)
+{
+    currentArena = &arena;
+}
+
+Arena::Scope::~Scope()
+{
+    currentArena = m_previous;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+/// Memory that objects are allocated from one after another, so that objects
+/// that are allocated together are close together. The memory is all released
+/// at once when the arena is destroyed. The arena does not run destructors;
+/// the owners of its objects do, through NodeDeleter.
+class Arena {
+    /// Blocks of memory that have been allocated from the heap
+    std::vector<std::unique_ptr<uint8_t[]>> m_chunks;
+    /// Free memory in the last chunk
+    uint8_t *m_pos;
+    uint8_t *m_end;
+    /// Number of objects and bytes that have been allocated
+    size_t m_allocations;
+    size_t m_bytes;
+public:
+    Arena();
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    /// Allocate size bytes, aligned to align
+    void *allocate(size_t size, size_t align);
+    /// Get the number of objects that have been allocated
+    size_t getAllocations() const;
+    /// Get the number of bytes that have been allocated
+    size_t getBytes() const;
+    /// Get the arena that nodes are allocated from on this thread. Throws an
+    /// exception if there is none.
+    static Arena& getCurrent();
+
+    /// Makes an arena the current arena of this thread, until it goes out
+    /// of scope
+    class Scope {
+        Arena *m_previous;
+    public:
+        Scope(Arena& arena);
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+};
+
+/// Destroys a node without releasing its memory, which belongs to an arena.
+/// Only allocation is batched by arenas: nodes keep their children, names
+/// and literals in vectors, strings and bit stacks that use the heap, so every
+/// node is still destroyed one at a time to free them. Tearing a program
+/// down walks its nodes, even though the nodes themselves are released at
+/// once.
+struct NodeDeleter {
+    template <class T>
+    void operator()(T *node) const
+    {
+        node->~T();
+    }
+};
+
+/// Unique pointer to a node that was allocated from an arena
+template <class T>
+using NodePtr = std::unique_ptr<T, NodeDeleter>;
+
+/// Create a node in the current arena
+template <class T, class... Args>
+NodePtr<T> makeNode(Args&&... args)
+{
+    void *memory = Arena::getCurrent().allocate(sizeof(T), alignof(T));
+    return NodePtr<T>(new (memory) T(std::forward<Args>(args)...));
+}
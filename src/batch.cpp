@@ -0,0 +1,428 @@
+#include "batch.h"
+#include "function.h"
+#include "idiom.h"
+#include "state.h"
+#include <stdexcept>
+#include <algorithm>
+
+template <size_t Words>
+inline Lanes<Words> lanesFill(bool value)
+{
+    Lanes<Words> ret;
+    for (size_t i = 0; i < Words; ++i) {
+        ret.words[i] = value ? ~uint64_t(0) : 0;
+    }
+    return ret;
+}
+
+template <size_t Words>
+inline Lanes<Words> lanesNand(const Lanes<Words>& a, const Lanes<Words>& b)
+{
+    Lanes<Words> ret;
+    for (size_t i = 0; i < Words; ++i) {
+        ret.words[i] = ~(a.words[i] & b.words[i]);
+    }
+    return ret;
+}
+
+template <size_t Words>
+inline Lanes<Words> lanesAnd(const Lanes<Words>& a, const Lanes<Words>& b)
+{
+    Lanes<Words> ret;
+    for (size_t i = 0; i < Words; ++i) {
+        ret.words[i] = a.words[i] & b.words[i];
+    }
+    return ret;
+}
+
+/// Get the lanes that are set in a but not in b
+template <size_t Words>
+inline Lanes<Words> lanesAndNot(const Lanes<Words>& a, const Lanes<Words>& b)
+{
+    Lanes<Words> ret;
+    for (size_t i = 0; i < Words; ++i) {
+        ret.words[i] = a.words[i] & ~b.words[i];
+    }
+    return ret;
+}
+
+template <size_t Words>
+inline Lanes<Words> lanesOr(const Lanes<Words>& a, const Lanes<Words>& b)
+{
+    Lanes<Words> ret;
+    for (size_t i = 0; i < Words; ++i) {
+        ret.words[i] = a.words[i] | b.words[i];
+    }
+    return ret;
+}
+
+/// Take the lanes in mask from value, and the rest from old
+template <size_t Words>
+inline Lanes<Words> lanesBlend(const Lanes<Words>& old,
+    const Lanes<Words>& value, const Lanes<Words>& mask)
+{
+    Lanes<Words> ret;
+    for (size_t i = 0; i < Words; ++i) {
+        ret.words[i] = (old.words[i] & ~mask.words[i])
+                     | (value.words[i] & mask.words[i]);
+    }
+    return ret;
+}
+
+template <size_t Words>
+inline bool lanesAny(const Lanes<Words>& a)
+{
+    uint64_t ret = 0;
+    for (size_t i = 0; i < Words; ++i) {
+        ret |= a.words[i];
+    }
+    return ret != 0;
+}
+
+template <size_t Words>
+inline bool lanesEqual(const Lanes<Words>& a, const Lanes<Words>& b)
+{
+    uint64_t ret = 0;
+    for (size_t i = 0; i < Words; ++i) {
+        ret |= a.words[i] ^ b.words[i];
+    }
+    return ret == 0;
+}
+
+template <size_t Words>
+const size_t BatchEvaluator<Words>::laneCount;
+
+template <size_t Words>
+BatchEvaluator<Words>::BatchEvaluator(const Function& function)
+: m_all(lanesFill<Words>(true)), m_maxSteps(0), m_steps(0),
+  m_stackLimit(0)
+{
+    m_root = &load(function);
+}
+
+template <size_t Words>
+const typename BatchEvaluator<Words>::Code& BatchEvaluator<Words>::load(
+    const Function& function)
+{
+    auto iter = m_code.find(&function);
+    if (iter != m_code.end()) {
+        return iter->second;
+    }
+    const Bytecode *bytecode = function.getBytecode();
+    if (!bytecode) {
+        throw std::runtime_error("Only functions that do not call external "
+            "functions can be evaluated in a batch");
+    }
+    // Add the code before loading calls, so that recursive calls find it
+    Code& code = m_code[&function];
+    code.bytecode = bytecode;
+    code.inputs = function.getInputNum();
+    code.outputs = function.getOutputNum();
+    code.depths = bytecode->getDepths(code.inputs + code.outputs);
+    for (const Function *callee : bytecode->getCalls()) {
+        code.calls.push_back(&load(*callee));
+    }
+    return code;
+}
+
+template <size_t Words>
+size_t BatchEvaluator<Words>::getInputNum() const
+{
+    return m_root->inputs;
+}
+
+template <size_t Words>
+size_t BatchEvaluator<Words>::getOutputNum() const
+{
+    return m_root->outputs;
+}
+
+template <size_t Words>
+void BatchEvaluator<Words>::setLimits(size_t maxSteps)
+{
+    m_maxSteps = maxSteps;
+}
+
+template <size_t Words>
+void BatchEvaluator<Words>::evaluate(const Word *inputs, Word *outputs,
+    const Word& active)
+{
+    size_t frame = std::max(m_root->inputs, m_root->outputs);
+    if (m_stack.size() < frame) {
+        m_stack.resize(frame);
+    }
+    std::copy(inputs, inputs + m_root->inputs, m_stack.begin());
+    m_all = active;
+    m_steps = 0;
+    m_stackLimit = getStackLimit();
+    m_counters.clear();
+    call(*m_root, 0, active);
+    std::copy(m_stack.begin(), m_stack.begin() + m_root->outputs, outputs);
+}
+
+template <size_t Words>
+std::vector<std::vector<bool>> BatchEvaluator<Words>::evaluate(
+    const std::vector<std::vector<bool>>& inputs)
+{
+    size_t inputNum = getInputNum();
+    size_t outputNum = getOutputNum();
+    std::vector<std::vector<bool>> ret;
+    ret.reserve(inputs.size());
+    std::vector<Word> in(inputNum);
+    std::vector<Word> out(outputNum);
+    for (size_t start = 0; start < inputs.size(); start += laneCount) {
+        size_t num = std::min(laneCount, inputs.size() - start);
+        // transpose vectors into lanes
+        std::fill(in.begin(), in.end(), lanesFill<Words>(false));
+        Word active = lanesFill<Words>(false);
+        for (size_t lane = 0; lane < num; ++lane) {
+            const std::vector<bool>& vec = inputs[start + lane];
+            if (vec.size() != inputNum) {
+                throw std::runtime_error("Input vector has the wrong number "
+                    "of bits");
+            }
+            uint64_t bit = uint64_t(1) << (lane % 64);
+            active.words[lane / 64] |= bit;
+            for (size_t i = 0; i < inputNum; ++i) {
+                if (vec[i]) {
+                    in[i].words[lane / 64] |= bit;
+                }
+            }
+        }
+        evaluate(in.data(), out.data(), active);
+        // transpose lanes back into vectors
+        for (size_t lane = 0; lane < num; ++lane) {
+            std::vector<bool> vec(outputNum);
+            for (size_t i = 0; i < outputNum; ++i) {
+                vec[i] = (out[i].words[lane / 64] >> (lane % 64)) & 1;
+            }
+            ret.push_back(std::move(vec));
+        }
+    }
+    return ret;
+}
+
+template <size_t Words>
+void BatchEvaluator<Words>::call(const Code& code, size_t base, Word mask)
+{
+    const std::vector<Instruction>& instructions = code.bytecode->getCode();
+    const BitStack& literals = code.bytecode->getLiterals();
+    const std::vector<size_t>& depths = code.depths;
+    // the stack grows down on every supported platform
+    char position;
+    if (uintptr_t(&position) < m_stackLimit) {
+        throw StackOverflow();
+    }
+    if (m_stack.size() < base + depths.back()) {
+        m_stack.resize(std::max(base + depths.back(), m_stack.size() * 2));
+    }
+    Word *s = &m_stack[base];
+    const Word entry = mask;
+    // When every lane is running, writes do not need to be masked
+    bool full = lanesEqual(mask, m_all);
+    auto write = [&](Word& dst, const Word& value) {
+        dst = full ? value : lanesBlend(dst, value, mask);
+    };
+    // moves are done forwards or backwards depending on their overlap
+    auto move = [&](size_t dst, size_t src, size_t num) {
+        if (dst < src) {
+            for (size_t i = 0; i < num; ++i) {
+                write(s[dst + i], s[src + i]);
+            }
+        } else if (dst > src) {
+            for (size_t i = num; i > 0; --i) {
+                write(s[dst + i - 1], s[src + i - 1]);
+            }
+        }
+    };
+    const Word zero = lanesFill<Words>(false);
+    const Word one = lanesFill<Words>(true);
+    for (size_t i = 0; i < code.outputs; ++i) {
+        write(s[code.inputs + i], zero);
+    }
+    // lanes waiting at other instructions
+    std::map<size_t, Word> pending;
+    auto wait = [&](size_t at, const Word& lanes) {
+        auto iter = pending.find(at);
+        if (iter == pending.end()) {
+            pending[at] = lanes;
+        } else {
+            iter->second = lanesOr(iter->second, lanes);
+        }
+    };
+    size_t pc = 0;
+    for (;;) {
+        if (!pending.empty() && pending.begin()->first <= pc) {
+            auto iter = pending.begin();
+            if (iter->first == pc) {
+                // join lanes that have reached the same instruction
+                mask = lanesOr(mask, iter->second);
+                pending.erase(iter);
+            } else {
+                // lanes at a lower instruction must run first
+                size_t next = iter->first;
+                Word nextMask = iter->second;
+                pending.erase(iter);
+                wait(pc, mask);
+                pc = next;
+                mask = nextMask;
+            }
+            full = lanesEqual(mask, m_all);
+        }
+        if (m_maxSteps != 0 && ++m_steps > m_maxSteps) {
+            throw std::runtime_error("Batch evaluation ran too many "
+                "instructions");
+        }
+        const Instruction& inst = instructions[pc];
+        size_t d = depths[pc];
+        ++pc;
+        switch (inst.op) {
+        case Opcode::PUSH:
+            write(s[d], inst.a ? one : zero);
+            break;
+        case Opcode::PUSH_ARRAY:
+            for (size_t i = 0; i < inst.b; ++i) {
+                write(s[d + i], literals.get(inst.a + i) ? one : zero);
+            }
+            break;
+        case Opcode::ALLOC:
+            for (size_t i = 0; i < inst.a; ++i) {
+                write(s[d + i], zero);
+            }
+            break;
+        case Opcode::LOAD:
+            write(s[d], s[inst.a]);
+            break;
+        case Opcode::LOAD_ARRAY:
+            move(d, inst.a, inst.b);
+            break;
+        case Opcode::STORE:
+            write(s[inst.a], s[d - 1]);
+            break;
+        case Opcode::STORE_ARRAY:
+            move(inst.a, d - inst.b, inst.b);
+            break;
+        case Opcode::DROP:
+            break;
+        case Opcode::TRUNCATE:
+            for (size_t i = d; i < inst.a; ++i) {
+                write(s[i], zero);
+            }
+            break;
+        case Opcode::NAND:
+            write(s[d - 2], lanesNand(s[d - 2], s[d - 1]));
+            break;
+        case Opcode::NAND_VARS:
+            write(s[d], lanesNand(s[inst.a], s[inst.b]));
+            break;
+        case Opcode::CALL: {
+            const Code& callee = *code.calls[inst.a];
+            call(callee, base + d - callee.inputs, mask);
+            // the stack may have been reallocated
+            s = &m_stack[base];
+            break;
+        }
+        case Opcode::JUMP:
+            pc = inst.a;
+            break;
+        case Opcode::JUMP_IF_ZERO: {
+            Word taken = lanesAndNot(mask, s[d - 1]);
+            if (!lanesAny(taken)) {
+                break;
+            }
+            Word fallthrough = lanesAnd(mask, s[d - 1]);
+            if (lanesAny(fallthrough)) {
+                // the lanes diverge
+                wait(inst.a, taken);
+                mask = fallthrough;
+                full = false;
+            } else {
+                pc = inst.a;
+            }
+            break;
+        }
+        case Opcode::INT_OP: {
+            // operations are done 64 lanes at a time
+            IntOp op = IntOp(inst.c);
+            size_t inputs = getIntOpInputs(op, inst.b);
+            size_t outputs = getIntOpOutputs(op, inst.b);
+            uint64_t operands[128];
+            uint64_t results[64];
+            Word value[64];
+            for (size_t w = 0; w < Words; ++w) {
+                for (size_t i = 0; i < inputs; ++i) {
+                    operands[i] = s[inst.a + i].words[w];
+                }
+                evalIntOpSliced(op, inst.b, operands, results);
+                for (size_t i = 0; i < outputs; ++i) {
+                    value[i].words[w] = results[i];
+                }
+            }
+            for (size_t i = 0; i < outputs; ++i) {
+                write(s[d + i], value[i]);
+            }
+            break;
+        }
+        case Opcode::TABLE: {
+            // entries are looked up one lane at a time
+            const TruthTable& table = code.bytecode->getTables()[inst.b];
+            Word value[64];
+            std::fill(value, value + table.outputs, zero);
+            for (size_t w = 0; w < Words; ++w) {
+                uint64_t lanes = mask.words[w];
+                while (lanes) {
+                    unsigned lane = __builtin_ctzll(lanes);
+                    lanes &= lanes - 1;
+                    size_t index = 0;
+                    for (size_t i = 0; i < table.inputs; ++i) {
+                        index = (index << 1)
+                              | ((s[inst.a + i].words[w] >> lane) & 1);
+                    }
+                    uint64_t entry = table.entries.getBits(
+                        index * table.outputs, table.outputs);
+                    for (size_t i = 0; i < table.outputs; ++i) {
+                        value[i].words[w] |= ((entry >> i) & 1) << lane;
+                    }
+                }
+            }
+            for (size_t i = 0; i < table.outputs; ++i) {
+                write(s[d + i], value[i]);
+            }
+            break;
+        }
+        case Opcode::FOR_BEGIN:
+            m_counters.push_back(0);
+            break;
+        case Opcode::FOR_LOAD:
+            move(d, inst.a + ptrdiff_t(inst.c) * m_counters.back(), inst.b);
+            break;
+        case Opcode::FOR_STORE:
+            move(inst.a + ptrdiff_t(inst.c) * m_counters.back(), d - inst.b,
+                inst.b);
+            break;
+        case Opcode::FOR_NEXT:
+            if (++m_counters.back() < inst.b) {
+                pc = inst.a;
+            } else {
+                m_counters.pop_back();
+            }
+            break;
+        case Opcode::RETURN:
+            if (pending.empty()) {
+                // every lane has returned
+                mask = entry;
+                full = lanesEqual(mask, m_all);
+                move(0, code.inputs, code.outputs);
+                return;
+            }
+            pc = pending.begin()->first;
+            mask = pending.begin()->second;
+            pending.erase(pending.begin());
+            full = lanesEqual(mask, m_all);
+            break;
+        }
+    }
+}
+
+template class BatchEvaluator<1>;
+template class BatchEvaluator<4>;
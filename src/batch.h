@@ -0,0 +1,84 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <map>
+
+class Function;
+class Bytecode;
+
+/// A set of lanes, one bit per lane. A batch evaluator stores every
+/// Nandlang bit as one of these, so that each lane holds an independent
+/// evaluation. Words is 1 for 64 lanes, or 4 for 256 lanes, which compilers
+/// can map onto AVX2 registers.
+template <size_t Words>
+struct Lanes {
+    uint64_t words[Words];
+};
+
+/// Evaluates a function over many independent inputs at once.
+/// The function is run from its bytecode, with NAND being a bitwise
+/// operation over whole words. Lanes that take different branches are
+/// tracked with masks: every group of lanes that is at the same instruction
+/// runs together, and the group at the lowest instruction always runs first,
+/// so that lanes join up again after a branch. Writes only affect the lanes
+/// that are running.
+/// Only functions that never call an external function, directly or
+/// indirectly, can be evaluated. Functions must be lowered into bytecode.
+template <size_t Words>
+class BatchEvaluator {
+public:
+    typedef Lanes<Words> Word;
+    /// Number of inputs that are evaluated at once
+    static const size_t laneCount = 64 * Words;
+    /// Throws an exception if the function can not be evaluated
+    BatchEvaluator(const Function& function);
+    /// Get number of input bits of the function
+    size_t getInputNum() const;
+    /// Get number of output bits of the function
+    size_t getOutputNum() const;
+    /// Throw an exception when a single evaluation runs more than maxSteps
+    /// instructions. 0 means no limit. Calls that are nested too deeply for
+    /// the native stack always throw StackOverflow.
+    void setLimits(size_t maxSteps);
+    /// Evaluate up to laneCount inputs. inputs holds one word per input bit,
+    /// and outputs receives one word per output bit. Only the lanes that are
+    /// set in active are evaluated.
+    void evaluate(const Word *inputs, Word *outputs, const Word& active);
+    /// Evaluate any number of input vectors, laneCount at a time. Each input
+    /// vector must have getInputNum() bits.
+    std::vector<std::vector<bool>> evaluate(
+        const std::vector<std::vector<bool>>& inputs);
+private:
+    struct Code {
+        const Bytecode *bytecode;
+        size_t inputs;
+        size_t outputs;
+        /// Stack depth before each instruction, and the maximum depth
+        std::vector<size_t> depths;
+        /// Code of the functions in the bytecode's call table
+        std::vector<const Code*> calls;
+    };
+    std::map<const Function*, Code> m_code;
+    const Code *m_root;
+    /// One word per bit for every frame
+    std::vector<Word> m_stack;
+    /// Iteration counters for for loops. Lanes in a loop always iterate
+    /// together, so one counter is enough for every lane.
+    std::vector<size_t> m_counters;
+    /// Every lane being evaluated
+    Word m_all;
+    size_t m_maxSteps;
+    /// Instructions run by the current evaluation
+    size_t m_steps;
+    /// Lowest address of the native stack that calls may reach, see
+    /// getStackLimit
+    uintptr_t m_stackLimit;
+    /// Find the code of a function and every function it calls
+    const Code& load(const Function& function);
+    /// Run a function whose frame starts at base for the given lanes
+    void call(const Code& code, size_t base, Word mask);
+};
+
+extern template class BatchEvaluator<1>;
+extern template class BatchEvaluator<4>;
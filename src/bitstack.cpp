@@ -0,0 +1,146 @@
+#include "bitstack.h"
+#include <algorithm>
+
+/// Get a mask of the lowest num bits. num must be at most 64.
+inline uint64_t lowMask(size_t num)
+{
+    return num >= 64 ? ~uint64_t(0) : (uint64_t(1) << num) - 1;
+}
+
+BitStack::BitStack()
+: m_size(0) {}
+
+BitStack::BitStack(const std::vector<bool>& bits)
+: m_size(0)
+{
+    reserveBits(bits.size());
+    for (bool b : bits) {
+        push(b);
+    }
+}
+
+BitStack::BitStack(std::vector<uint64_t>&& words, size_t size)
+: m_words(std::move(words)), m_size(size)
+{
+    reserveBits(size);
+}
+
+void BitStack::reserveBits(size_t bits)
+{
+    size_t words = (bits + 63) / 64;
+    if (words > m_words.size()) {
+        // grow geometrically so that pushes stay cheap
+        m_words.resize(std::max(words, m_words.size() * 2));
+    }
+}
+
+void BitStack::resize(size_t size)
+{
+    if (size > m_size) {
+        reserveBits(size);
+        fill(m_size, size - m_size, false);
+    }
+    m_size = size;
+}
+
+uint64_t BitStack::getBits(size_t pos, size_t num) const
+{
+    if (num == 0) {
+        return 0;
+    }
+    size_t word = pos / 64;
+    size_t offset = pos % 64;
+    uint64_t value = m_words[word] >> offset;
+    if (offset + num > 64) {
+        value |= m_words[word + 1] << (64 - offset);
+    }
+    return value & lowMask(num);
+}
+
+void BitStack::setBits(size_t pos, size_t num, uint64_t value)
+{
+    if (num == 0) {
+        return;
+    }
+    uint64_t mask = lowMask(num);
+    value &= mask;
+    size_t word = pos / 64;
+    size_t offset = pos % 64;
+    m_words[word] = (m_words[word] & ~(mask << offset)) | (value << offset);
+    if (offset + num > 64) {
+        // the rest of the bits go to the start of the next word
+        size_t shift = 64 - offset;
+        m_words[word + 1] = (m_words[word + 1] & ~(mask >> shift))
+                          | (value >> shift);
+    }
+}
+
+void BitStack::pushBits(uint64_t value, size_t num)
+{
+    size_t dst = m_size;
+    reserveBits(m_size + num);
+    m_size += num;
+    setBits(dst, num, value);
+}
+
+void BitStack::pushRange(size_t pos, size_t num)
+{
+    size_t dst = m_size;
+    reserveBits(m_size + num);
+    m_size += num;
+    // The source is always below the destination, so there is no overlap
+    copy(dst, pos, num);
+}
+
+void BitStack::pushRange(const BitStack& other, size_t pos, size_t num)
+{
+    size_t dst = m_size;
+    reserveBits(m_size + num);
+    m_size += num;
+    for (size_t i = 0; i < num; i += 64) {
+        size_t n = std::min<size_t>(64, num - i);
+        setBits(dst + i, n, other.getBits(pos + i, n));
+    }
+}
+
+void BitStack::popRange(size_t pos, size_t num)
+{
+    m_size -= num;
+    copy(pos, m_size, num);
+}
+
+void BitStack::copy(size_t dst, size_t src, size_t num)
+{
+    if (dst == src || num == 0) {
+        return;
+    }
+    if (dst < src) {
+        // copy forwards
+        for (size_t i = 0; i < num; i += 64) {
+            size_t n = std::min<size_t>(64, num - i);
+            setBits(dst + i, n, getBits(src + i, n));
+        }
+    } else {
+        // copy backwards, so that overlapping bits are read before they are
+        // overwritten
+        size_t i = num;
+        while (i > 0) {
+            size_t n = std::min<size_t>(64, i);
+            i -= n;
+            setBits(dst + i, n, getBits(src + i, n));
+        }
+    }
+}
+
+void BitStack::fill(size_t pos, size_t num, bool value)
+{
+    uint64_t bits = value ? ~uint64_t(0) : 0;
+    for (size_t i = 0; i < num; i += 64) {
+        setBits(pos + i, std::min<size_t>(64, num - i), bits);
+    }
+}
+
+const std::vector<uint64_t>& BitStack::getWords() const
+{
+    return m_words;
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/// A stack of bits, packed into 64-bit words.
+/// Bit i is stored in word i/64, at bit position i%64. Ranges of bits can be
+/// moved around a whole word at a time.
+class BitStack {
+    std::vector<uint64_t> m_words;
+    size_t m_size;
+    /// Make sure that there is room for the given number of bits
+    void reserveBits(size_t bits);
+public:
+    BitStack();
+    /// Create a stack from the given bits, in push order
+    BitStack(const std::vector<bool>& bits);
+    /// Create a stack of size bits from words, laid out as getWords() is
+    BitStack(std::vector<uint64_t>&& words, size_t size);
+    /// Get number of bits
+    size_t size() const;
+    /// Resize the stack. New bits are set to 0.
+    void resize(size_t size);
+    /// Push a bit
+    void push(bool value);
+    /// Pop a bit
+    bool pop();
+    /// Get a bit
+    bool get(size_t pos) const;
+    /// Set a bit
+    void set(size_t pos, bool value);
+    /// Read up to 64 bits starting at pos. The first bit is the lowest bit of
+    /// the returned value.
+    uint64_t getBits(size_t pos, size_t num) const;
+    /// Write up to 64 bits starting at pos. The lowest bit of value is written
+    /// to pos.
+    void setBits(size_t pos, size_t num, uint64_t value);
+    /// Push up to 64 bits. The lowest bit of value is pushed first.
+    void pushBits(uint64_t value, size_t num);
+    /// Push num bits, copied from this stack starting at pos
+    void pushRange(size_t pos, size_t num);
+    /// Push num bits, copied from another stack starting at pos
+    void pushRange(const BitStack& other, size_t pos, size_t num);
+    /// Pop num bits into this stack starting at pos. The last popped bit goes
+    /// to pos, so that the bits keep the order that they were pushed in.
+    void popRange(size_t pos, size_t num);
+    /// Copy num bits from src to dst. The ranges may overlap.
+    void copy(size_t dst, size_t src, size_t num);
+    /// Set num bits starting at pos to the given value
+    void fill(size_t pos, size_t num, bool value);
+    /// Get the words that the bits are packed into. There may be more words
+    /// than the bits need.
+    const std::vector<uint64_t>& getWords() const;
+};
+
+/// Reverse the order of the lowest num bits of value. num must be between 1
+/// and 64.
+inline uint64_t reverseBits(uint64_t value, size_t num)
+{
+    // swap neighbouring bits, pairs and nibbles, and then the bytes
+    const uint64_t masks[] = {
+        0x5555555555555555, 0x3333333333333333, 0x0F0F0F0F0F0F0F0F
+    };
+    for (size_t i = 0; i < 3; ++i) {
+        size_t shift = size_t(1) << i;
+        value = ((value >> shift) & masks[i]) | ((value & masks[i]) << shift);
+    }
+    value = __builtin_bswap64(value);
+    return value >> (64 - num);
+}
+
+inline size_t BitStack::size() const
+{
+    return m_size;
+}
+
+inline void BitStack::push(bool value)
+{
+    if (m_size == m_words.size() * 64) {
+        reserveBits(m_size + 1);
+    }
+    set(m_size, value);
+    ++m_size;
+}
+
+inline bool BitStack::pop()
+{
+    --m_size;
+    return get(m_size);
+}
+
+inline bool BitStack::get(size_t pos) const
+{
+    return (m_words[pos / 64] >> (pos % 64)) & 1;
+}
+
+inline void BitStack::set(size_t pos, bool value)
+{
+    uint64_t& word = m_words[pos / 64];
+    uint64_t mask = uint64_t(1) << (pos % 64);
+    word = (word & ~mask) | (uint64_t(value) << (pos % 64));
+}
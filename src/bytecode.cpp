@@ -0,0 +1,382 @@
+#include "bytecode.h"
+#include "state.h"
+#include "idiom.h"
+#include <limits>
+#include <stdexcept>
+#include <algorithm>
+#include <sstream>
+
+/// Make sure that the given operand fits into an instruction
+uint32_t toOperand(size_t value)
+{
+    if (value > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("Bytecode operand is too large");
+    }
+    return uint32_t(value);
+}
+
+void Bytecode::execute(State& state) const
+{
+    if (state.isChecked()) {
+        run<true>(state);
+    } else {
+        run<false>(state);
+    }
+}
+
+void Bytecode::checkEnds(const State& state, size_t index) const
+{
+    auto iter = std::lower_bound(m_ends.begin(), m_ends.end(), index,
+        [](const StatementEnd& end, size_t index) {
+            return end.index < index;
+        });
+    size_t depth = state.size() - state.getVarOffset();
+    for (; iter != m_ends.end() && iter->index == index; ++iter) {
+        if (depth != iter->depth) {
+            std::stringstream s;
+            s << "Statement left the stack at depth " << depth
+              << " instead of " << iter->depth;
+            throwError(iter->info, s.str());
+        }
+    }
+}
+
+template <bool checked>
+void Bytecode::run(State& state) const
+{
+    const Instruction *code = m_code.data();
+    const Instruction *ip = code;
+    for (;;) {
+        if (checked) {
+            checkEnds(state, ip - code);
+        }
+        const Instruction& inst = *ip++;
+        switch (inst.op) {
+        case Opcode::PUSH:
+            state.push(inst.a);
+            break;
+        case Opcode::PUSH_ARRAY:
+            state.pushBits(m_literals, inst.a, inst.b);
+            break;
+        case Opcode::ALLOC:
+            state.resize(state.size() + inst.a);
+            break;
+        case Opcode::LOAD:
+            state.push(state.getVar(inst.a));
+            break;
+        case Opcode::LOAD_ARRAY:
+            state.pushVars(inst.a, inst.b);
+            break;
+        case Opcode::STORE:
+            state.setVar(inst.a, state.pop());
+            break;
+        case Opcode::STORE_ARRAY:
+            state.popVars(inst.a, inst.b);
+            break;
+        case Opcode::DROP:
+            state.resize(state.size() - inst.a);
+            break;
+        case Opcode::NAND: {
+            bool right = state.pop();
+            bool left = state.pop();
+            state.push(!(left && right));
+            break;
+        }
+        case Opcode::NAND_VARS:
+            state.push(!(state.getVar(inst.a) && state.getVar(inst.b)));
+            break;
+        case Opcode::CALL:
+            m_calls[inst.a]->call(state);
+            break;
+        case Opcode::JUMP:
+            ip = code + inst.a;
+            break;
+        case Opcode::JUMP_IF_ZERO:
+            if (!state.pop()) {
+                ip = code + inst.a;
+            }
+            break;
+        case Opcode::TRUNCATE:
+            state.resize(state.getVarOffset() + inst.a);
+            break;
+        case Opcode::FOR_BEGIN:
+            state.pushCounter();
+            break;
+        case Opcode::FOR_LOAD:
+            state.pushVars(inst.a + ptrdiff_t(inst.c) * state.getCounter(),
+                inst.b);
+            break;
+        case Opcode::FOR_STORE:
+            state.popVars(inst.a + ptrdiff_t(inst.c) * state.getCounter(),
+                inst.b);
+            break;
+        case Opcode::FOR_NEXT:
+            if (++state.getCounter() < inst.b) {
+                ip = code + inst.a;
+            } else {
+                state.popCounter();
+            }
+            break;
+        case Opcode::INT_OP: {
+            IntOp op = IntOp(inst.c);
+            uint64_t a = state.getVarInt(inst.a, inst.b);
+            uint64_t b = op == IntOp::NEG ? 0
+                : state.getVarInt(inst.a + inst.b, inst.b);
+            state.pushInt(evalIntOp(op, a, b, inst.b),
+                getIntOpOutputs(op, inst.b));
+            break;
+        }
+        case Opcode::TABLE: {
+            const TruthTable& table = m_tables[inst.b];
+            size_t index = state.getVarInt(inst.a, table.inputs);
+            state.pushBits(table.entries, index * table.outputs,
+                table.outputs);
+            break;
+        }
+        case Opcode::RETURN:
+            return;
+        }
+    }
+}
+
+Bytecode::Bytecode(std::vector<Instruction>&& code, BitStack&& literals,
+    std::vector<TruthTable>&& tables, std::vector<const Function*>&& calls)
+: m_code(std::move(code)), m_literals(std::move(literals))
+, m_tables(std::move(tables)), m_calls(std::move(calls)) {}
+
+size_t Bytecode::size() const
+{
+    return m_code.size();
+}
+
+const std::vector<Instruction>& Bytecode::getCode() const
+{
+    return m_code;
+}
+
+const BitStack& Bytecode::getLiterals() const
+{
+    return m_literals;
+}
+
+const std::vector<const Function*>& Bytecode::getCalls() const
+{
+    return m_calls;
+}
+
+const std::vector<TruthTable>& Bytecode::getTables() const
+{
+    return m_tables;
+}
+
+std::vector<size_t> Bytecode::getDepths(size_t depth) const
+{
+    // Depths of jump targets, since code after an unconditional jump can only
+    // be reached by jumping to it.
+    std::map<size_t, size_t> targets;
+    std::vector<size_t> depths;
+    depths.reserve(m_code.size() + 1);
+    size_t max = depth;
+    for (size_t i = 0; i < m_code.size(); ++i) {
+        auto iter = targets.find(i);
+        if (iter != targets.end()) {
+            depth = iter->second;
+        }
+        const Instruction& inst = m_code[i];
+        depths.push_back(depth);
+        depth = applyStackEffect(inst, depth, m_calls, m_tables);
+        max = std::max(max, depth);
+        switch (inst.op) {
+        case Opcode::JUMP:
+        case Opcode::JUMP_IF_ZERO:
+        case Opcode::FOR_NEXT:
+            targets[inst.a] = depth;
+            break;
+        default:
+            break;
+        }
+    }
+    depths.push_back(max);
+    return depths;
+}
+
+size_t applyStackEffect(const Instruction& inst, size_t depth,
+    const std::vector<const Function*>& calls,
+    const std::vector<TruthTable>& tables)
+{
+    switch (inst.op) {
+    case Opcode::PUSH:
+    case Opcode::LOAD:
+    case Opcode::NAND_VARS:
+        return depth + 1;
+    case Opcode::PUSH_ARRAY:
+    case Opcode::LOAD_ARRAY:
+    case Opcode::FOR_LOAD:
+        return depth + inst.b;
+    case Opcode::ALLOC:
+        return depth + inst.a;
+    case Opcode::STORE:
+    case Opcode::NAND:
+    case Opcode::JUMP_IF_ZERO:
+        return depth - 1;
+    case Opcode::STORE_ARRAY:
+    case Opcode::FOR_STORE:
+        return depth - inst.b;
+    case Opcode::DROP:
+        return depth - inst.a;
+    case Opcode::INT_OP:
+        return depth + getIntOpOutputs(IntOp(inst.c), inst.b);
+    case Opcode::TABLE:
+        return depth + tables[inst.b].outputs;
+    case Opcode::TRUNCATE:
+        return inst.a;
+    case Opcode::CALL: {
+        const Function *func = calls[inst.a];
+        return depth - func->getInputNum() + func->getOutputNum();
+    }
+    case Opcode::JUMP:
+    case Opcode::FOR_BEGIN:
+    case Opcode::FOR_NEXT:
+    case Opcode::RETURN:
+        break;
+    }
+    return depth;
+}
+
+BytecodeBuilder::BytecodeBuilder(const State& state, size_t depth)
+: m_state(state), m_depth(depth), m_barrier(0) {}
+
+const State& BytecodeBuilder::getState() const
+{
+    return m_state;
+}
+
+size_t BytecodeBuilder::emit(Opcode op, size_t a, size_t b, ptrdiff_t c)
+{
+    auto& code = m_bytecode.m_code;
+    // Combine NANDs of two variables into a single instruction. This is only
+    // done when no jump can land in between the loads.
+    if (op == Opcode::NAND && code.size() >= m_barrier + 2
+        && code[code.size()-1].op == Opcode::LOAD
+        && code[code.size()-2].op == Opcode::LOAD) {
+        Instruction& left = code[code.size()-2];
+        left.op = Opcode::NAND_VARS;
+        left.b = code.back().a;
+        code.pop_back();
+        m_depth -= 1;
+        return code.size() - 1;
+    }
+    if (c < std::numeric_limits<int32_t>::min()
+     || c > std::numeric_limits<int32_t>::max()) {
+        throw std::runtime_error("Bytecode operand is too large");
+    }
+    code.push_back({op, toOperand(a), toOperand(b), int32_t(c)});
+    m_depth = applyStackEffect(code.back(), m_depth, m_bytecode.m_calls,
+        m_bytecode.m_tables);
+    return code.size() - 1;
+}
+
+void BytecodeBuilder::emitCall(const Function& function)
+{
+    auto iter = m_callIndices.find(&function);
+    size_t index;
+    if (iter == m_callIndices.end()) {
+        index = m_bytecode.m_calls.size();
+        m_bytecode.m_calls.push_back(&function);
+        m_callIndices[&function] = index;
+    } else {
+        index = iter->second;
+    }
+    emit(Opcode::CALL, index);
+}
+
+void BytecodeBuilder::emitLiterals(const BitStack& values)
+{
+    if (values.size() == 1) {
+        emit(Opcode::PUSH, values.get(0));
+    } else {
+        auto& literals = m_bytecode.m_literals;
+        size_t pos = literals.size();
+        literals.pushRange(values, 0, values.size());
+        emit(Opcode::PUSH_ARRAY, pos, values.size());
+    }
+}
+
+void BytecodeBuilder::emitTable(TruthTable&& table, size_t pos)
+{
+    size_t index = m_bytecode.m_tables.size();
+    m_bytecode.m_tables.push_back(std::move(table));
+    emit(Opcode::TABLE, pos, index);
+}
+
+void BytecodeBuilder::emitStores(const std::vector<size_t>& variables)
+{
+    // Values are popped in reverse order. Runs of ignored values become a
+    // single DROP, and runs of consecutive positions become a STORE_ARRAY.
+    auto iter = variables.rbegin();
+    while (iter != variables.rend()) {
+        size_t pos = *iter;
+        size_t count = 1;
+        ++iter;
+        if (pos == ignorePosition) {
+            while (iter != variables.rend() && *iter == ignorePosition) {
+                ++count;
+                ++iter;
+            }
+            emit(Opcode::DROP, count);
+        } else {
+            while (iter != variables.rend() && *iter != ignorePosition
+                && *iter + 1 == pos) {
+                pos = *iter;
+                ++count;
+                ++iter;
+            }
+            if (count == 1) {
+                emit(Opcode::STORE, pos);
+            } else {
+                emit(Opcode::STORE_ARRAY, pos, count);
+            }
+        }
+    }
+}
+
+void BytecodeBuilder::emitTruncate(size_t depth)
+{
+    if (m_depth != depth) {
+        emit(Opcode::TRUNCATE, depth);
+    }
+}
+
+void BytecodeBuilder::endStatement(size_t depth, const DebugInfo& info)
+{
+    m_bytecode.m_ends.push_back({here(), depth, info});
+}
+
+void BytecodeBuilder::patch(size_t index, size_t target)
+{
+    m_bytecode.m_code[index].a = toOperand(target);
+}
+
+size_t BytecodeBuilder::here()
+{
+    // Anything may jump here, so instructions before this point can not be
+    // combined with instructions after it.
+    m_barrier = m_bytecode.m_code.size();
+    return m_barrier;
+}
+
+size_t BytecodeBuilder::getDepth() const
+{
+    return m_depth;
+}
+
+void BytecodeBuilder::setDepth(size_t depth)
+{
+    m_depth = depth;
+}
+
+Bytecode BytecodeBuilder::finish()
+{
+    emit(Opcode::RETURN);
+    return std::move(m_bytecode);
+}
@@ -0,0 +1,168 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <map>
+#include "bitstack.h"
+#include "debug.h"
+
+class State;
+class Function;
+
+/// Bytecode operation codes.
+/// Every instruction has up to three operands: a, b, and c. Positions are
+/// relative to the variable offset of the function being executed.
+enum class Opcode : uint8_t {
+    PUSH,         // push the literal bit a
+    PUSH_ARRAY,   // push b bits from the literal pool, starting at a
+    ALLOC,        // push a zero bits
+    LOAD,         // push the variable at a
+    LOAD_ARRAY,   // push b variables, starting at a
+    STORE,        // pop a value into the variable at a
+    STORE_ARRAY,  // pop b values into the variables a+b-1 down to a
+    DROP,         // pop a values and discard them
+    NAND,         // pop two values and push their NAND
+    NAND_VARS,    // push the NAND of the variables at a and b
+    CALL,         // call the function at index a of the call table
+    JUMP,         // jump to instruction a
+    JUMP_IF_ZERO, // pop a value, and jump to instruction a if it is 0
+    TRUNCATE,     // resize the stack to have a values past the variable offset
+    FOR_BEGIN,    // start a new for loop counter at 0
+    FOR_LOAD,     // push b variables, starting at a + c*counter
+    FOR_STORE,    // pop b values into the variables a + c*counter + b-1 down
+                  // to a + c*counter
+    FOR_NEXT,     // increment the counter, jump to a if it is less than b,
+                  // otherwise the counter is removed.
+    INT_OP,       // apply the IntOp c to the b bit integers in the variables
+                  // starting at a, and push the result
+    TABLE,        // look up the variables starting at a in truth table b, and
+                  // push the entry
+    RETURN        // stop executing
+};
+
+/// A single bytecode instruction
+struct Instruction {
+    Opcode op;
+    uint32_t a;
+    uint32_t b;
+    int32_t c;
+};
+
+/// The outputs of a function for every value of its inputs
+struct TruthTable {
+    /// Number of input bits, which index the table most significant bit
+    /// first
+    size_t inputs;
+    /// Number of output bits in each entry
+    size_t outputs;
+    /// Entries in order of their index, with the bits of each entry in the
+    /// order that they are pushed
+    BitStack entries;
+};
+
+/// The end of a statement, where checked mode checks the stack
+struct StatementEnd {
+    /// Index of the instruction that follows the statement
+    size_t index;
+    /// Stack depth past the variable offset once the statement has finished
+    size_t depth;
+    /// Location of the statement, for errors
+    DebugInfo info;
+};
+
+/// A compiled, linear representation of a function body.
+class Bytecode {
+    friend class BytecodeBuilder;
+    std::vector<Instruction> m_code;
+    /// Literal bits, stored in the order that they are pushed
+    BitStack m_literals;
+    /// Truth tables that are looked up by this bytecode
+    std::vector<TruthTable> m_tables;
+    /// Functions called by this bytecode
+    std::vector<const Function*> m_calls;
+    /// Ends of the statements that this bytecode was lowered from, in order
+    /// of their index. Bytecode that was not lowered from statements has
+    /// none.
+    std::vector<StatementEnd> m_ends;
+    /// Run the instructions, checking the stack at the end of every statement
+    /// if checked is true
+    template <bool checked>
+    void run(State& state) const;
+    /// Throw an exception if the stack is not as it should be after the
+    /// statements that end before the instruction at index
+    void checkEnds(const State& state, size_t index) const;
+public:
+    Bytecode() = default;
+    /// Create bytecode from its parts, e.g. when loading a compiled program
+    Bytecode(std::vector<Instruction>&& code, BitStack&& literals,
+        std::vector<TruthTable>&& tables,
+        std::vector<const Function*>&& calls);
+    /// Execute this bytecode. The stack frame must already be set up, the same
+    /// as it would be for the function's statements. In checked mode, the
+    /// stack is checked at the end of every statement.
+    void execute(State& state) const;
+    /// Get the number of instructions
+    size_t size() const;
+    /// Get the instructions
+    const std::vector<Instruction>& getCode() const;
+    /// Get the literal pool
+    const BitStack& getLiterals() const;
+    /// Get the functions that are called by this bytecode
+    const std::vector<const Function*>& getCalls() const;
+    /// Get the truth tables
+    const std::vector<TruthTable>& getTables() const;
+    /// Calculate the stack depth before each instruction, given the depth at
+    /// the start of the function. The last element is the maximum depth.
+    std::vector<size_t> getDepths(size_t depth) const;
+};
+
+/// Get the stack depth after the given instruction is executed
+size_t applyStackEffect(const Instruction& inst, size_t depth,
+    const std::vector<const Function*>& calls,
+    const std::vector<TruthTable>& tables);
+
+/// Lowers statements and expressions into Bytecode.
+/// Keeps track of the stack depth past the variable offset, so that blocks can
+/// restore the stack to the size that they started with.
+class BytecodeBuilder {
+    const State& m_state;
+    Bytecode m_bytecode;
+    std::map<const Function*, size_t> m_callIndices;
+    size_t m_depth;
+    /// Instructions before this index may be jumped over
+    size_t m_barrier;
+public:
+    /// The initial depth is the number of variables in the function's frame
+    /// when it begins, i.e. its inputs and outputs.
+    BytecodeBuilder(const State& state, size_t depth);
+    /// Get the execution state that functions are looked up in
+    const State& getState() const;
+    /// Append an instruction. Returns the instruction's index.
+    size_t emit(Opcode op, size_t a = 0, size_t b = 0, ptrdiff_t c = 0);
+    /// Emit a call to the given function
+    void emitCall(const Function& function);
+    /// Emit literal bits, in the order that they should be pushed.
+    void emitLiterals(const BitStack& values);
+    /// Emit a lookup into the given table, indexed by the variables starting
+    /// at pos
+    void emitTable(TruthTable&& table, size_t pos);
+    /// Emit stores into the given variables, popping values from the stack in
+    /// reverse order. Ignored positions are dropped.
+    void emitStores(const std::vector<size_t>& variables);
+    /// Emit an instruction to restore the stack depth, if it is required.
+    void emitTruncate(size_t depth);
+    /// Mark the end of a statement, where checked mode checks that the stack
+    /// has the given depth
+    void endStatement(size_t depth, const DebugInfo& info);
+    /// Set the jump target of the instruction at the given index
+    void patch(size_t index, size_t target);
+    /// Get the index that the next instruction will be placed at, for use as
+    /// a jump target.
+    size_t here();
+    /// Get the current stack depth
+    size_t getDepth() const;
+    /// Set the current stack depth, e.g. when starting an else block.
+    void setDepth(size_t depth);
+    /// Finish building
+    Bytecode finish();
+};
@@ -0,0 +1,552 @@
+#include "cache.h"
+#include "idiom.h"
+#include "state.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <set>
+#include <sstream>
+#include <thread>
+#if defined(_WIN32)
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+namespace {
+
+/// Version of the format of the files. This is only bumped when the format
+/// changes; changes to how programs are compiled are covered by getBuildId.
+const char *cacheFormat = "Nandlang v1.2, cache format 2";
+
+/// First bytes of every file
+const char fileMagic[8] = {'N', 'A', 'N', 'D', 'C', '\0', '\0', '2'};
+
+/// Start of a file
+struct FileHeader {
+    char magic[8];
+    uint64_t key;
+    /// Checksum of everything that follows the header, see hashPayload, so
+    /// that files that were cut short or damaged are not loaded
+    uint64_t checksum;
+    /// Size of an instruction, which is stored as it is in memory
+    uint64_t instructionSize;
+    uint64_t functionCount;
+};
+
+/// Kinds of function
+enum class FunctionKind : uint32_t {
+    EXTERNAL, INTERNAL
+};
+
+/// Start of every function. Internal functions are followed by their name
+/// and then their bytecode; external functions only by their name, as they
+/// are looked up in the state that the program is loaded into.
+struct FunctionHeader {
+    FunctionKind kind;
+    ConstantLevel constant;
+    uint64_t nameLength;
+    uint64_t inputs;
+    uint64_t outputs;
+    uint64_t frameSize;
+    uint64_t codeSize;
+    uint64_t literalBits;
+    uint64_t tableCount;
+    uint64_t callCount;
+};
+
+/// Start of every truth table, followed by its entries
+struct TableHeader {
+    uint64_t inputs;
+    uint64_t outputs;
+    uint64_t bits;
+};
+
+/// Hash bytes with 64-bit FNV-1a, continuing from hash
+uint64_t hashBytes(uint64_t hash, const char *data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= uint8_t(data[i]);
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+/// Hash the part of a file that follows its header. Everything in a file is
+/// padded to 8 bytes, so it is hashed a word at a time; a file that was cut
+/// off part way through a word has its last bytes padded with zeros.
+uint64_t hashPayload(const char *data, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325 ^ size;
+    for (size_t i = 0; i < size; i += 8) {
+        uint64_t word = 0;
+        std::memcpy(&word, data + i, std::min<size_t>(8, size - i));
+        hash = (hash ^ word) * 0x100000001b3;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+/// Appends values to a file in memory. Everything is padded to 8 bytes.
+class Writer {
+    std::string m_data;
+public:
+    void write(const void *data, size_t size)
+    {
+        if (size == 0) {
+            return;
+        }
+        m_data.append(static_cast<const char*>(data), size);
+        m_data.append((8 - size % 8) % 8, '\0');
+    }
+
+    template <class T>
+    void write(const T& value)
+    {
+        write(&value, sizeof(T));
+    }
+
+    void writeBits(const BitStack& bits)
+    {
+        write(bits.getWords().data(), (bits.size() + 63) / 64 * 8);
+    }
+
+    std::string& getData()
+    {
+        return m_data;
+    }
+};
+
+/// Reads the values that a Writer wrote. Returns false once it runs past the
+/// end of the file.
+class Reader {
+    const char *m_pos;
+    const char *m_end;
+public:
+    Reader(const char *data, size_t size)
+    : m_pos(data), m_end(data + size) {}
+
+    bool read(void *data, size_t size)
+    {
+        size_t padded = size + (8 - size % 8) % 8;
+        if (padded > size_t(m_end - m_pos)) {
+            return false;
+        }
+        if (size > 0) {
+            std::memcpy(data, m_pos, size);
+        }
+        m_pos += padded;
+        return true;
+    }
+
+    template <class T>
+    bool read(T& value)
+    {
+        return read(&value, sizeof(T));
+    }
+
+    bool readBits(BitStack& bits, size_t size)
+    {
+        if (size / 8 > size_t(m_end - m_pos)) {
+            return false;
+        }
+        std::vector<uint64_t> words((size + 63) / 64);
+        if (!read(words.data(), words.size() * 8)) {
+            return false;
+        }
+        bits = BitStack(std::move(words), size);
+        return true;
+    }
+
+    /// Make sure that count values of the given size could still be read, so
+    /// that damaged files do not make huge allocations
+    bool has(uint64_t count, size_t size) const
+    {
+        return count <= size_t(m_end - m_pos) / size;
+    }
+};
+
+/// A function that has been read, but not yet added to the state
+struct LoadedFunction {
+    std::string name;
+    FunctionHeader header;
+    std::vector<Instruction> code;
+    BitStack literals;
+    std::vector<TruthTable> tables;
+    /// Indices of the functions that the bytecode calls
+    std::vector<uint64_t> calls;
+    FunctionPtr function;
+};
+
+/// Check that a truth table has an entry for every value of its inputs
+bool checkTable(const TruthTable& table)
+{
+    if (table.inputs >= 64) {
+        return false;
+    }
+    uint64_t count = uint64_t(1) << table.inputs;
+    if (table.outputs == 0) {
+        return table.entries.size() == 0;
+    }
+    return table.entries.size() % table.outputs == 0
+        && table.entries.size() / table.outputs == count;
+}
+
+/// Check that the operands of every instruction refer to something that
+/// exists: an opcode, a call, a jump target, literals, a truth table or an
+/// integer operation
+bool checkCode(const LoadedFunction& loaded)
+{
+    const std::vector<Instruction>& code = loaded.code;
+    for (const Instruction& inst : code) {
+        switch (inst.op) {
+        case Opcode::PUSH:
+            if (inst.a > 1) {
+                return false;
+            }
+            break;
+        case Opcode::PUSH_ARRAY:
+            if (inst.a > loaded.literals.size()
+             || inst.b > loaded.literals.size() - inst.a) {
+                return false;
+            }
+            break;
+        case Opcode::CALL:
+            if (inst.a >= loaded.calls.size()) {
+                return false;
+            }
+            break;
+        case Opcode::JUMP:
+        case Opcode::JUMP_IF_ZERO:
+        case Opcode::FOR_NEXT:
+            if (inst.a >= code.size()) {
+                return false;
+            }
+            break;
+        case Opcode::INT_OP:
+            if (inst.c < 0 || inst.c > int32_t(IntOp::GE) || inst.b == 0
+             || inst.b > 64) {
+                return false;
+            }
+            break;
+        case Opcode::TABLE:
+            if (inst.b >= loaded.tables.size()) {
+                return false;
+            }
+            break;
+        case Opcode::ALLOC:
+        case Opcode::LOAD:
+        case Opcode::LOAD_ARRAY:
+        case Opcode::STORE:
+        case Opcode::STORE_ARRAY:
+        case Opcode::DROP:
+        case Opcode::NAND:
+        case Opcode::NAND_VARS:
+        case Opcode::TRUNCATE:
+        case Opcode::FOR_BEGIN:
+        case Opcode::FOR_LOAD:
+        case Opcode::FOR_STORE:
+        case Opcode::RETURN:
+            break;
+        default:
+            // not an opcode at all
+            return false;
+        }
+    }
+    // the code must not run off its end
+    return !code.empty() && code.back().op == Opcode::RETURN;
+}
+
+/// Read a function, other than the functions that its bytecode calls
+bool readFunction(Reader& reader, LoadedFunction& loaded,
+    uint64_t functionCount)
+{
+    FunctionHeader& header = loaded.header;
+    if (!reader.read(header) || !reader.has(header.nameLength, 1)) {
+        return false;
+    }
+    loaded.name.resize(header.nameLength);
+    if (!reader.read(&loaded.name[0], header.nameLength)) {
+        return false;
+    }
+    if (header.kind == FunctionKind::EXTERNAL) {
+        return true;
+    }
+    if (header.kind != FunctionKind::INTERNAL
+     || !reader.has(header.codeSize, sizeof(Instruction))) {
+        return false;
+    }
+    loaded.code.resize(header.codeSize);
+    if (!reader.read(loaded.code.data(),
+            loaded.code.size() * sizeof(Instruction))
+     || !reader.readBits(loaded.literals, header.literalBits)
+     || !reader.has(header.tableCount, sizeof(TableHeader))) {
+        return false;
+    }
+    loaded.tables.resize(header.tableCount);
+    for (TruthTable& table : loaded.tables) {
+        TableHeader tableHeader;
+        if (!reader.read(tableHeader)
+         || !reader.readBits(table.entries, tableHeader.bits)) {
+            return false;
+        }
+        table.inputs = tableHeader.inputs;
+        table.outputs = tableHeader.outputs;
+        if (!checkTable(table)) {
+            return false;
+        }
+    }
+    if (!reader.has(header.callCount, sizeof(uint64_t))) {
+        return false;
+    }
+    loaded.calls.resize(header.callCount);
+    if (!reader.read(loaded.calls.data(), loaded.calls.size() * 8)) {
+        return false;
+    }
+    for (uint64_t index : loaded.calls) {
+        if (index >= functionCount) {
+            return false;
+        }
+    }
+    return checkCode(loaded);
+}
+
+/// Get something that tells this build of the compiler apart from every
+/// other, so that programs compiled by other builds are never loaded, or an
+/// empty string if there is nothing that does.
+/// SCons passes the hash of every source of the compiler. Otherwise, the
+/// executable is told apart by its size, inode and modification time, which
+/// change whenever it is rebuilt.
+std::string findBuildId()
+{
+#if defined(NANDLANG_SOURCE_HASH)
+    return std::string("sources ") + NANDLANG_SOURCE_HASH;
+#elif defined(__linux__)
+    struct stat info;
+    if (stat("/proc/self/exe", &info) != 0) {
+        return "";
+    }
+    std::stringstream s;
+    s << "executable " << info.st_dev << " " << info.st_ino << " "
+      << info.st_size << " " << info.st_mtim.tv_sec << "."
+      << info.st_mtim.tv_nsec;
+    return s.str();
+#else
+    return "";
+#endif
+}
+
+const std::string& getBuildId()
+{
+    static const std::string id = findBuildId();
+    return id;
+}
+
+/// Characters that separate the directories of a path
+#if defined(_WIN32)
+const char *pathSeparators = "/\\";
+#else
+const char *pathSeparators = "/";
+#endif
+
+/// Make a directory, if it does not exist yet. Returns false on failure.
+bool makeDirectory(const std::string& path)
+{
+#if defined(_WIN32)
+    int ret = _mkdir(path.c_str());
+#else
+    int ret = mkdir(path.c_str(), 0777);
+#endif
+    return ret == 0 || errno == EEXIST;
+}
+
+/// Make a directory and every directory above it that does not exist yet
+bool makeDirectories(const std::string& path)
+{
+    size_t pos = path.find_first_of(pathSeparators, 1);
+    while (pos != std::string::npos) {
+        makeDirectory(path.substr(0, pos));
+        pos = path.find_first_of(pathSeparators, pos + 1);
+    }
+    return makeDirectory(path);
+}
+
+} // namespace
+
+bool isCacheSupported()
+{
+    return !getBuildId().empty();
+}
+
+uint64_t getCacheKey(const SourceFile& source, const std::string& options)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    // lengths are hashed as well, so that the parts can not run together
+    for (const std::string& part :
+            {std::string(cacheFormat), getBuildId(), options}) {
+        uint64_t size = part.size();
+        hash = hashBytes(hash, reinterpret_cast<const char*>(&size), 8);
+        hash = hashBytes(hash, part.data(), part.size());
+    }
+    return hashBytes(hash, source.data(), source.size());
+}
+
+std::string getCachePath(const std::string& directory, uint64_t key)
+{
+    std::stringstream s;
+    s << directory << "/" << std::hex << std::setw(16) << std::setfill('0')
+      << key << ".nandc";
+    return s.str();
+}
+
+bool saveProgram(const State& state, const std::string& path, uint64_t key)
+{
+    size_t slash = path.find_last_of(pathSeparators);
+    if (slash != std::string::npos && slash > 0
+     && !makeDirectories(path.substr(0, slash))) {
+        return false;
+    }
+    const auto& functions = state.getProgram()->getFunctions();
+    std::map<const Function*, uint64_t> indices;
+    for (const auto& func : functions) {
+        indices.emplace(func.second.get(), indices.size());
+    }
+    Writer writer;
+    FileHeader header;
+    std::memcpy(header.magic, fileMagic, sizeof(fileMagic));
+    header.key = key;
+    header.checksum = 0;
+    header.instructionSize = sizeof(Instruction);
+    header.functionCount = functions.size();
+    writer.write(header);
+    for (const auto& func : functions) {
+        const Function& function = *func.second;
+        const Bytecode *bytecode = function.getBytecode();
+        FunctionHeader funcHeader = {};
+        funcHeader.kind = bytecode ? FunctionKind::INTERNAL
+                                   : FunctionKind::EXTERNAL;
+        funcHeader.constant = function.getConstantLevel(state);
+        funcHeader.nameLength = func.first.size();
+        funcHeader.inputs = function.getInputNum();
+        funcHeader.outputs = function.getOutputNum();
+        funcHeader.frameSize = function.getFrameSize();
+        if (bytecode) {
+            funcHeader.codeSize = bytecode->size();
+            funcHeader.literalBits = bytecode->getLiterals().size();
+            funcHeader.tableCount = bytecode->getTables().size();
+            funcHeader.callCount = bytecode->getCalls().size();
+        }
+        writer.write(funcHeader);
+        writer.write(func.first.data(), func.first.size());
+        if (!bytecode) {
+            continue;
+        }
+        writer.write(bytecode->getCode().data(),
+            bytecode->size() * sizeof(Instruction));
+        writer.writeBits(bytecode->getLiterals());
+        for (const TruthTable& table : bytecode->getTables()) {
+            writer.write(TableHeader{table.inputs, table.outputs,
+                table.entries.size()});
+            writer.writeBits(table.entries);
+        }
+        std::vector<uint64_t> calls;
+        for (const Function *callee : bytecode->getCalls()) {
+            calls.push_back(indices.at(callee));
+        }
+        writer.write(calls.data(), calls.size() * 8);
+    }
+    std::string& data = writer.getData();
+    header.checksum = hashPayload(data.data() + sizeof(FileHeader),
+        data.size() - sizeof(FileHeader));
+    std::memcpy(&data[0], &header, sizeof(FileHeader));
+    // Several processes may be writing the same file, so each writes a file
+    // of its own and then moves it into place
+    std::stringstream temp;
+    temp << path << ".tmp"
+         << std::hash<std::thread::id>()(std::this_thread::get_id())
+         << std::chrono::steady_clock::now().time_since_epoch().count();
+    {
+        std::ofstream file(temp.str(), std::ios::binary);
+        if (!file.write(data.data(), data.size())) {
+            file.close();
+            std::remove(temp.str().c_str());
+            return false;
+        }
+    }
+    if (std::rename(temp.str().c_str(), path.c_str()) != 0) {
+        std::remove(temp.str().c_str());
+        return false;
+    }
+    return true;
+}
+
+bool loadProgram(State& state, const std::string& path, uint64_t key)
+{
+    SourceFile file;
+    if (!file.open(path)) {
+        return false;
+    }
+    Reader reader(file.data(), file.size());
+    FileHeader header;
+    if (!reader.read(header)
+     || std::memcmp(header.magic, fileMagic, sizeof(fileMagic)) != 0
+     || header.key != key || header.instructionSize != sizeof(Instruction)
+     || header.checksum != hashPayload(file.data() + sizeof(FileHeader),
+            file.size() - sizeof(FileHeader))
+     || !reader.has(header.functionCount, sizeof(FunctionHeader))) {
+        return false;
+    }
+    std::vector<LoadedFunction> loaded(header.functionCount);
+    std::set<std::string> names;
+    auto& functions = state.getProgram()->getFunctions();
+    for (LoadedFunction& func : loaded) {
+        if (!readFunction(reader, func, header.functionCount)
+         || !names.insert(func.name).second) {
+            return false;
+        }
+        const FunctionHeader& funcHeader = func.header;
+        if (funcHeader.kind == FunctionKind::EXTERNAL) {
+            // standard library functions are only used as they are
+            auto iter = functions.find(func.name);
+            if (iter == functions.end() || iter->second->getBytecode()
+             || iter->second->getInputNum() != funcHeader.inputs
+             || iter->second->getOutputNum() != funcHeader.outputs) {
+                return false;
+            }
+        } else {
+            func.function = std::make_unique<FunctionInternal>(
+                funcHeader.inputs, funcHeader.outputs, funcHeader.frameSize,
+                std::vector<StatementPtr>());
+            func.function->setConstantLevel(funcHeader.constant);
+        }
+    }
+    // The whole file has been read, so the state can now be changed
+    std::map<std::string, FunctionPtr> program;
+    for (LoadedFunction& func : loaded) {
+        if (!func.function) {
+            func.function = std::move(functions.at(func.name));
+        }
+    }
+    for (LoadedFunction& func : loaded) {
+        if (func.header.kind == FunctionKind::INTERNAL) {
+            std::vector<const Function*> calls;
+            for (uint64_t index : func.calls) {
+                calls.push_back(loaded[index].function.get());
+            }
+            func.function->setBytecode(std::make_unique<Bytecode>(
+                std::move(func.code), std::move(func.literals),
+                std::move(func.tables), std::move(calls)));
+        }
+    }
+    for (LoadedFunction& func : loaded) {
+        program[func.name] = std::move(func.function);
+    }
+    functions = std::move(program);
+    return true;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include "source.h"
+
+class State;
+
+/// Compiled programs are cached in files of their own, so that later runs of
+/// the same script skip parsing, checking, optimizing and lowering. A file
+/// holds the bytecode of every function, and is mapped into memory to be
+/// loaded; instructions, literals and truth tables are copied out of it
+/// whole rather than being parsed one at a time.
+/// Each file is named after a key that covers the script, the options that
+/// it was compiled with and the build of this compiler, so a file is never
+/// used for anything other than what it was written for.
+
+/// Get whether compiled programs can be cached. They can only be if this
+/// build of the compiler can be told apart from other builds, which it can
+/// when built with SCons or run on Linux.
+bool isCacheSupported();
+
+/// Get the key of a script's compiled program. options describes everything
+/// that changes how the program is compiled.
+uint64_t getCacheKey(const SourceFile& source, const std::string& options);
+
+/// Get the path of the compiled program with the given key in a directory
+std::string getCachePath(const std::string& directory, uint64_t key);
+
+/// Write the functions of a state to path, making its directory if it does
+/// not exist. Internal functions must have been lowered into bytecode. The
+/// file is written under another name and then renamed, so that other
+/// processes never load a file that is half written. Returns false if it
+/// could not be written.
+bool saveProgram(const State& state, const std::string& path, uint64_t key);
+
+/// Replace the functions of a newly created state with the compiled program
+/// at path. Returns false, and leaves the state as it was, if there is no
+/// file, it was not written for the given key, or it is damaged: its
+/// checksum does not match, or an instruction refers to a function, jump
+/// target, literal or truth table that it does not have.
+bool loadProgram(State& state, const std::string& path, uint64_t key);
@@ -0,0 +1,290 @@
+#include "nandlang.h"
+#include "parse.h"
+#include "state.h"
+#include "source.h"
+#include <iostream>
+#include <ostream>
+#include <sstream>
+#include <streambuf>
+
+/// A loaded program, and the source that its errors refer to
+struct nand_program {
+    std::unique_ptr<SourceFile> source;
+    SourceMap sources;
+    std::shared_ptr<Program> program;
+    bool checked;
+};
+
+namespace {
+
+/// Error of the last call on this thread that failed
+thread_local std::string lastError;
+
+/// Reads input through a callback, a character at a time
+class CallbackReader : public std::streambuf {
+    nand_read_fn m_read;
+    void *m_user;
+    char m_char;
+public:
+    CallbackReader(nand_read_fn read, void *user)
+    : m_read(read), m_user(user), m_char(0) {}
+
+protected:
+    int_type underflow() override
+    {
+        int c = m_read(m_user);
+        if (c < 0) {
+            return traits_type::eof();
+        }
+        m_char = char(c);
+        setg(&m_char, &m_char, &m_char + 1);
+        return traits_type::to_int_type(m_char);
+    }
+};
+
+/// Writes output through a callback
+class CallbackWriter : public std::streambuf {
+    nand_write_fn m_write;
+    void *m_user;
+public:
+    CallbackWriter(nand_write_fn write, void *user)
+    : m_write(write), m_user(user) {}
+
+protected:
+    int_type overflow(int_type c) override
+    {
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            char ch = traits_type::to_char_type(c);
+            m_write(m_user, &ch, 1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char *data, std::streamsize size) override
+    {
+        m_write(m_user, data, size_t(size));
+        return size;
+    }
+};
+
+/// Describe an error, with its location if it has one
+void setError(const DebugError& e, SourceMap& sources)
+{
+    SourceLocation location = sources.locate(e.getDebugInfo());
+    std::stringstream s;
+    if (!location.filename.empty()) {
+        s << location.filename << ":" << location.line << ":"
+          << location.column << ": ";
+    }
+    s << e.what();
+    lastError = s.str();
+}
+
+/// Compile the source of a program. Every function is kept, since any of
+/// them may be called.
+nand_program *compile(std::unique_ptr<nand_program> loaded,
+    const std::string& name, int flags)
+{
+    try {
+        uint32_t file = loaded->sources.addFile(name, *loaded->source);
+        loaded->checked = flags & NAND_CHECKED;
+        State state;
+        state.setChecked(loaded->checked);
+        state.parse(parseTokens(*loaded->source, file));
+        state.link();
+        state.check();
+        if (flags & NAND_OPTIMIZE) {
+            state.optimize();
+        }
+        state.compile();
+        if (flags & NAND_OPTIMIZE) {
+            state.flatten(CircuitOptions());
+            state.replaceIdioms();
+            state.tabulate(TableOptions());
+        }
+        // native code is never checked, so checked programs stay interpreted
+        if ((flags & NAND_JIT) && !loaded->checked && Jit::isSupported()) {
+            state.jit();
+        }
+        loaded->program = state.getProgram();
+        return loaded.release();
+    } catch (DebugError& e) {
+        setError(e, loaded->sources);
+    } catch (std::exception& e) {
+        lastError = e.what();
+    }
+    return nullptr;
+}
+
+/// Get the function that a handle stands for
+const Function& getFunction(const nand_function *function)
+{
+    return *reinterpret_cast<const Function*>(function);
+}
+
+} // namespace
+
+/// A state, and the streams that its I/O goes through
+struct nand_state {
+    State state;
+    std::unique_ptr<CallbackReader> reader;
+    std::unique_ptr<CallbackWriter> writer;
+    std::unique_ptr<std::istream> input;
+    std::unique_ptr<std::ostream> output;
+
+    nand_state(const nand_program& program)
+    : state(program.program)
+    {
+        state.setChecked(program.checked);
+    }
+};
+
+namespace {
+
+/// Call a function with bits packed into integers of type T
+template <class T>
+int call(nand_state *handle, const nand_function *function,
+    const T *inputs, T *outputs)
+{
+    static const size_t bits = 8 * sizeof(T);
+    State& state = handle->state;
+    const Function& func = getFunction(function);
+    size_t size = state.size();
+    size_t offset = state.getVarOffset();
+    try {
+        size_t inputNum = func.getInputNum();
+        for (size_t i = 0; i < inputNum; i += bits) {
+            size_t num = std::min(bits, inputNum - i);
+            state.pushInt(inputs[i / bits] >> (bits - num), num);
+        }
+        func.call(state);
+        size_t outputNum = func.getOutputNum();
+        for (size_t i = 0; i < outputNum; i += bits) {
+            size_t num = std::min(bits, outputNum - i);
+            uint64_t value = state.getBits(size + i, num);
+            outputs[i / bits] = T(reverseBits(value, num) << (bits - num));
+        }
+        state.resize(size);
+        // output is written out before returning, so that callers see all of
+        // it once a call is done
+        state.flushOutput();
+        return 0;
+    } catch (std::exception& e) {
+        lastError = e.what();
+    }
+    // leave the state as it was, so that it can still be used
+    state.flushOutput();
+    state.setVarOffset(offset);
+    state.resize(size);
+    return 1;
+}
+
+} // namespace
+
+const char *nand_version(void)
+{
+    return "1.2";
+}
+
+const char *nand_get_error(void)
+{
+    return lastError.c_str();
+}
+
+nand_program *nand_load_buffer(const char *source, size_t size,
+    const char *name, int flags)
+{
+    std::unique_ptr<nand_program> program(new nand_program());
+    program->source = std::make_unique<SourceFile>(
+        std::string(source, size));
+    return compile(std::move(program), name ? name : "", flags);
+}
+
+nand_program *nand_load_file(const char *path, int flags)
+{
+    std::unique_ptr<nand_program> program(new nand_program());
+    program->source = std::make_unique<SourceFile>();
+    if (!program->source->open(path)) {
+        lastError = std::string("Could not open ") + path;
+        return nullptr;
+    }
+    return compile(std::move(program), path, flags);
+}
+
+void nand_program_free(nand_program *program)
+{
+    delete program;
+}
+
+const nand_function *nand_find_function(const nand_program *program,
+    const char *name)
+{
+    const auto& functions = program->program->getFunctions();
+    auto iter = functions.find(name);
+    if (iter == functions.end()) {
+        lastError = std::string("No function named ") + name;
+        return nullptr;
+    }
+    return reinterpret_cast<const nand_function*>(iter->second.get());
+}
+
+size_t nand_function_inputs(const nand_function *function)
+{
+    return getFunction(function).getInputNum();
+}
+
+size_t nand_function_outputs(const nand_function *function)
+{
+    return getFunction(function).getOutputNum();
+}
+
+nand_state *nand_state_new(nand_program *program)
+{
+    try {
+        return new nand_state(*program);
+    } catch (std::exception& e) {
+        lastError = e.what();
+    }
+    return nullptr;
+}
+
+void nand_state_free(nand_state *state)
+{
+    delete state;
+}
+
+void nand_state_set_io(nand_state *state, nand_read_fn read,
+    nand_write_fn write, void *user)
+{
+    // the previous streams are only freed once the state stops using them
+    std::unique_ptr<CallbackReader> reader;
+    std::unique_ptr<std::istream> input;
+    if (read) {
+        reader = std::make_unique<CallbackReader>(read, user);
+        input = std::make_unique<std::istream>(reader.get());
+    }
+    state->state.setInput(input ? *input : std::cin);
+    state->input = std::move(input);
+    state->reader = std::move(reader);
+    std::unique_ptr<CallbackWriter> writer;
+    std::unique_ptr<std::ostream> output;
+    if (write) {
+        writer = std::make_unique<CallbackWriter>(write, user);
+        output = std::make_unique<std::ostream>(writer.get());
+    }
+    state->state.setOutput(output ? *output : std::cout);
+    state->output = std::move(output);
+    state->writer = std::move(writer);
+}
+
+int nand_call(nand_state *state, const nand_function *function,
+    const uint8_t *inputs, uint8_t *outputs)
+{
+    return call(state, function, inputs, outputs);
+}
+
+int nand_call_words(nand_state *state, const nand_function *function,
+    const uint64_t *inputs, uint64_t *outputs)
+{
+    return call(state, function, inputs, outputs);
+}
@@ -0,0 +1,377 @@
+#include "circuit.h"
+#include "function.h"
+#include "bytecode.h"
+#include "idiom.h"
+#include <algorithm>
+
+const Circuit::Node Circuit::zero;
+const Circuit::Node Circuit::one;
+
+Circuit::Circuit(size_t inputs)
+: m_inputs(inputs), m_gates(2 + inputs, Gate{0, 0}), m_nands(0) {}
+
+size_t Circuit::getInputNum() const
+{
+    return m_inputs;
+}
+
+Circuit::Node Circuit::input(size_t index) const
+{
+    return Node(2 + index);
+}
+
+bool Circuit::isConstant(Node node) const
+{
+    return node < 2;
+}
+
+bool Circuit::isInput(Node node) const
+{
+    return node >= 2 && node < 2 + m_inputs;
+}
+
+bool Circuit::isNot(Node node) const
+{
+    return node >= 2 + m_inputs && m_gates[node].left == m_gates[node].right;
+}
+
+Circuit::Node Circuit::getLeft(Node node) const
+{
+    return m_gates[node].left;
+}
+
+Circuit::Node Circuit::getRight(Node node) const
+{
+    return m_gates[node].right;
+}
+
+Circuit::Node Circuit::nand(Node a, Node b)
+{
+    ++m_nands;
+    if (a > b) {
+        std::swap(a, b);
+    }
+    if (a == zero) {
+        return one;
+    }
+    if (a == one) {
+        if (b == one) {
+            return zero;
+        }
+        // 1 NAND b is NOT b
+        a = b;
+    }
+    if (a == b && isNot(a)) {
+        // NOT NOT x is x
+        return m_gates[a].left;
+    }
+    if ((isNot(a) && m_gates[a].left == b)
+     || (isNot(b) && m_gates[b].left == a)) {
+        // x NAND NOT x is always 1
+        return one;
+    }
+    uint64_t key = (uint64_t(a) << 32) | b;
+    auto iter = m_table.find(key);
+    if (iter != m_table.end()) {
+        return iter->second;
+    }
+    Node node = Node(m_gates.size());
+    m_gates.push_back({a, b});
+    m_table[key] = node;
+    return node;
+}
+
+size_t Circuit::size() const
+{
+    return m_gates.size();
+}
+
+size_t Circuit::getNandCount() const
+{
+    return m_nands;
+}
+
+std::vector<Circuit::Node> Circuit::getLive(
+    const std::vector<Node>& outputs) const
+{
+    std::vector<bool> live(m_gates.size(), false);
+    for (Node node : outputs) {
+        live[node] = true;
+    }
+    // operands always come before the gates that use them
+    std::vector<Node> ret;
+    size_t i = m_gates.size();
+    while (i > 2 + m_inputs) {
+        --i;
+        if (live[i]) {
+            live[m_gates[i].left] = true;
+            live[m_gates[i].right] = true;
+            ret.push_back(Node(i));
+        }
+    }
+    std::reverse(ret.begin(), ret.end());
+    return ret;
+}
+
+std::vector<bool> Circuit::evaluate(const std::vector<Node>& outputs,
+    const std::vector<bool>& inputs) const
+{
+    std::vector<bool> values(m_gates.size(), false);
+    values[one] = true;
+    for (size_t i = 0; i < m_inputs; ++i) {
+        values[input(i)] = inputs[i];
+    }
+    for (Node node : getLive(outputs)) {
+        values[node] = !(values[m_gates[node].left]
+                      && values[m_gates[node].right]);
+    }
+    std::vector<bool> ret;
+    ret.reserve(outputs.size());
+    for (Node node : outputs) {
+        ret.push_back(values[node]);
+    }
+    return ret;
+}
+
+namespace {
+
+/// Runs bytecode over symbolic bits. Every bit on the stack is a node of the
+/// circuit being built.
+class SymbolicRunner {
+    const CircuitOptions& m_options;
+    Circuit& m_circuit;
+    std::vector<Circuit::Node> m_stack;
+    std::vector<size_t> m_counters;
+    /// Functions that are being run, to give up on recursion
+    std::vector<const Function*> m_running;
+    size_t m_steps;
+public:
+    SymbolicRunner(const CircuitOptions& options, Circuit& circuit)
+    : m_options(options), m_circuit(circuit), m_steps(0) {}
+
+    /// Run a function whose inputs are on top of the stack. Returns false
+    /// if it can not be turned into a circuit.
+    bool call(const Function& function)
+    {
+        const Bytecode *bytecode = function.getBytecode();
+        if (!bytecode || std::count(m_running.begin(), m_running.end(),
+                &function)) {
+            return false;
+        }
+        size_t inputs = function.getInputNum();
+        size_t outputs = function.getOutputNum();
+        // [previous]:[inputs][outputs]
+        size_t base = m_stack.size() - inputs;
+        m_stack.resize(base + inputs + outputs, Circuit::zero);
+        m_running.push_back(&function);
+        bool ok = run(*bytecode, base);
+        m_running.pop_back();
+        if (!ok) {
+            return false;
+        }
+        // [previous]:[outputs]
+        std::copy(m_stack.begin() + base + inputs,
+            m_stack.begin() + base + inputs + outputs,
+            m_stack.begin() + base);
+        m_stack.resize(base + outputs);
+        return true;
+    }
+
+    bool run(const Bytecode& bytecode, size_t base)
+    {
+        const auto& code = bytecode.getCode();
+        const BitStack& literals = bytecode.getLiterals();
+        const auto& calls = bytecode.getCalls();
+        size_t ip = 0;
+        for (;;) {
+            if (++m_steps > m_options.maxSteps
+             || m_circuit.size() > 4 * m_options.maxGates) {
+                return false;
+            }
+            const Instruction& inst = code[ip++];
+            switch (inst.op) {
+            case Opcode::PUSH:
+                m_stack.push_back(inst.a ? Circuit::one : Circuit::zero);
+                break;
+            case Opcode::PUSH_ARRAY:
+                for (size_t i = 0; i < inst.b; ++i) {
+                    m_stack.push_back(literals.get(inst.a + i)
+                        ? Circuit::one : Circuit::zero);
+                }
+                break;
+            case Opcode::ALLOC:
+                m_stack.resize(m_stack.size() + inst.a, Circuit::zero);
+                break;
+            case Opcode::LOAD:
+                m_stack.push_back(m_stack[base + inst.a]);
+                break;
+            case Opcode::LOAD_ARRAY:
+                load(base + inst.a, inst.b);
+                break;
+            case Opcode::STORE:
+                m_stack[base + inst.a] = m_stack.back();
+                m_stack.pop_back();
+                break;
+            case Opcode::STORE_ARRAY:
+                store(base + inst.a, inst.b);
+                break;
+            case Opcode::DROP:
+                m_stack.resize(m_stack.size() - inst.a);
+                break;
+            case Opcode::NAND: {
+                Circuit::Node right = m_stack.back();
+                m_stack.pop_back();
+                m_stack.back() = m_circuit.nand(m_stack.back(), right);
+                break;
+            }
+            case Opcode::NAND_VARS:
+                m_stack.push_back(m_circuit.nand(m_stack[base + inst.a],
+                    m_stack[base + inst.b]));
+                break;
+            case Opcode::CALL:
+                if (!call(*calls[inst.a])) {
+                    return false;
+                }
+                break;
+            case Opcode::JUMP:
+                ip = inst.a;
+                break;
+            case Opcode::JUMP_IF_ZERO: {
+                Circuit::Node cond = m_stack.back();
+                m_stack.pop_back();
+                if (!m_circuit.isConstant(cond)) {
+                    return false;
+                }
+                if (cond == Circuit::zero) {
+                    ip = inst.a;
+                }
+                break;
+            }
+            case Opcode::TRUNCATE:
+                m_stack.resize(base + inst.a, Circuit::zero);
+                break;
+            case Opcode::FOR_BEGIN:
+                m_counters.push_back(0);
+                break;
+            case Opcode::FOR_LOAD:
+                load(base + inst.a + ptrdiff_t(inst.c) * m_counters.back(),
+                    inst.b);
+                break;
+            case Opcode::FOR_STORE:
+                store(base + inst.a + ptrdiff_t(inst.c) * m_counters.back(),
+                    inst.b);
+                break;
+            case Opcode::FOR_NEXT:
+                if (++m_counters.back() < inst.b) {
+                    ip = inst.a;
+                } else {
+                    m_counters.pop_back();
+                }
+                break;
+            case Opcode::INT_OP: {
+                IntOp op = IntOp(inst.c);
+                size_t outputs = getIntOpOutputs(op, inst.b);
+                size_t top = m_stack.size();
+                m_stack.resize(top + outputs);
+                expandIntOp(m_circuit, op, inst.b, &m_stack[base + inst.a],
+                    &m_stack[top]);
+                break;
+            }
+            case Opcode::TABLE: {
+                // only lookups at a constant index are turned into gates
+                const TruthTable& table = bytecode.getTables()[inst.b];
+                size_t index = 0;
+                for (size_t i = 0; i < table.inputs; ++i) {
+                    Circuit::Node node = m_stack[base + inst.a + i];
+                    if (!m_circuit.isConstant(node)) {
+                        return false;
+                    }
+                    index = (index << 1) | (node == Circuit::one);
+                }
+                for (size_t i = 0; i < table.outputs; ++i) {
+                    m_stack.push_back(
+                        table.entries.get(index * table.outputs + i)
+                        ? Circuit::one : Circuit::zero);
+                }
+                break;
+            }
+            case Opcode::RETURN:
+                return true;
+            }
+        }
+    }
+
+    /// Push num bits, starting at pos
+    void load(size_t pos, size_t num)
+    {
+        for (size_t i = 0; i < num; ++i) {
+            m_stack.push_back(m_stack[pos + i]);
+        }
+    }
+
+    /// Pop num bits into pos, keeping the order that they were pushed in
+    void store(size_t pos, size_t num)
+    {
+        size_t top = m_stack.size() - num;
+        for (size_t i = 0; i < num; ++i) {
+            m_stack[pos + i] = m_stack[top + i];
+        }
+        m_stack.resize(top);
+    }
+
+    const std::vector<Circuit::Node>& getStack() const
+    {
+        return m_stack;
+    }
+
+    void push(Circuit::Node node)
+    {
+        m_stack.push_back(node);
+    }
+};
+
+} // namespace
+
+bool buildCircuit(const Function& function, const CircuitOptions& options,
+    Circuit& circuit, std::vector<Circuit::Node>& outputs)
+{
+    SymbolicRunner runner(options, circuit);
+    for (size_t i = 0; i < function.getInputNum(); ++i) {
+        runner.push(circuit.input(i));
+    }
+    if (!runner.call(function)) {
+        return false;
+    }
+    outputs = runner.getStack();
+    return circuit.getLive(outputs).size() <= options.maxGates;
+}
+
+Bytecode lowerCircuit(const State& state, const Circuit& circuit,
+    const std::vector<Circuit::Node>& outputs)
+{
+    size_t inputs = circuit.getInputNum();
+    BytecodeBuilder builder(state, inputs + outputs.size());
+    // Gates are pushed in evaluation order, so each one stays at the
+    // position that it was pushed to.
+    std::vector<size_t> positions(circuit.size());
+    for (size_t i = 0; i < inputs; ++i) {
+        positions[circuit.input(i)] = i;
+    }
+    for (Circuit::Node node : circuit.getLive(outputs)) {
+        positions[node] = builder.getDepth();
+        builder.emit(Opcode::NAND_VARS, positions[circuit.getLeft(node)],
+            positions[circuit.getRight(node)]);
+    }
+    std::vector<size_t> variables;
+    for (size_t i = 0; i < outputs.size(); ++i) {
+        Circuit::Node node = outputs[i];
+        if (circuit.isConstant(node)) {
+            builder.emit(Opcode::PUSH, node == Circuit::one);
+        } else {
+            builder.emit(Opcode::LOAD, positions[node]);
+        }
+        variables.push_back(inputs + i);
+    }
+    builder.emitStores(variables);
+    return builder.finish();
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <string>
+#include <unordered_map>
+
+class State;
+class Function;
+class Bytecode;
+
+/// Limits on which functions are flattened into circuits
+struct CircuitOptions {
+    /// Functions whose circuit needs more gates than this are left alone.
+    /// 0 disables flattening.
+    size_t maxGates = 4096;
+    /// Maximum number of instructions to run while building a circuit, so
+    /// that loops that never end are given up on.
+    size_t maxSteps = 1 << 20;
+};
+
+/// Gate counts of a function that has been flattened into a circuit
+struct CircuitStats {
+    std::string function;
+    /// Number of NANDs that the function's bytecode performs
+    size_t before;
+    /// Number of gates after simplification and dead gate removal
+    size_t after;
+};
+
+/// A combinational circuit of NAND gates, built from a function that has no
+/// data-dependent control flow.
+/// Gates are hash-consed, so the same gate is never built twice, and are
+/// simplified as they are built: constants are propagated, double negations
+/// are removed, and a gate of a value and its negation becomes constant.
+/// Every gate is built after its operands, so node order is a valid
+/// evaluation order.
+class Circuit {
+public:
+    typedef uint32_t Node;
+    /// Node that is always 0
+    static const Node zero = 0;
+    /// Node that is always 1
+    static const Node one = 1;
+    /// Create a circuit with the given number of input bits
+    Circuit(size_t inputs);
+    /// Get the number of input bits
+    size_t getInputNum() const;
+    /// Get the node of an input bit
+    Node input(size_t index) const;
+    /// Get the NAND of two nodes
+    Node nand(Node a, Node b);
+    /// Returns true if the node is 0 or 1
+    bool isConstant(Node node) const;
+    /// Returns true if the node is an input bit
+    bool isInput(Node node) const;
+    /// Get the operands of a gate
+    Node getLeft(Node node) const;
+    Node getRight(Node node) const;
+    /// Get the total number of nodes, including constants and inputs
+    size_t size() const;
+    /// Get the number of NANDs that were asked for, before simplification
+    size_t getNandCount() const;
+    /// Get the gates that the given nodes depend on, in evaluation order
+    std::vector<Node> getLive(const std::vector<Node>& outputs) const;
+    /// Evaluate the given nodes for the given input bits
+    std::vector<bool> evaluate(const std::vector<Node>& outputs,
+        const std::vector<bool>& inputs) const;
+private:
+    struct Gate {
+        Node left;
+        Node right;
+    };
+    size_t m_inputs;
+    /// Operands of every gate. Constants and inputs come first, and have no
+    /// operands.
+    std::vector<Gate> m_gates;
+    /// Maps a pair of operands to the gate built from them
+    std::unordered_map<uint64_t, Node> m_table;
+    size_t m_nands;
+    /// Returns true if the node is a gate that negates another node
+    bool isNot(Node node) const;
+};
+
+/// Build a circuit from a function by running its bytecode, and every
+/// function that it calls, over symbolic bits. Returns false if the function
+/// calls an external function, branches on a bit that is not constant, or
+/// goes past the given limits. The circuit's outputs are written to outputs.
+bool buildCircuit(const Function& function, const CircuitOptions& options,
+    Circuit& circuit, std::vector<Circuit::Node>& outputs);
+
+/// Lower a circuit into bytecode for a function with the circuit's inputs
+/// and the given outputs. Every live gate is a single instruction.
+Bytecode lowerCircuit(const State& state, const Circuit& circuit,
+    const std::vector<Circuit::Node>& outputs);
@@ -2,9 +2,13 @@
 #include <iostream>
 #include <stdexcept>
 #include <sstream>
-#include <functional>
 #include <cmath>
 
+// The parser takes tokens from the front of a TokenTaker, which is a cursor
+// over the token array. Lists of comma separated items are parsed item by
+// item from the same cursor, and an item ends at a comma, at the end of the
+// cursor, or at a symbol that ends the whole list.
+
 /// Returns the number of bits required to store the given value.
 size_t getRequiredBits(size_t value)
 {
@@ -36,106 +40,112 @@ void assertEmpty(const TokenTaker& tokens)
     }
 }
 
-/// Makes sure that the given TokenTaker is not empty.
+/// Returns true if the TokenTaker is empty, or if its front-most token is the
+/// given symbol
+bool isAtEnd(const TokenTaker& tokens, Symbol stop)
+{
+    Symbol symbol = tokens.peek();
+    return symbol == Symbol::NONE || symbol == stop;
+}
+
+/// Makes sure that the given TokenTaker is not empty, treating the given
+/// symbol as the end of the tokens.
 /// Will throw an InfolessError, make sure that these errors are caught and
 /// passed on in order to give them debug information.
-void assertNotEmpty(
-    const TokenTaker& tokens, const std::string& expected)
+void assertNotEmpty(const TokenTaker& tokens, const std::string& expected,
+    Symbol stop = Symbol::NONE)
 {
-    if (!tokens) {
+    if (isAtEnd(tokens, stop)) {
         std::stringstream s;
         s << "Expected " << expected;
         throwErrorNoInfo(s.str());
     }
 }
 
-/// Split a TokenTaker into two TokenTakers at the given symbol.
-/// This will exhaust the given TokenTaker.
-/// If no split symbol is found, then the second return will be empty.
-/// The third parameter is a pointer to a DebugInfo that will be assigned to the
-/// splitting token's debug info.
-std::pair<TokenTaker, TokenTaker> splitAt(
-    TokenTaker&& tokens, Symbol at, DebugInfo *info)
+/// Makes sure that a list item has been fully parsed, so that the tokens are
+/// at a comma or at the end of the list.
+void assertItemEnd(const TokenTaker& tokens, Symbol stop)
 {
-    TokenTaker left;
-    TokenTaker right;
-    while (tokens) {
-        Token t = tokens.pop();
-        if (t.getSymbol() == at) {
-            if (info) {
-                // assign debug info for center token
-                *info = t.getDebugInfo();
-            }
-            break;
-        } else {
-            left.push(std::move(t));
-        }
+    if (!isAtEnd(tokens, Symbol::COMMA) && !isAtEnd(tokens, stop)) {
+        assertEmpty(tokens);
     }
-    // everything after is now on the right, even if it is the split symbol.
-    while (tokens) {
-        Token t = tokens.pop();
-        right.push(std::move(t));
+}
+
+/// Pop the front-most token of a list item. An item ends at a comma.
+Token popItem(TokenTaker& tokens)
+{
+    if (tokens.peek() == Symbol::COMMA) {
+        // the item is out of tokens
+        throw std::runtime_error("Attempt to pop from an empty TokenTaker");
     }
-    return std::pair<TokenTaker, TokenTaker>(left, right);
+    return tokens.pop();
 }
 
-/// Take tokens from the token taker until the given symbol is met
-TokenTaker takeUntil(TokenTaker& tokens, Symbol at) {
-    if (!tokens) {
-        std::stringstream s;
-        s << "Expected " << at;
-        throwErrorNoInfo(s.str());
+/// Parse a list of comma separated items, until the tokens run out or the
+/// given symbol is met. parse is called at the start of every item, and must
+/// take all of the item's tokens. An empty item is an error, unless it comes
+/// after the last comma.
+template <class Parse>
+void parseList(TokenTaker& tokens, Symbol stop, const std::string& expected,
+    Parse parse)
+{
+    while (!isAtEnd(tokens, stop)) {
+        if (tokens.peek() == Symbol::COMMA) {
+            tokens.front().throwError("Expected " + expected);
+        }
+        parse();
+        if (tokens.peek() == Symbol::COMMA) {
+            tokens.skip();
+        }
     }
-    TokenTaker ret;
+}
+
+/// Take the tokens of the statement at the front of the given tokens, up to
+/// the semicolon that ends it. The semicolon is looked for first, so that a
+/// missing one is reported before anything else in the statement. is_assign
+/// is set if the statement has an assignment symbol.
+TokenTaker takeStatement(TokenTaker& tokens, bool& is_assign)
+{
+    size_t begin = tokens.getPosition();
+    is_assign = false;
     while (tokens) {
-        Token t = tokens.pop();
-        if (!tokens && t.getSymbol() != at) {
+        size_t pos = tokens.getPosition();
+        Symbol symbol = tokens.peek();
+        tokens.skip();
+        if (symbol == Symbol::LINESEP) {
+            return tokens.slice(begin, pos);
+        }
+        if (!tokens) {
             // error if reaching end of tokens but haven't found symbol
+            Token t = tokens.get(pos);
             std::stringstream s;
-            s << "Expected " << at << "; got " << t << " instead";
+            s << "Expected " << Symbol::LINESEP << "; got " << t
+              << " instead";
             t.throwError(s.str());
         }
-        if (t.getSymbol() == at) {
-            break;
-        } else {
-            ret.push(std::move(t));
+        if (symbol == Symbol::ASSIGN) {
+            is_assign = true;
         }
     }
-    return ret;
+    std::stringstream s;
+    s << "Expected " << Symbol::LINESEP;
+    throwErrorNoInfo(s.str());
 }
 
-/// Split a TokenTaker into multiple TokenTakers at the given symbol.
-/// This will exhaust the given TokenTaker.
-/// If require_end is true, then the last symbol must be the delimiter.
-void splitMultiple(TokenTaker& tokens, Symbol at, bool require_end,
-    std::function<void(TokenTaker)> func)
+/// Parse a list of names of function inputs or outputs
+void parseParameters(TokenTaker& tokens, Symbol stop, NameStack& names)
 {
-    TokenTaker taker;
-    while (tokens) {
+    parseList(tokens, stop, "identifier", [&]() {
         Token t = tokens.pop();
-        if (t.getSymbol() != at) {
-            // add all other symbols to the TokenTaker
-            taker.push(std::move(t));
-        }
-        if (t.getSymbol() == at || (!tokens && taker)) {
-            // call the function if the split symbol is found, or if we have
-            // ran out of tokens and there are still symbols that need to be
-            // parsed.
-            try {
-                func(taker);
-            } catch (InfolessError& e) {
-                t.throwError(e.what());
-            }
-            taker.clear();
-        }
-        if (t.getSymbol() != at && require_end && !tokens) {
-            // There is an error if the split symbol is expected at the end,
-            // but the last symbol is not the split symbol.
-            std::stringstream s;
-            s << "Expected " << at;
-            t.throwError(s.str());
+        assertToken(t, Symbol::IDENTIFIER);
+        if (tokens.peek() == Symbol::INDEX) {
+            Token tokenIndex = tokens.pop();
+            names.insertIndexed(t, tokenIndex.getValue());
+        } else {
+            names.insert(t);
         }
-    }
+        assertItemEnd(tokens, stop);
+    });
 }
 
 std::pair<std::string, FunctionPtr> parseFunction(TokenTaker& tokens)
@@ -152,49 +162,38 @@ std::pair<std::string, FunctionPtr> parseFunction(TokenTaker& tokens)
     assertToken(token_arguments, Symbol::PARENTHESIS);
     assertToken(token_block, Symbol::BLOCK);
     // parse tokens
-    TokenTaker itaker;
-    TokenTaker otaker;
-    TokenTaker argtaker(std::move(token_arguments.takeBlock()));
+    TokenTaker argtaker = tokens.takeBlock(token_arguments);
     // inputs are separated from outputs by the :  symbol (IOSEP)
     // The : symbol is not required. If it is not there, then all paramters are
     // treated as inputs
-    std::tie(itaker, otaker) = splitAt(
-        std::move(argtaker), Symbol::IOSEP, nullptr);
-    splitMultiple(itaker, Symbol::COMMA, false, [&names](auto tokens) {
-        // inputs are comma delimited
-        assertNotEmpty(tokens, "identifier");
-        Token t = tokens.pop();
-        assertToken(t, Symbol::IDENTIFIER);
-        if (tokens.peek() == Symbol::INDEX) {
-            Token tokenIndex = tokens.pop();
-            names.insertIndexed(t, tokenIndex.getValue());
-        } else {
-            names.insert(t);
-        }
-        assertEmpty(tokens);
-    });
+    parseParameters(argtaker, Symbol::IOSEP, names);
     size_t num_inputs = names.size();
-    splitMultiple(otaker, Symbol::COMMA, false, [&names](auto tokens) {
-        // outputs are also comma delimited
-        assertNotEmpty(tokens, "identifier");
-        Token t = tokens.pop();
-        assertToken(t, Symbol::IDENTIFIER);
-        if (tokens.peek() == Symbol::INDEX) {
-            Token tokenIndex = tokens.pop();
-            names.insertIndexed(t, tokenIndex.getValue());
-        } else {
-            names.insert(t);
-        }
-        assertEmpty(tokens);
-    });
+    if (argtaker.peek() == Symbol::IOSEP) {
+        argtaker.skip();
+    }
+    // any further : symbol is an error in the outputs
+    parseParameters(argtaker, Symbol::NONE, names);
     size_t num_outputs = names.size() - num_inputs;
     // parse statements
-    TokenTaker blocktaker(std::move(token_block.takeBlock()));
+    TokenTaker blocktaker = tokens.takeBlock(token_block);
     std::vector<StatementPtr> block = parseBlock(blocktaker, names);
     // return
     return std::pair<std::string, FunctionPtr>(token_fname.getIdentifier(),
         std::make_unique<FunctionInternal>(num_inputs, num_outputs,
-        std::move(block)));
+        names.getFrameSize(), std::move(block)));
+}
+
+/// Parse a list of comma separated expressions, e.g. the parameters of a
+/// function call
+std::vector<ExpressionPtr> parseExpressionList(TokenTaker& tokens,
+    NameStack& names, const std::string& expected)
+{
+    std::vector<ExpressionPtr> values;
+    parseList(tokens, Symbol::NONE, expected, [&]() {
+        values.push_back(parseExpression(tokens, names, Symbol::COMMA));
+        assertItemEnd(tokens, Symbol::NONE);
+    });
+    return values;
 }
 
 /// Parse a function expression
@@ -203,16 +202,10 @@ ExpressionPtr parseExpressionFunction(
 {
     Token args = tokens.pop();
     // its a function call, parse inside of parenthesis as parameters
-    TokenTaker param_taker(std::move(args.takeBlock()));
-    std::vector<ExpressionPtr> values;
-    splitMultiple(param_taker, Symbol::COMMA, false,
-    [&values, &names](auto tokens) {
-        assertNotEmpty(tokens, "expression before comma");
-        // expressions are comma delimited
-        values.push_back(parseExpression(tokens, names));
-        assertEmpty(tokens);
-    });
-    return std::make_unique<ExpressionFunction>(
+    TokenTaker param_taker = tokens.takeBlock(args);
+    std::vector<ExpressionPtr> values = parseExpressionList(param_taker,
+        names, "expression before comma");
+    return makeNode<ExpressionFunction>(
         token_function.getDebugInfo(), token_function.getIdentifier(),
         std::move(values));
 }
@@ -234,22 +227,23 @@ ExpressionPtr parseExpressionIdentifier(
         token_id.throwError(s.str());
     }
     if (def.size == 1) {
-        return std::make_unique<ExpressionVariable>(
+        return makeNode<ExpressionVariable>(
             token_id.getDebugInfo(), def.pos);
     } else {
-        return std::make_unique<ExpressionArray>(
+        return makeNode<ExpressionArray>(
             token_id.getDebugInfo(), def.pos, def.size);
     }
 }
 
-ExpressionPtr parseExpression(TokenTaker& tokens, NameStack& names)
+ExpressionPtr parseExpression(TokenTaker& tokens, NameStack& names,
+    Symbol stop)
 {
     auto first = tokens.peek();
     ExpressionPtr left = nullptr;
     if (first == Symbol::PARENTHESIS) {
         // parenthesis, parse inside
         Token t = tokens.pop();
-        TokenTaker left_taker(std::move(t.takeBlock()));
+        TokenTaker left_taker = tokens.takeBlock(t);
         try {
             assertNotEmpty(left_taker, "expression inside parentheses");
         } catch (InfolessError& e) {
@@ -281,7 +275,7 @@ ExpressionPtr parseExpression(TokenTaker& tokens, NameStack& names)
             t.throwError(s.str());
         }
         if (bits_max == 1) {
-            left = std::make_unique<ExpressionLiteral>(
+            left = makeNode<ExpressionLiteral>(
                 t.getDebugInfo(), t.getValue());
         } else {
             std::vector<bool> arr;
@@ -291,7 +285,7 @@ ExpressionPtr parseExpression(TokenTaker& tokens, NameStack& names)
                 arr.push_back(value & 0x01);
                 value >>= 1;
             }
-            left = std::make_unique<ExpressionLiteralArray>(
+            left = makeNode<ExpressionLiteralArray>(
                 t.getDebugInfo(), std::move(arr));
         }
     } else {
@@ -306,12 +300,12 @@ ExpressionPtr parseExpression(TokenTaker& tokens, NameStack& names)
         // expression.
         Token t = tokens.pop();
         try {
-            assertNotEmpty(tokens, "expression after NAND operator");
+            assertNotEmpty(tokens, "expression after NAND operator", stop);
         } catch (InfolessError& e) {
             throwError(t.getDebugInfo(), e.what());
         }
-        ExpressionPtr right = parseExpression(tokens, names);
-        return std::make_unique<ExpressionNand>(
+        ExpressionPtr right = parseExpression(tokens, names, stop);
+        return makeNode<ExpressionNand>(
             t.getDebugInfo(), std::move(left), std::move(right));
     } else {
         return left;
@@ -334,25 +328,24 @@ StatementPtr parseStatementConditional(TokenTaker& tokens, NameStack& names)
     // block
     Token token_block = tokens.pop();
     assertToken(token_block, Symbol::BLOCK);
-    TokenTaker blocktaker(std::move(token_block.takeBlock()));
+    TokenTaker blocktaker = tokens.takeBlock(token_block);
     NameStack subnames(names);
     std::vector<StatementPtr> block = parseBlock(blocktaker, subnames);
     // return
     if (is_while) {
-        return std::make_unique<StatementWhile>(
+        return makeNode<StatementWhile>(
             t.getDebugInfo(), std::move(expr), std::move(block));
     } else {
         std::vector<StatementPtr> elseblock;
         if (tokens.peek() == Symbol::ELSE) {
-            tokens.pop();
+            tokens.skip();
             Token else_token = tokens.pop();
             assertToken(else_token, Symbol::BLOCK);
-            TokenTaker elseblocktaker(std::move(else_token.takeBlock()));
+            TokenTaker elseblocktaker = tokens.takeBlock(else_token);
             NameStack elsesubnames(names);
             elseblock = parseBlock(elseblocktaker, elsesubnames);
-            assertEmpty(elseblocktaker);
         }
-        return std::make_unique<StatementIf>(
+        return makeNode<StatementIf>(
             t.getDebugInfo(), std::move(expr),
             std::move(block), std::move(elseblock));
     }
@@ -365,20 +358,12 @@ StatementPtr parseStatementAssign(TokenTaker& tokens, NameStack& names)
     bool is_var = false;
     if (tokens.peek() == Symbol::VAR) {
         is_var = true;
-        tokens.pop();
+        tokens.skip();
     }
     std::vector<size_t> positions;
-    std::vector<ExpressionPtr> values;
-    // split tokens at assignment symbol
-    TokenTaker nametaker;
-    TokenTaker valuetaker;
-    DebugInfo info;
-    std::tie(nametaker, valuetaker) = splitAt(
-        std::move(tokens), Symbol::ASSIGN, &info);
-    splitMultiple(nametaker, Symbol::COMMA, false,
-        [&positions, &names, is_var](auto tokens) {
+    // names come before the assignment symbol
+    parseList(tokens, Symbol::ASSIGN, "identifier before comma", [&]() {
         // expressions are comma delimited
-        assertNotEmpty(tokens, "identifier before comma");
         Token t = tokens.pop();
         assertToken(t, Symbol::IDENTIFIER);
         NameStackDef def;
@@ -411,21 +396,18 @@ StatementPtr parseStatementAssign(TokenTaker& tokens, NameStack& names)
             }
             positions.push_back(pos);
         }
-        assertEmpty(tokens);
-    });
-    splitMultiple(valuetaker, Symbol::COMMA, false,
-        [&values, &names](auto tokens) {
-        // expressions are comma delimited
-        assertNotEmpty(tokens, "expression after assignment");
-        values.push_back(parseExpression(tokens, names));
-        assertEmpty(tokens);
+        assertItemEnd(tokens, Symbol::ASSIGN);
     });
+    // the statement is known to have an assignment symbol
+    DebugInfo info = tokens.pop().getDebugInfo();
+    std::vector<ExpressionPtr> values = parseExpressionList(tokens, names,
+        "expression after assignment");
     // return
     if (is_var) {
-        return std::make_unique<StatementVariable>(
+        return makeNode<StatementVariable>(
             info, std::move(positions), std::move(values));
     } else {
-        return std::make_unique<StatementAssign>(
+        return makeNode<StatementAssign>(
             info, std::move(positions), std::move(values));
     }
 }
@@ -462,25 +444,23 @@ StatementPtr parseFor(TokenTaker& tokens, NameStack& names)
     auto token_block = tokens.pop();
     assertToken(token_block, Symbol::BLOCK);
     std::vector<NumIterationResult> iternames;
-    auto nametaker = TokenTaker(std::move(token_namelist.takeBlock()));
+    auto nametaker = tokens.takeBlock(token_namelist);
     size_t expected_iter = 0;
-    splitMultiple(nametaker, Symbol::COMMA, false, [&](auto tokens) {
+    parseList(nametaker, Symbol::NONE, "identifier", [&]() {
         // inputs are comma delimited
         bool reverse = false;
-        assertNotEmpty(tokens, "identifier");
-        if (tokens.peek() == Symbol::IOSEP) {
-            tokens.pop();
+        if (nametaker.peek() == Symbol::IOSEP) {
+            nametaker.skip();
             reverse = true;
         }
-        Token t = tokens.pop();
+        Token t = popItem(nametaker);
         assertToken(t, Symbol::IDENTIFIER);
-        std::string name = t.getIdentifier();
         size_t size = 1;
-        if (tokens.peek() == Symbol::INDEX) {
-            Token tokenIndex = tokens.pop();
+        if (nametaker.peek() == Symbol::INDEX) {
+            Token tokenIndex = nametaker.pop();
             size = tokenIndex.getValue();
         }
-        assertEmpty(tokens);
+        assertItemEnd(nametaker, Symbol::NONE);
         auto result = getNumIterations(names, std::move(t), size);
         if (expected_iter && expected_iter != result.num_iterations) {
             std::stringstream s;
@@ -501,8 +481,8 @@ StatementPtr parseFor(TokenTaker& tokens, NameStack& names)
     NameStack subnames(names);
     for (const auto& iter : iternames) {
         subnames.removeName(iter.token.getIdentifier());
-        subnames.insertIndexed(iter.token, iter.size);
-        ForData data = {iter.pos, iter.size, ptrdiff_t(iter.size)};
+        NameStackDef def = subnames.insertIndexed(iter.token, iter.size);
+        ForData data = {iter.pos, iter.size, ptrdiff_t(iter.size), def.pos};
         if (iter.reverse) {
             // if reversed, then beginning is last set of bits in variable and
             // reverse the step
@@ -511,9 +491,9 @@ StatementPtr parseFor(TokenTaker& tokens, NameStack& names)
         }
         fordata.push_back(std::move(data));
     }
-    TokenTaker blocktaker(std::move(token_block.takeBlock()));
+    TokenTaker blocktaker = tokens.takeBlock(token_block);
     std::vector<StatementPtr> block = parseBlock(blocktaker, subnames);
-    return std::make_unique<StatementFor>(
+    return makeNode<StatementFor>(
         first.getDebugInfo(), expected_iter, std::move(fordata), std::move(block));
 }
 
@@ -526,14 +506,15 @@ StatementPtr parseStatement(TokenTaker& tokens, NameStack& names)
     } else if (first == Symbol::FOR) {
         return parseFor(tokens, names);
     } else {
-        TokenTaker subtokens = takeUntil(tokens, Symbol::LINESEP);
-        if (subtokens.contains(Symbol::ASSIGN)) {
+        bool is_assign;
+        TokenTaker subtokens = takeStatement(tokens, is_assign);
+        if (is_assign) {
             return parseStatementAssign(subtokens, names);
         } else {
             // this is probably an expression. An error will result if it is not.
             auto expr = parseExpression(subtokens, names);
             assertEmpty(subtokens);
-            return std::make_unique<StatementExpression>(std::move(expr));
+            return makeNode<StatementExpression>(std::move(expr));
         }
     }
 }
@@ -11,7 +11,9 @@ std::pair<std::string, FunctionPtr> parseFunction(TokenTaker& tokens);
 
 /// Unlike parseStatement, this function does not exhaust the given TokenTaker
 /// Make sure to use the assertEmpty function afterwards if need be.
-ExpressionPtr parseExpression(TokenTaker& tokens, NameStack& names);
+/// The expression ends at the given symbol, as if the tokens ended there.
+ExpressionPtr parseExpression(TokenTaker& tokens, NameStack& names,
+    Symbol stop = Symbol::NONE);
 
 /// Parses a statement. Will exhaust the given TokenTaker.
 /// Make sure that TokenTaker is not exhausted before calling this function.
@@ -1,21 +1,10 @@
 #include "debug.h"
-#include <sstream>
 
 DebugInfo::DebugInfo()
-: line(0), column(0), position(0), filename(nullptr) {}
+: file(0), position(0) {}
 
-std::ostream& operator<<(std::ostream& stream, const DebugInfo& info)
-{
-    // output filename only if file is known
-    if (info.filename) {
-        stream << " in file " << *info.filename;
-    }
-    // output line if it is non-zero (known lines are not zero)
-    if (info.line) {
-        stream << " on line " << info.line << ":" << info.column;
-    }
-    return stream;
-}
+DebugInfo::DebugInfo(uint32_t file, uint32_t position)
+: file(file), position(position) {}
 
 InfolessError::InfolessError(const std::string& what)
 : m_err(what) {}
@@ -57,11 +46,7 @@ void Debuggable::setDebugInfo(const DebugInfo& info)
 }
 
 DebugError::DebugError(const DebugInfo& info, const std::string& what)
-: Debuggable(info) {
-    std::stringstream s;
-    s << "Error" << info << ":\n" << what;
-    m_err = s.str();
-}
+: Debuggable(info), m_err(what) {}
 
 const char* DebugError::what() const noexcept
 {
@@ -1,24 +1,21 @@
 #pragma once
-#include <iostream>
+#include <cstdint>
 #include <string>
 #include <memory>
 #include <stdexcept>
 
-/// Contains debugging information
+/// Contains debugging information. This is only a position in a source file,
+/// so that it is cheap to copy; lines and columns are worked out by the
+/// SourceMap when an error is reported.
 class DebugInfo {
 public:
     DebugInfo();
-    // line in file
-    size_t line;
-    /// column in file
-    size_t column;
+    DebugInfo(uint32_t file, uint32_t position);
+    /// index of the file in the source map, or 0 if it is unknown
+    uint32_t file;
     /// byte position in file
-    size_t position;
-    /// name of the file. This is a shared pointer so that memory/processing
-    /// isn't wasted too much by copying strings around.
-    std::shared_ptr<std::string> filename;
+    uint32_t position;
 };
-std::ostream& operator<<(std::ostream&, const DebugInfo&);
 
 /// Throw an error for the given debugging info object and the given description
 [[noreturn]] void throwError(const DebugInfo& info, const std::string& what);
@@ -46,7 +43,7 @@ class DebugError : public Debuggable, public std::exception {
     std::string m_err;
 public:
     DebugError(const DebugInfo&, const std::string&);
-    /// Error message
+    /// Error message, without the location of the error
     const char* what() const noexcept;
 };
 
@@ -0,0 +1,124 @@
+#include "effects.h"
+#include "function.h"
+#include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+
+namespace {
+
+/// Finds strongly connected components of the call graph with Tarjan's
+/// algorithm. Components are found callees first.
+class ComponentFinder {
+    const State& m_state;
+    /// Leave out functions whose constant-ness is already known
+    bool m_unsolvedOnly;
+    std::map<const Function*, size_t> m_index;
+    std::map<const Function*, size_t> m_lowLink;
+    std::vector<const Function*> m_stack;
+    std::set<const Function*> m_onStack;
+    std::vector<std::vector<const Function*>> m_components;
+public:
+    ComponentFinder(const State& state, bool unsolvedOnly)
+    : m_state(state), m_unsolvedOnly(unsolvedOnly) {}
+
+    bool isVisited(const Function& function) const
+    {
+        return m_index.count(&function);
+    }
+
+    void visit(const Function& function)
+    {
+        size_t index = m_index.size();
+        m_index[&function] = index;
+        m_lowLink[&function] = index;
+        m_stack.push_back(&function);
+        m_onStack.insert(&function);
+        std::set<const Function*> calls;
+        function.getCalls(m_state, calls);
+        for (const Function *callee : calls) {
+            if (m_unsolvedOnly && callee->hasConstantLevel()) {
+                continue;
+            }
+            if (!m_index.count(callee)) {
+                visit(*callee);
+                m_lowLink[&function] = std::min(m_lowLink[&function],
+                    m_lowLink[callee]);
+            } else if (m_onStack.count(callee)) {
+                m_lowLink[&function] = std::min(m_lowLink[&function],
+                    m_index[callee]);
+            }
+        }
+        if (m_lowLink[&function] == index) {
+            // this function is the root of a component
+            std::vector<const Function*> component;
+            const Function *member;
+            do {
+                member = m_stack.back();
+                m_stack.pop_back();
+                m_onStack.erase(member);
+                component.push_back(member);
+            } while (member != &function);
+            m_components.push_back(std::move(component));
+        }
+    }
+
+    std::vector<std::vector<const Function*>>& getComponents()
+    {
+        return m_components;
+    }
+};
+
+/// Find the constant-ness of every function in a component. Every function
+/// that it calls outside of the component is already solved.
+void solve(const State& state, const std::vector<const Function*>& component)
+{
+    // a component of one function is only recursive if it calls itself
+    bool recursive = component.size() > 1;
+    if (!recursive) {
+        std::set<const Function*> calls;
+        component[0]->getCalls(state, calls);
+        recursive = calls.count(component[0]);
+    }
+    for (const Function *member : component) {
+        member->setConstantLevel(ConstantLevel::LITERAL);
+        member->setRecursive(recursive);
+    }
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (const Function *member : component) {
+            ConstantLevel level = member->calculateConstantLevel(state);
+            if (level != member->getConstantLevel(state)) {
+                member->setConstantLevel(level);
+                changed = true;
+            }
+        }
+    }
+}
+
+} // namespace
+
+void analyzeEffects(const State& state, const Function& function)
+{
+    if (function.hasConstantLevel()) {
+        return;
+    }
+    ComponentFinder finder(state, true);
+    finder.visit(function);
+    for (const auto& component : finder.getComponents()) {
+        solve(state, component);
+    }
+}
+
+std::vector<std::vector<const Function*>> getCallComponents(
+    const State& state, const std::vector<const Function*>& functions)
+{
+    ComponentFinder finder(state, false);
+    for (const Function *function : functions) {
+        if (!finder.isVisited(*function)) {
+            finder.visit(*function);
+        }
+    }
+    return std::move(finder.getComponents());
+}
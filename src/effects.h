@@ -0,0 +1,21 @@
+#pragma once
+#include <vector>
+
+class State;
+class Function;
+
+/// Work out the constant-ness of a function, and of every function that it
+/// calls whose constant-ness is not yet known.
+/// The call graph is split into strongly connected components, which are
+/// solved callees first. Within a component, every function starts out as
+/// constant as possible and is made less constant until nothing changes, so
+/// that recursion on its own never gives a function global effects. Every
+/// member of a component that calls itself is marked recursive, so that
+/// calls to it are still never run ahead of time.
+void analyzeEffects(const State& state, const Function& function);
+
+/// Split the call graph of the given functions, and of every function that
+/// they call, into strongly connected components. Every component comes
+/// after the components of the functions that it calls.
+std::vector<std::vector<const Function*>> getCallComponents(
+    const State& state, const std::vector<const Function*>& functions);
@@ -1,5 +1,8 @@
 #include "expression.h"
 #include "state.h"
+#include "bytecode.h"
+#include "statement.h"
+#include "inliner.h"
 #include <algorithm>
 #include <sstream>
 
@@ -21,6 +24,13 @@ void checkExpressions(const State& state,
     }
 }
 
+void linkExpressions(State& state, std::vector<ExpressionPtr>& expressions)
+{
+    for (auto& expr : expressions) {
+        expr->link(state);
+    }
+}
+
 void optimizeExpressions(State& state,
     std::vector<ExpressionPtr>& expressions)
 {
@@ -37,7 +47,7 @@ void optimizeExpressions(State& state,
             DebugInfo info = (*iter_begin)->getDebugInfo();
             iter = expressions.erase(iter_begin, iter);
             expressions.insert(iter_begin,
-                std::make_unique<ExpressionLiteralArray>(
+                makeNode<ExpressionLiteralArray>(
                     info, std::move(values)));
             ++iter;
         }
@@ -74,8 +84,53 @@ ConstantLevel getExpressionsConstantLevel(const State& state,
     return ret;
 }
 
+void getExpressionsCalls(const State& state,
+    const std::vector<ExpressionPtr>& expressions,
+    std::set<const Function*>& calls)
+{
+    for (const auto& expr : expressions) {
+        expr->getCalls(state, calls);
+    }
+}
+
+void inlineExpression(Inliner& inliner, ExpressionPtr& expression,
+    size_t depth)
+{
+    ExpressionPtr replacement = expression->inlineCalls(inliner, depth);
+    if (replacement) {
+        expression = std::move(replacement);
+    }
+}
+
+void inlineExpressions(Inliner& inliner,
+    std::vector<ExpressionPtr>& expressions, size_t depth)
+{
+    for (auto& expr : expressions) {
+        inlineExpression(inliner, expr, depth);
+        depth += expr->getOutputNum(inliner.getState());
+    }
+}
+
+std::vector<ExpressionPtr> cloneExpressions(
+    const std::vector<ExpressionPtr>& expressions, size_t offset)
+{
+    std::vector<ExpressionPtr> ret;
+    ret.reserve(expressions.size());
+    for (const auto& expr : expressions) {
+        ret.push_back(expr->clone(offset));
+    }
+    return ret;
+}
+
 Expression::Expression(const DebugInfo& info) : Debuggable(info) {}
 
+void Expression::resolveInto(State& state,
+    const std::vector<size_t>& positions) const
+{
+    resolve(state);
+    state.popVarsInto(positions);
+}
+
 ExpressionNand::ExpressionNand(
     const DebugInfo& info, ExpressionPtr&& left, ExpressionPtr&& right)
 : Expression(info), m_left(std::move(left)), m_right(std::move(right)) {}
@@ -115,7 +170,20 @@ ConstantLevel ExpressionNand::getConstantLevel(const State& state) const
 {
     // Returns the constantness of the least-constant expression.
     return std::min({ConstantLevel::CONSTANT,
-        m_left->getConstantLevel(state), m_left->getConstantLevel(state)});
+        m_left->getConstantLevel(state), m_right->getConstantLevel(state)});
+}
+
+void ExpressionNand::getCalls(const State& state,
+    std::set<const Function*>& calls) const
+{
+    m_left->getCalls(state, calls);
+    m_right->getCalls(state, calls);
+}
+
+void ExpressionNand::link(State& state)
+{
+    m_left->link(state);
+    m_right->link(state);
 }
 
 void ExpressionNand::optimize(State& state)
@@ -124,11 +192,32 @@ void ExpressionNand::optimize(State& state)
     m_right->optimize(state);
 }
 
+void ExpressionNand::compile(BytecodeBuilder& builder) const
+{
+    m_left->compile(builder);
+    m_right->compile(builder);
+    builder.emit(Opcode::NAND);
+}
+
+ExpressionPtr ExpressionNand::inlineCalls(Inliner& inliner, size_t depth)
+{
+    inlineExpression(inliner, m_left, depth);
+    inlineExpression(inliner, m_right, depth + 1);
+    return nullptr;
+}
+
+ExpressionPtr ExpressionNand::clone(size_t offset) const
+{
+    return makeNode<ExpressionNand>(getDebugInfo(),
+        m_left->clone(offset), m_right->clone(offset));
+}
+
 ExpressionFunction::ExpressionFunction(
     const DebugInfo& info, const std::string& name,
     std::vector<ExpressionPtr>&& args)
 : Expression(info), m_functionName(name),
-m_arguments(std::move(args)), m_function(nullptr) {}
+m_arguments(std::move(args)), m_function(nullptr), m_inputNum(0)
+, m_outputNum(0) {}
 
 void ExpressionFunction::resolve(State& state) const
 {
@@ -136,33 +225,36 @@ void ExpressionFunction::resolve(State& state) const
         // push in forward order
         (*iter)->resolve(state);
     }
-    if (!m_function) {
-        Function& func = state.getFunction(m_functionName);
-        m_function = &func;
-    }
     m_function->call(state);
 }
 
-uint64_t ExpressionFunction::getOutputNum(const State& state) const
+void ExpressionFunction::resolveInto(State& state,
+    const std::vector<size_t>& positions) const
 {
-    const Function& func = state.getFunction(m_functionName);
-    return func.getOutputNum();
+    for (const auto& arg : m_arguments) {
+        arg->resolve(state);
+    }
+    m_function->callInto(state, positions);
+}
+
+uint64_t ExpressionFunction::getOutputNum(const State&) const
+{
+    return m_outputNum;
 }
 
 void ExpressionFunction::check(const State& state) const
 {
-    if (!state.hasFunction(m_functionName)) {
+    if (!m_function) {
         std::stringstream s;
         s << "Call to non-existent function " << m_functionName;
         throwError(s.str());
     }
     checkExpressions(state, m_arguments);
-    const Function& func = state.getFunction(m_functionName);
     size_t inputnum = countOutputs(state, m_arguments);
-    if (func.getInputNum() != inputnum) {
+    if (m_inputNum != inputnum) {
         std::stringstream s;
         s << "Function " << m_functionName << " expected "
-          << func.getInputNum() << " inputs; got " << inputnum;
+          << m_inputNum << " inputs; got " << inputnum;
         throwError(s.str());
     }
     // Do NOT check func here because functions are already checked by State
@@ -170,21 +262,68 @@ void ExpressionFunction::check(const State& state) const
 
 ConstantLevel ExpressionFunction::getConstantLevel(const State& state) const
 {
-    const Function& func = state.getFunction(m_functionName);
-    ConstantLevel func_const = func.getConstantLevel(state);
+    ConstantLevel func_const = m_function->getConstantLevel(state);
     ConstantLevel arg_const = getExpressionsConstantLevel(state, m_arguments);
-    if (func_const == ConstantLevel::LOCAL) {
+    if (m_function->isRecursive(state)) {
+        // a recursive call may never finish, so it is neither run ahead of
+        // time nor removed, however few effects it has
+        func_const = std::min(func_const, ConstantLevel::LOCAL);
+    } else if (func_const == ConstantLevel::LOCAL) {
         // function only affects itself, so this expression is CONSTANT.
         func_const = ConstantLevel::CONSTANT;
     }
     return std::min(func_const, arg_const);
 }
 
+void ExpressionFunction::getCalls(const State& state,
+    std::set<const Function*>& calls) const
+{
+    calls.insert(m_function);
+    getExpressionsCalls(state, m_arguments, calls);
+}
+
+void ExpressionFunction::link(State& state)
+{
+    // a missing function is reported by check, in the same order as every
+    // other error
+    if (state.hasFunction(m_functionName)) {
+        m_function = &state.getFunction(m_functionName);
+        m_inputNum = m_function->getInputNum();
+        m_outputNum = m_function->getOutputNum();
+    }
+    linkExpressions(state, m_arguments);
+}
+
 void ExpressionFunction::optimize(State& state)
 {
     optimizeExpressions(state, m_arguments);
 }
 
+void ExpressionFunction::compile(BytecodeBuilder& builder) const
+{
+    for (const auto& arg : m_arguments) {
+        arg->compile(builder);
+    }
+    builder.emitCall(*m_function);
+}
+
+ExpressionPtr ExpressionFunction::inlineCalls(Inliner& inliner, size_t depth)
+{
+    inlineExpressions(inliner, m_arguments, depth);
+    return inliner.inlineCall(getDebugInfo(), *m_function, m_arguments,
+        depth);
+}
+
+ExpressionPtr ExpressionFunction::clone(size_t offset) const
+{
+    auto ret = makeNode<ExpressionFunction>(getDebugInfo(),
+        m_functionName, cloneExpressions(m_arguments, offset));
+    ret->m_function = m_function;
+    ret->m_inputNum = m_inputNum;
+    ret->m_outputNum = m_outputNum;
+    return std::move(ret);
+}
+
 ExpressionVariable::ExpressionVariable(
     const DebugInfo& info, size_t pos)
 : Expression(info), m_pos(pos) {}
@@ -209,11 +348,38 @@ ConstantLevel ExpressionVariable::getConstantLevel(const State&) const
     return ConstantLevel::LOCAL;
 }
 
+void ExpressionVariable::getCalls(const State&,
+    std::set<const Function*>&) const
+{
+    // nothing to do
+}
+
+void ExpressionVariable::link(State&)
+{
+    // nothing to do
+}
+
 void ExpressionVariable::optimize(State& state)
 {
     // nothing to do
 }
 
+void ExpressionVariable::compile(BytecodeBuilder& builder) const
+{
+    builder.emit(Opcode::LOAD, m_pos);
+}
+
+ExpressionPtr ExpressionVariable::inlineCalls(Inliner&, size_t)
+{
+    return nullptr;
+}
+
+ExpressionPtr ExpressionVariable::clone(size_t offset) const
+{
+    return makeNode<ExpressionVariable>(getDebugInfo(),
+        m_pos + offset);
+}
+
 ExpressionArray::ExpressionArray(
     const DebugInfo& info, size_t pos, size_t size)
 : Expression(info), m_pos(pos), m_size(size) {}
@@ -225,9 +391,7 @@ void ExpressionArray::check(const State& state) const
 
 void ExpressionArray::resolve(State& state) const
 {
-    for (size_t i = 0; i < m_size; ++i) {
-        state.push(state.getVar(m_pos + i));
-    }
+    state.pushVars(m_pos, m_size);
 }
 
 uint64_t ExpressionArray::getOutputNum(const State& state) const
@@ -240,11 +404,38 @@ ConstantLevel ExpressionArray::getConstantLevel(const State&) const
     return ConstantLevel::LOCAL;
 }
 
+void ExpressionArray::getCalls(const State&,
+    std::set<const Function*>&) const
+{
+    // nothing to do
+}
+
+void ExpressionArray::link(State&)
+{
+    // nothing to do
+}
+
 void ExpressionArray::optimize(State& state)
 {
     // nothing to do
 }
 
+void ExpressionArray::compile(BytecodeBuilder& builder) const
+{
+    builder.emit(Opcode::LOAD_ARRAY, m_pos, m_size);
+}
+
+ExpressionPtr ExpressionArray::inlineCalls(Inliner&, size_t)
+{
+    return nullptr;
+}
+
+ExpressionPtr ExpressionArray::clone(size_t offset) const
+{
+    return makeNode<ExpressionArray>(getDebugInfo(),
+        m_pos + offset, m_size);
+}
+
 ExpressionLiteral::ExpressionLiteral(const DebugInfo& info, bool value)
 : Expression(info), m_value(value) {}
 
@@ -268,20 +459,49 @@ ConstantLevel ExpressionLiteral::getConstantLevel(const State&) const
     return ConstantLevel::LITERAL;
 }
 
+void ExpressionLiteral::getCalls(const State&,
+    std::set<const Function*>&) const
+{
+    // nothing to do
+}
+
+void ExpressionLiteral::link(State&)
+{
+    // nothing to do
+}
+
 void ExpressionLiteral::optimize(State& state)
 {
     // nothing to do
 }
 
+void ExpressionLiteral::compile(BytecodeBuilder& builder) const
+{
+    builder.emit(Opcode::PUSH, m_value);
+}
+
+ExpressionPtr ExpressionLiteral::inlineCalls(Inliner&, size_t)
+{
+    return nullptr;
+}
+
+ExpressionPtr ExpressionLiteral::clone(size_t) const
+{
+    return makeNode<ExpressionLiteral>(getDebugInfo(), m_value);
+}
+
 ExpressionLiteralArray::ExpressionLiteralArray(
     const DebugInfo& info, std::vector<bool>&& values)
-: Expression(info), m_values(std::move(values)) {}
+: Expression(info)
+, m_values(std::vector<bool>(values.rbegin(), values.rend())) {}
+
+ExpressionLiteralArray::ExpressionLiteralArray(
+    const DebugInfo& info, const BitStack& values)
+: Expression(info), m_values(values) {}
 
 void ExpressionLiteralArray::resolve(State& state) const
 {
-    for (auto iter = m_values.rbegin(); iter != m_values.rend(); ++iter) {
-        state.push(*iter);
-    }
+    state.pushBits(m_values, 0, m_values.size());
 }
 
 uint64_t ExpressionLiteralArray::getOutputNum(const State& state) const
@@ -299,7 +519,140 @@ ConstantLevel ExpressionLiteralArray::getConstantLevel(const State&) const
     return ConstantLevel::LITERAL;
 }
 
+void ExpressionLiteralArray::getCalls(const State&,
+    std::set<const Function*>&) const
+{
+    // nothing to do
+}
+
+void ExpressionLiteralArray::link(State&)
+{
+    // nothing to do
+}
+
 void ExpressionLiteralArray::optimize(State& state)
 {
     // nothing to do
 }
+
+void ExpressionLiteralArray::compile(BytecodeBuilder& builder) const
+{
+    builder.emitLiterals(m_values);
+}
+
+ExpressionPtr ExpressionLiteralArray::inlineCalls(Inliner&, size_t)
+{
+    return nullptr;
+}
+
+ExpressionPtr ExpressionLiteralArray::clone(size_t) const
+{
+    return makeNode<ExpressionLiteralArray>(getDebugInfo(), m_values);
+}
+
+ExpressionInline::ExpressionInline(const DebugInfo& info, size_t base,
+    size_t inputs, size_t outputs, size_t frameSize,
+    std::vector<ExpressionPtr>&& arguments, std::vector<StatementPtr>&& block)
+: Expression(info), m_base(base), m_inputs(inputs), m_outputs(outputs)
+, m_frameSize(frameSize), m_arguments(std::move(arguments)), m_block(std::move(block)) {}
+
+ExpressionInline::~ExpressionInline() {}
+
+void ExpressionInline::resolve(State& state) const
+{
+    for (const auto& arg : m_arguments) {
+        arg->resolve(state);
+    }
+    // The block only uses its own variables, which start at m_base. The
+    // variable offset is moved so that m_base lands on the inputs, since the
+    // optimizer may resolve this on a different stack than the caller's. The
+    // subtraction may wrap around, but so does adding positions back onto it.
+    // [previous]:[inputs]
+    size_t frame = state.size() - m_inputs;
+    size_t prev_var = state.setVarOffset(frame - m_base);
+    // [previous]:[inputs][outputs][variables]
+    state.resize(frame + m_frameSize);
+    resolveStatements(state, m_block);
+    // [previous]:[outputs]
+    state.copyVars(m_base, m_base + m_inputs, m_outputs);
+    state.setVarOffset(prev_var);
+    state.resize(frame + m_outputs);
+}
+
+uint64_t ExpressionInline::getOutputNum(const State&) const
+{
+    return m_outputs;
+}
+
+void ExpressionInline::check(const State& state) const
+{
+    // nothing to do, the function was checked before it was inlined
+}
+
+ConstantLevel ExpressionInline::getConstantLevel(const State& state) const
+{
+    ConstantLevel block_const = getStatementsConstantLevel(state, m_block);
+    ConstantLevel arg_const = getExpressionsConstantLevel(state, m_arguments);
+    if (block_const == ConstantLevel::LOCAL) {
+        // same as for a function call, the block only affects itself
+        block_const = ConstantLevel::CONSTANT;
+    }
+    return std::min(block_const, arg_const);
+}
+
+void ExpressionInline::getCalls(const State& state,
+    std::set<const Function*>& calls) const
+{
+    getExpressionsCalls(state, m_arguments, calls);
+    getStatementsCalls(state, m_block, calls);
+}
+
+void ExpressionInline::link(State& state)
+{
+    linkExpressions(state, m_arguments);
+    linkStatements(state, m_block);
+}
+
+void ExpressionInline::optimize(State& state)
+{
+    optimizeExpressions(state, m_arguments);
+    optimizeStatements(state, m_block);
+}
+
+void ExpressionInline::compile(BytecodeBuilder& builder) const
+{
+    for (const auto& arg : m_arguments) {
+        arg->compile(builder);
+    }
+    if (builder.getDepth() != m_base + m_inputs) {
+        throw std::logic_error("Inlined function is at the wrong stack depth");
+    }
+    if (m_outputs > 0) {
+        builder.emit(Opcode::ALLOC, m_outputs);
+    }
+    compileStatements(builder, m_block);
+    // move the outputs down over the inputs
+    if (m_inputs > 0 && m_outputs == 1) {
+        builder.emit(Opcode::LOAD, m_base + m_inputs);
+        builder.emit(Opcode::STORE, m_base);
+    } else if (m_inputs > 0 && m_outputs > 1) {
+        builder.emit(Opcode::LOAD_ARRAY, m_base + m_inputs, m_outputs);
+        builder.emit(Opcode::STORE_ARRAY, m_base, m_outputs);
+    }
+    builder.emitTruncate(m_base + m_outputs);
+}
+
+ExpressionPtr ExpressionInline::inlineCalls(Inliner& inliner, size_t depth)
+{
+    // the block was finished before it was inlined
+    inlineExpressions(inliner, m_arguments, depth);
+    return nullptr;
+}
+
+ExpressionPtr ExpressionInline::clone(size_t offset) const
+{
+    return makeNode<ExpressionInline>(getDebugInfo(),
+        m_base + offset, m_inputs, m_outputs, m_frameSize,
+        cloneExpressions(m_arguments, offset),
+        cloneStatements(m_block, offset));
+}
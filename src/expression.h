@@ -5,9 +5,14 @@
 #include <memory>
 #include <set>
 #include "debug.h"
+#include "bitstack.h"
+#include "arena.h"
 
 class State;
 class Function;
+class BytecodeBuilder;
+class Inliner;
+class Statement;
 
 /// Level of a constant expression.
 /// GLOBAL means that this expression affects or is affected by the global state
@@ -28,12 +33,19 @@ enum class ConstantLevel {
 };
 
 /// An expression. An expression has inputs and outputs.
+/// Expressions are allocated from an arena with makeNode.
 class Expression : public Debuggable {
 public:
     Expression(const DebugInfo& info);
+    virtual ~Expression() = default;
     /// Call this expression. Will take getInputNum() values from the stack,
     /// then push getOutputNum() values onto the stack.
     virtual void resolve(State&) const = 0;
+    /// Call this expression, storing its outputs into the variables at the
+    /// given positions instead of pushing them. There must be one position
+    /// for each output. Ignored positions drop their output.
+    virtual void resolveInto(State&,
+        const std::vector<size_t>& positions) const;
     /// Get the number of outputs.
     virtual uint64_t getOutputNum(const State&) const = 0;
     /// Check the expression to ensure consistency and integrity.
@@ -42,11 +54,26 @@ public:
     virtual void check(const State&) const = 0;
     /// Returns the constant-ness of this expression
     virtual ConstantLevel getConstantLevel(const State&) const = 0;
+    /// Add every function that this expression calls directly to the set
+    virtual void getCalls(const State&,
+        std::set<const Function*>&) const = 0;
+    /// Resolve the names of the functions that this expression calls.
+    /// Calls to functions that do not exist are left for check to report.
+    virtual void link(State&) = 0;
     /// Optimize this expression
     virtual void optimize(State&) = 0;
+    /// Lower this expression into bytecode
+    virtual void compile(BytecodeBuilder&) const = 0;
+    /// Inline calls within this expression. The expression's outputs are
+    /// pushed at the given stack depth past the variable offset. Returns an
+    /// expression to replace this one with, or null.
+    virtual NodePtr<Expression> inlineCalls(Inliner&, size_t depth) = 0;
+    /// Copy this expression, moving every variable position up by offset
+    virtual NodePtr<Expression> clone(size_t offset) const = 0;
 };
 
-typedef std::unique_ptr<Expression> ExpressionPtr;
+/// Unique pointer to an expression
+typedef NodePtr<Expression> ExpressionPtr;
 
 /// Count the number of outputs that the given list of expressions has.
 /// This is because an expression can have a variable number of outputs.
@@ -56,12 +83,28 @@ size_t countOutputs(const State& state,
 /// Apply the check function for all of the given expressions
 void checkExpressions(const State& state,
     const std::vector<ExpressionPtr>& expressions);
+/// Link all of the given expressions
+void linkExpressions(State& state, std::vector<ExpressionPtr>& expressions);
 /// Optimize the given list of expressions
 void optimizeExpressions(State& state,
     std::vector<ExpressionPtr>& expressions);
 /// Get the constantness of the given expression list
 ConstantLevel getExpressionsConstantLevel(const State& state,
     const std::vector<ExpressionPtr>& expressions);
+/// Add every function that the given expressions call directly to calls
+void getExpressionsCalls(const State& state,
+    const std::vector<ExpressionPtr>& expressions,
+    std::set<const Function*>& calls);
+/// Inline calls within the given expression, replacing it if required
+void inlineExpression(Inliner& inliner, ExpressionPtr& expression,
+    size_t depth);
+/// Inline calls within the given list of expressions, which are pushed one
+/// after another starting at the given stack depth
+void inlineExpressions(Inliner& inliner,
+    std::vector<ExpressionPtr>& expressions, size_t depth);
+/// Copy the given list of expressions, moving variable positions up by offset
+std::vector<ExpressionPtr> cloneExpressions(
+    const std::vector<ExpressionPtr>& expressions, size_t offset);
 
 /// A NAND expression. NANDS two values together
 class ExpressionNand : public Expression {
@@ -73,24 +116,39 @@ public:
     uint64_t getOutputNum(const State&) const override;
     void check(const State&) const override;
     ConstantLevel getConstantLevel(const State&) const override;
+    void getCalls(const State&, std::set<const Function*>&) const override;
+    void link(State&) override;
     void optimize(State&) override;
+    void compile(BytecodeBuilder&) const override;
+    ExpressionPtr inlineCalls(Inliner&, size_t depth) override;
+    ExpressionPtr clone(size_t offset) const override;
 };
 
 /// A function expression. Calls a function when evaluated
 class ExpressionFunction : public Expression {
+    /// Name of the function, only kept for error messages
     std::string m_functionName;
     std::vector<ExpressionPtr> m_arguments;
-    // mutable is fine here since this is just a cache so the function doesn't
-    // have to be looked up every time
-    mutable Function *m_function;
+    /// The called function, which is set when this expression is linked
+    Function *m_function;
+    /// Number of inputs and outputs of the called function
+    uint64_t m_inputNum;
+    uint64_t m_outputNum;
 public:
     ExpressionFunction(const DebugInfo&, const std::string&,
         std::vector<ExpressionPtr>&&);
     void resolve(State&) const override;
+    void resolveInto(State&,
+        const std::vector<size_t>& positions) const override;
     uint64_t getOutputNum(const State&) const override;
     void check(const State&) const override;
     ConstantLevel getConstantLevel(const State&) const override;
+    void getCalls(const State&, std::set<const Function*>&) const override;
+    void link(State&) override;
     void optimize(State&) override;
+    void compile(BytecodeBuilder&) const override;
+    ExpressionPtr inlineCalls(Inliner&, size_t depth) override;
+    ExpressionPtr clone(size_t offset) const override;
 };
 
 /// A variable expression. Represents a variable
@@ -102,7 +160,12 @@ public:
     uint64_t getOutputNum(const State&) const override;
     void check(const State&) const override;
     ConstantLevel getConstantLevel(const State&) const override;
+    void getCalls(const State&, std::set<const Function*>&) const override;
+    void link(State&) override;
     void optimize(State&) override;
+    void compile(BytecodeBuilder&) const override;
+    ExpressionPtr inlineCalls(Inliner&, size_t depth) override;
+    ExpressionPtr clone(size_t offset) const override;
 };
 
 /// A variable expression. Represents a variable
@@ -115,7 +178,12 @@ public:
     uint64_t getOutputNum(const State&) const override;
     void check(const State&) const override;
     ConstantLevel getConstantLevel(const State&) const override;
+    void getCalls(const State&, std::set<const Function*>&) const override;
+    void link(State&) override;
     void optimize(State&) override;
+    void compile(BytecodeBuilder&) const override;
+    ExpressionPtr inlineCalls(Inliner&, size_t depth) override;
+    ExpressionPtr clone(size_t offset) const override;
 };
 
 /// A literal expression
@@ -127,18 +195,62 @@ public:
     uint64_t getOutputNum(const State&) const override;
     void check(const State&) const override;
     ConstantLevel getConstantLevel(const State&) const override;
+    void getCalls(const State&, std::set<const Function*>&) const override;
+    void link(State&) override;
     void optimize(State&) override;
+    void compile(BytecodeBuilder&) const override;
+    ExpressionPtr inlineCalls(Inliner&, size_t depth) override;
+    ExpressionPtr clone(size_t offset) const override;
 };
 
 /// A literal array expression
 class ExpressionLiteralArray : public Expression {
-    std::vector<bool> m_values;
+    /// Values, stored in the order that they are pushed
+    BitStack m_values;
 public:
     /// Constructor expects values in reverse order
     ExpressionLiteralArray(const DebugInfo&, std::vector<bool>&&);
+    /// Create from values in the order that they are pushed
+    ExpressionLiteralArray(const DebugInfo&, const BitStack&);
     void resolve(State&) const override;
     uint64_t getOutputNum(const State&) const override;
     void check(const State&) const override;
     ConstantLevel getConstantLevel(const State&) const override;
+    void getCalls(const State&, std::set<const Function*>&) const override;
+    void link(State&) override;
     void optimize(State&) override;
+    void compile(BytecodeBuilder&) const override;
+    ExpressionPtr inlineCalls(Inliner&, size_t depth) override;
+    ExpressionPtr clone(size_t offset) const override;
+};
+
+/// The body of a function, inlined into its caller.
+/// Behaves the same as calling the function, except that the body's variables
+/// have been moved up to the stack depth of the call, so that no new frame is
+/// required.
+class ExpressionInline : public Expression {
+    /// Stack depth of the inlined function's frame
+    size_t m_base;
+    size_t m_inputs;
+    size_t m_outputs;
+    /// Frame size of the inlined function
+    size_t m_frameSize;
+    std::vector<ExpressionPtr> m_arguments;
+    std::vector<NodePtr<Statement>> m_block;
+public:
+    ExpressionInline(const DebugInfo&, size_t base, size_t inputs,
+        size_t outputs, size_t frameSize,
+        std::vector<ExpressionPtr>&& arguments,
+        std::vector<NodePtr<Statement>>&& block);
+    ~ExpressionInline();
+    void resolve(State&) const override;
+    uint64_t getOutputNum(const State&) const override;
+    void check(const State&) const override;
+    ConstantLevel getConstantLevel(const State&) const override;
+    void getCalls(const State&, std::set<const Function*>&) const override;
+    void link(State&) override;
+    void optimize(State&) override;
+    void compile(BytecodeBuilder&) const override;
+    ExpressionPtr inlineCalls(Inliner&, size_t depth) override;
+    ExpressionPtr clone(size_t offset) const override;
 };
@@ -1,20 +1,24 @@
 #include "function.h"
 #include "state.h"
+#include "effects.h"
 #include <set>
+#include <stdexcept>
 #include <sstream>
 
-Function::Function() : m_recurse(0) {}
+Function::Function() {}
+
+void Function::callInto(State& state,
+    const std::vector<size_t>& positions) const
+{
+    call(state);
+    state.popVarsInto(positions);
+}
 
 FunctionExternal::FunctionExternal(std::function<void(State&)> func,
     uint64_t inputs, uint64_t outputs, ConstantLevel constant)
 : Function(), m_inputNum(inputs), m_outputNum(outputs), m_function(func)
 , m_constant(constant) {}
 
-size_t Function::getRecursion() const
-{
-    return m_recurse;
-}
-
 uint64_t FunctionExternal::getInputNum() const
 {
     return m_inputNum;
@@ -25,6 +29,11 @@ uint64_t FunctionExternal::getOutputNum() const
     return m_outputNum;
 }
 
+uint64_t FunctionExternal::getFrameSize() const
+{
+    return m_inputNum + m_outputNum;
+}
+
 void FunctionExternal::call(State& state) const
 {
     m_function(state);
@@ -40,16 +49,116 @@ ConstantLevel FunctionExternal::getConstantLevel(const State&) const
     return m_constant;
 }
 
+ConstantLevel FunctionExternal::calculateConstantLevel(const State&) const
+{
+    return m_constant;
+}
+
+bool FunctionExternal::hasConstantLevel() const
+{
+    return true;
+}
+
+void FunctionExternal::setConstantLevel(ConstantLevel level) const
+{
+    // nothing to do, the constant-ness is given when the function is made
+}
+
+bool FunctionExternal::isRecursive(const State&) const
+{
+    return false;
+}
+
+void FunctionExternal::setRecursive(bool) const
+{
+    // nothing to do, external functions never call back into a program
+}
+
+void FunctionExternal::getCalls(const State&,
+    std::set<const Function*>& calls) const
+{
+    // nothing to do
+}
+
+void FunctionExternal::link(State& state)
+{
+    // nothing to do
+}
+
 void FunctionExternal::optimize(State& state)
 {
     // nothing to do
 }
 
+void FunctionExternal::compile(const State& state)
+{
+    // nothing to do
+}
+
+const Bytecode *FunctionExternal::getBytecode() const
+{
+    return nullptr;
+}
+
+void FunctionExternal::jit(Jit& jit)
+{
+    // nothing to do, external functions are called through a bridge
+}
+
+void FunctionExternal::transpile(Transpiler& transpiler,
+    const std::string& name) const
+{
+    transpiler.addExternal(name, *this);
+}
+
+void FunctionExternal::memoize(const State& state, size_t capacity)
+{
+    // nothing to do, external functions may have side effects
+}
+
+const MemoCache *FunctionExternal::getMemo() const
+{
+    return nullptr;
+}
+
+void FunctionExternal::inlineCalls(Inliner& inliner)
+{
+    // nothing to do
+}
+
+const std::vector<StatementPtr> *FunctionExternal::getBlock() const
+{
+    return nullptr;
+}
+
+void FunctionExternal::layout()
+{
+    // nothing to do
+}
+
+std::unique_ptr<Bytecode> FunctionExternal::flatten(const State& state,
+    const CircuitOptions& options, size_t& before, size_t& after) const
+{
+    return nullptr;
+}
+
+std::unique_ptr<Bytecode> FunctionExternal::replaceIdiom(const State& state,
+    IntOp& op, size_t& width) const
+{
+    return nullptr;
+}
+
+void FunctionExternal::setBytecode(std::unique_ptr<Bytecode> bytecode)
+{
+    // nothing to do
+}
+
 FunctionInternal::FunctionInternal(
-    size_t inputs, size_t outputs,
+    size_t inputs, size_t outputs, size_t frameSize,
     std::vector<StatementPtr>&& block)
-: Function(), m_inputs(inputs), m_outputs(outputs), m_block(std::move(block))
-, m_hasCalculatedConstant(false) {}
+: Function(), m_inputs(inputs), m_outputs(outputs), m_frameSize(frameSize)
+, m_block(std::move(block))
+, m_hasCalculatedConstant(false), m_recursive(false), m_native(nullptr) {}
 
 uint64_t FunctionInternal::getInputNum() const
 {
@@ -61,29 +170,96 @@ uint64_t FunctionInternal::getOutputNum() const
     return m_outputs;
 }
 
+uint64_t FunctionInternal::getFrameSize() const
+{
+    return m_frameSize;
+}
+
 void FunctionInternal::call(State& state) const
 {
+    if (m_memo) {
+        std::vector<uint64_t> key = m_memo->getKey(state);
+        if (m_memo->lookup(state, key)) {
+            return;
+        }
+        run(state);
+        m_memo->store(state, std::move(key));
+        return;
+    }
+    run(state);
+}
+
+void FunctionInternal::callInto(State& state,
+    const std::vector<size_t>& positions) const
+{
+    if (m_memo || m_native) {
+        // these push their outputs
+        Function::callInto(state, positions);
+        return;
+    }
+    run(state, &positions);
+}
+
+void FunctionInternal::run(State& state,
+    const std::vector<size_t> *destinations) const
+{
+    CallScope scope(state);
+    if (m_native) {
+        state.callNative(m_native, m_inputs, m_outputs);
+        return;
+    }
     // get the current size of the state
     // :[previous][inputs]
     size_t prev_size = state.size();
     // set the variable offset to include all of this function's inputs
     // [previous]:[inputs]
     size_t prev_var = state.setVarOffset(prev_size - m_inputs);
-    // put values for outputs onto the stack
-    // [previous]:[inputs][outputs]
-    for (size_t i = 0; i < m_outputs; ++i) {
-        state.push(0);
-    }
     // resolve statements
-    for (const auto& stmt : m_block) {
-        stmt->resolve(state);
+    if (m_bytecode) {
+        // put values for outputs onto the stack, the bytecode allocates its
+        // own variables
+        // [previous]:[inputs][outputs]
+        state.resize(prev_size + m_outputs);
+        m_bytecode->execute(state);
+    } else {
+        // reserve the whole frame at once, so that statements never grow the
+        // stack
+        // [previous]:[inputs][outputs][variables]
+        state.resize(prev_size - m_inputs + m_frameSize);
+        resolveStatements(state, m_block);
+    }
+    if (state.isChecked() && (state.getVarOffset() != prev_size - m_inputs
+     || state.size() < prev_size + m_outputs)) {
+        throw std::runtime_error("Stack frame was corrupted by a call");
+    }
+    if (destinations) {
+        // store the outputs straight into the caller's variables, copying
+        // each run of consecutive positions at once. The runs are copied from
+        // the last to the first, so that when a variable is given twice the
+        // first output wins, as it does with popVarsInto.
+        // :[previous][inputs][outputs][garbage]
+        state.setVarOffset(prev_var);
+        size_t outputs = prev_size - prev_var;
+        size_t end = m_outputs;
+        while (end > 0) {
+            size_t pos = (*destinations)[end - 1];
+            size_t num = 1;
+            if (pos != ignorePosition) {
+                while (num < end && num <= pos
+                    && (*destinations)[end - 1 - num] == pos - num) {
+                    ++num;
+                }
+                state.copyVars(pos - (num - 1), outputs + end - num, num);
+            }
+            end -= num;
+        }
+        // :[previous]
+        state.resize(prev_size - m_inputs);
+        return;
     }
     // put outputs onto the stack
     // [previous]:[outputs][garbage]
-    for (size_t i = 0; i < m_outputs; i ++) {
-        bool value = state.getVar(i + m_inputs);
-        state.setVar(i, value);
-    }
+    state.copyVars(0, m_inputs, m_outputs);
     // put variable offset to its previous value
     // :[previous][outputs][garbage]
     state.setVarOffset(prev_var);
@@ -99,21 +275,153 @@ void FunctionInternal::check(const State& state) const
 
 ConstantLevel FunctionInternal::getConstantLevel(const State& state) const
 {
-    if (m_hasCalculatedConstant) {
-        return m_constant;
+    if (!m_hasCalculatedConstant) {
+        analyzeEffects(state, *this);
     }
-    if (m_recurse) {
-        // Recursive function can not be optimized
-        return ConstantLevel::GLOBAL;
+    return m_constant;
+}
+
+ConstantLevel FunctionInternal::calculateConstantLevel(
+    const State& state) const
+{
+    return getStatementsConstantLevel(state, m_block);
+}
+
+bool FunctionInternal::hasConstantLevel() const
+{
+    return m_hasCalculatedConstant;
+}
+
+void FunctionInternal::setConstantLevel(ConstantLevel level) const
+{
+    m_constant = level;
+    m_hasCalculatedConstant = true;
+}
+
+bool FunctionInternal::isRecursive(const State& state) const
+{
+    if (!m_hasCalculatedConstant) {
+        analyzeEffects(state, *this);
     }
-    ++ m_recurse;
-    auto ret = getStatementsConstantLevel(state, m_block);
-    -- m_recurse;
-    m_constant = ret;
-    return ret;
+    return m_recursive;
+}
+
+void FunctionInternal::setRecursive(bool recursive) const
+{
+    m_recursive = recursive;
+}
+
+void FunctionInternal::getCalls(const State& state,
+    std::set<const Function*>& calls) const
+{
+    getStatementsCalls(state, m_block, calls);
+}
+
+void FunctionInternal::link(State& state)
+{
+    linkStatements(state, m_block);
 }
 
 void FunctionInternal::optimize(State& state)
 {
     optimizeStatements(state, m_block);
 }
+
+void FunctionInternal::compile(const State& state)
+{
+    BytecodeBuilder builder(state, m_inputs + m_outputs);
+    for (const auto& stmt : m_block) {
+        compileStatement(builder, *stmt);
+    }
+    m_bytecode = std::make_unique<Bytecode>(builder.finish());
+}
+
+const Bytecode *FunctionInternal::getBytecode() const
+{
+    return m_bytecode.get();
+}
+
+void FunctionInternal::jit(Jit& jit)
+{
+    // Memoized functions are called through the interpreter, so that native
+    // callers still go through the cache.
+    if (m_bytecode && !m_memo) {
+        jit.add(*this, *m_bytecode);
+    }
+}
+
+void FunctionInternal::transpile(Transpiler& transpiler,
+    const std::string& name) const
+{
+    if (!m_bytecode) {
+        throw std::runtime_error("Function must be lowered before transpiling");
+    }
+    transpiler.addInternal(name, *this, *m_bytecode);
+}
+
+void FunctionInternal::memoize(const State& state, size_t capacity)
+{
+    // Functions without outputs are only worth running for their effects, a
+    // truth table is already faster than a cache, and short functions run
+    // faster than a lookup
+    if (m_outputs > 0 && getConstantLevel(state) >= ConstantLevel::LOCAL
+     && !(m_bytecode && !m_bytecode->getTables().empty())
+     && isWorthMemoizing(*this)) {
+        m_memo = std::make_unique<MemoCache>(m_inputs, m_outputs, capacity);
+    }
+}
+
+const MemoCache *FunctionInternal::getMemo() const
+{
+    return m_memo.get();
+}
+
+void FunctionInternal::inlineCalls(Inliner& inliner)
+{
+    inlineStatements(inliner, m_block, m_inputs + m_outputs);
+}
+
+const std::vector<StatementPtr> *FunctionInternal::getBlock() const
+{
+    return &m_block;
+}
+
+void FunctionInternal::layout()
+{
+    m_block = cloneStatements(m_block, 0);
+}
+
+std::unique_ptr<Bytecode> FunctionInternal::flatten(const State& state,
+    const CircuitOptions& options, size_t& before, size_t& after) const
+{
+    Circuit circuit(m_inputs);
+    std::vector<Circuit::Node> outputs;
+    if (!m_bytecode || !buildCircuit(*this, options, circuit, outputs)) {
+        return nullptr;
+    }
+    before = circuit.getNandCount();
+    after = circuit.getLive(outputs).size();
+    return std::make_unique<Bytecode>(lowerCircuit(state, circuit, outputs));
+}
+
+std::unique_ptr<Bytecode> FunctionInternal::replaceIdiom(const State& state,
+    IntOp& op, size_t& width) const
+{
+    Circuit circuit(m_inputs);
+    std::vector<Circuit::Node> outputs;
+    if (!m_bytecode || !buildCircuit(*this, CircuitOptions(), circuit, outputs)
+     || !recognizeIdiom(circuit, outputs, op, width)) {
+        return nullptr;
+    }
+    return std::make_unique<Bytecode>(lowerIdiom(state, op, width));
+}
+
+void FunctionInternal::setBytecode(std::unique_ptr<Bytecode> bytecode)
+{
+    m_bytecode = std::move(bytecode);
+}
+
+void FunctionInternal::setNative(JitFunction native)
+{
+    m_native = native;
+}
@@ -3,33 +3,97 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <set>
 #include "debug.h"
 #include "statement.h"
+#include "bytecode.h"
+#include "jit.h"
+#include "transpiler.h"
+#include "memo.h"
+#include "circuit.h"
+#include "idiom.h"
 
 class State;
+class Inliner;
 
 /// A function that can be called
 /// Has a set number of inputs and outputs
 class Function : public Debuggable {
-protected:
-    mutable size_t m_recurse;
 public:
     Function();
+    virtual ~Function() = default;
     /// get number of inputs
     virtual uint64_t getInputNum() const = 0;
     /// get number of outputs
     virtual uint64_t getOutputNum() const = 0;
+    /// get number of variables in this function's frame, including the
+    /// inputs and outputs
+    virtual uint64_t getFrameSize() const = 0;
     /// call this function
     virtual void call(State&) const = 0;
+    /// call this function, storing its outputs into the caller's variables
+    /// at the given positions instead of pushing them
+    virtual void callInto(State&,
+        const std::vector<size_t>& positions) const;
     /// Check the function to ensure consistency and integrity.
     /// Throws an exception on failure.
     virtual void check(const State&) const = 0;
     /// Returns the constant-ness of this function
     virtual ConstantLevel getConstantLevel(const State&) const = 0;
+    /// Work out the constant-ness of this function from its body, given what
+    /// is currently known about the functions that it calls
+    virtual ConstantLevel calculateConstantLevel(const State&) const = 0;
+    /// Returns true if the constant-ness of this function is known
+    virtual bool hasConstantLevel() const = 0;
+    /// Set the constant-ness of this function
+    virtual void setConstantLevel(ConstantLevel level) const = 0;
+    /// Returns true if this function can call itself, directly or through
+    /// other functions. Calls to such functions are never run ahead of time,
+    /// since they may not finish.
+    virtual bool isRecursive(const State&) const = 0;
+    /// Set whether this function can call itself
+    virtual void setRecursive(bool recursive) const = 0;
+    /// Add every function that this function calls directly to the set
+    virtual void getCalls(const State&,
+        std::set<const Function*>& calls) const = 0;
+    /// Resolve the names of the functions that this function calls
+    virtual void link(State& state) = 0;
     /// Optimize this function
     virtual void optimize(State& state) = 0;
-    /// Get the recursion level of this function
-    size_t getRecursion() const;
+    /// Lower this function into bytecode
+    virtual void compile(const State& state) = 0;
+    /// Get the bytecode of this function, or null if it has none
+    virtual const Bytecode *getBytecode() const = 0;
+    /// Add this function to the JIT, if it has been lowered into bytecode
+    virtual void jit(Jit& jit) = 0;
+    /// Add this function to a C program under the given name
+    virtual void transpile(Transpiler& transpiler,
+        const std::string& name) const = 0;
+    /// Cache the results of this function, keeping up to capacity results,
+    /// if it has no global effects
+    virtual void memoize(const State& state, size_t capacity) = 0;
+    /// Get the result cache of this function, or null if it has none
+    virtual const MemoCache *getMemo() const = 0;
+    /// Inline calls to other functions into this function
+    virtual void inlineCalls(Inliner& inliner) = 0;
+    /// Get the statements of this function, or null if it has none
+    virtual const std::vector<StatementPtr> *getBlock() const = 0;
+    /// Copy the statements of this function into the current arena, so that
+    /// each statement is laid out before the statements that follow it
+    virtual void layout() = 0;
+    /// Lower this function into a circuit of NAND gates, if it has no
+    /// data-dependent control flow and calls no external functions. Returns
+    /// the circuit's bytecode or null, and sets the number of NANDs before
+    /// and gates after.
+    virtual std::unique_ptr<Bytecode> flatten(const State& state,
+        const CircuitOptions& options, size_t& before, size_t& after) const = 0;
+    /// Recognize this function as an integer operation, if its circuit is
+    /// one. Returns the operation's bytecode or null, and sets the operation
+    /// and its width.
+    virtual std::unique_ptr<Bytecode> replaceIdiom(const State& state,
+        IntOp& op, size_t& width) const = 0;
+    /// Replace the bytecode of this function
+    virtual void setBytecode(std::unique_ptr<Bytecode> bytecode) = 0;
 };
 
 typedef std::unique_ptr<Function> FunctionPtr;
@@ -45,26 +109,97 @@ public:
                      uint64_t inputs, uint64_t outputs, ConstantLevel constant);
     uint64_t getInputNum() const override;
     uint64_t getOutputNum() const override;
+    uint64_t getFrameSize() const override;
     void call(State&) const override;
     void check(const State&) const override;
     ConstantLevel getConstantLevel(const State&) const override;
+    ConstantLevel calculateConstantLevel(const State&) const override;
+    bool hasConstantLevel() const override;
+    void setConstantLevel(ConstantLevel level) const override;
+    bool isRecursive(const State&) const override;
+    void setRecursive(bool recursive) const override;
+    void getCalls(const State&,
+        std::set<const Function*>& calls) const override;
+    void link(State& state) override;
     void optimize(State& state) override;
+    void compile(const State& state) override;
+    const Bytecode *getBytecode() const override;
+    void jit(Jit& jit) override;
+    void transpile(Transpiler& transpiler,
+        const std::string& name) const override;
+    void memoize(const State& state, size_t capacity) override;
+    const MemoCache *getMemo() const override;
+    void inlineCalls(Inliner& inliner) override;
+    const std::vector<StatementPtr> *getBlock() const override;
+    void layout() override;
+    std::unique_ptr<Bytecode> flatten(const State& state,
+        const CircuitOptions& options,
+        size_t& before, size_t& after) const override;
+    std::unique_ptr<Bytecode> replaceIdiom(const State& state,
+        IntOp& op, size_t& width) const override;
+    void setBytecode(std::unique_ptr<Bytecode> bytecode) override;
 };
 
 /// An internal Nandlang function
 class FunctionInternal : public Function {
     size_t m_inputs;
     size_t m_outputs;
+    /// Number of variables, including inputs and outputs. Every variable has
+    /// a fixed position in the frame, which is reserved once per call.
+    size_t m_frameSize;
     std::vector<StatementPtr> m_block;
     mutable ConstantLevel m_constant;
     mutable bool m_hasCalculatedConstant;
+    /// Whether this function can call itself. Worked out along with the
+    /// constant-ness.
+    mutable bool m_recursive;
+    /// Compiled bytecode. If this is null, the statements are resolved instead.
+    std::unique_ptr<Bytecode> m_bytecode;
+    /// Native code. If this is set, it is used instead of the bytecode.
+    JitFunction m_native;
+    /// Results of previous calls. Only set for functions without global
+    /// effects.
+    mutable std::unique_ptr<MemoCache> m_memo;
+    /// Run this function without looking at its result cache. If
+    /// destinations is set, the outputs are stored into the caller's
+    /// variables at those positions instead of being pushed.
+    void run(State&, const std::vector<size_t> *destinations = nullptr) const;
 public:
-    FunctionInternal(size_t inputs, size_t outputs,
+    FunctionInternal(size_t inputs, size_t outputs, size_t frameSize,
                      std::vector<StatementPtr>&& block);
     uint64_t getInputNum() const override;
     uint64_t getOutputNum() const override;
+    uint64_t getFrameSize() const override;
     void call(State&) const override;
+    void callInto(State&,
+        const std::vector<size_t>& positions) const override;
     void check(const State&) const override;
     ConstantLevel getConstantLevel(const State&) const override;
+    ConstantLevel calculateConstantLevel(const State&) const override;
+    bool hasConstantLevel() const override;
+    void setConstantLevel(ConstantLevel level) const override;
+    bool isRecursive(const State&) const override;
+    void setRecursive(bool recursive) const override;
+    void getCalls(const State&,
+        std::set<const Function*>& calls) const override;
+    void link(State& state) override;
     void optimize(State& state) override;
+    void compile(const State& state) override;
+    const Bytecode *getBytecode() const override;
+    void jit(Jit& jit) override;
+    void transpile(Transpiler& transpiler,
+        const std::string& name) const override;
+    void memoize(const State& state, size_t capacity) override;
+    const MemoCache *getMemo() const override;
+    void inlineCalls(Inliner& inliner) override;
+    const std::vector<StatementPtr> *getBlock() const override;
+    void layout() override;
+    std::unique_ptr<Bytecode> flatten(const State& state,
+        const CircuitOptions& options,
+        size_t& before, size_t& after) const override;
+    std::unique_ptr<Bytecode> replaceIdiom(const State& state,
+        IntOp& op, size_t& width) const override;
+    void setBytecode(std::unique_ptr<Bytecode> bytecode) override;
+    /// Set the native entry point of this function
+    void setNative(JitFunction native);
 };
@@ -0,0 +1,497 @@
+#include "idiom.h"
+#include "bytecode.h"
+#include <array>
+#include <random>
+#include <unordered_map>
+
+namespace {
+
+/// Number of 64-bit words of random inputs that circuits are simulated on
+const size_t simulationWords = 4;
+/// Maximum number of nodes in the cone of a single carry or output bit
+const size_t maxConeSize = 256;
+/// Circuits with up to this many input bits are proven by trying every input
+const size_t maxExhaustiveInputs = 16;
+
+const IntOp intOps[] = {
+    IntOp::ADD, IntOp::SUB, IntOp::NEG, IntOp::EQ, IntOp::NE,
+    IntOp::LT, IntOp::LE, IntOp::GT, IntOp::GE
+};
+
+typedef std::array<uint64_t, simulationWords> Signature;
+
+/// Get a mask of the lowest num bits. num must be at most 64.
+uint64_t lowMask(size_t num)
+{
+    return num >= 64 ? ~uint64_t(0) : (uint64_t(1) << num) - 1;
+}
+
+bool isCompare(IntOp op)
+{
+    return op != IntOp::ADD && op != IntOp::SUB && op != IntOp::NEG;
+}
+
+/// Every operation is computed from the least significant bit up, with a
+/// carry that is passed from one bit to the next. These describe the carry
+/// into the lowest bit, and how each bit and its incoming carry give the
+/// output bit and the outgoing carry. Comparisons only have a single output,
+/// which is computed from the last carry.
+bool getInitialCarry(IntOp op)
+{
+    switch (op) {
+    case IntOp::SUB:
+    case IntOp::NEG:
+    case IntOp::EQ:
+    case IntOp::NE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/// Get the outgoing carry of one bit, given the operand bits and the incoming
+/// carry. Works on single bits as well as on 64 bits at a time.
+uint64_t stepCarry(IntOp op, uint64_t a, uint64_t b, uint64_t c)
+{
+    switch (op) {
+    case IntOp::ADD:
+        return (a & b) | (c & (a ^ b));
+    case IntOp::SUB:
+        b = ~b;
+        return (a & b) | (c & (a ^ b));
+    case IntOp::NEG:
+        return ~a & c;
+    case IntOp::EQ:
+    case IntOp::NE:
+        // no difference so far
+        return c & ~(a ^ b);
+    case IntOp::LT:
+    case IntOp::GE:
+        // a < b so far
+        return (~(a ^ b) & c) | (~a & b);
+    case IntOp::GT:
+    case IntOp::LE:
+        // a > b so far
+        return (~(a ^ b) & c) | (a & ~b);
+    }
+    return 0;
+}
+
+/// Get the output bit of one bit of an arithmetic operation
+uint64_t stepOutput(IntOp op, uint64_t a, uint64_t b, uint64_t c)
+{
+    switch (op) {
+    case IntOp::ADD:
+        return a ^ b ^ c;
+    case IntOp::SUB:
+        return a ^ ~b ^ c;
+    case IntOp::NEG:
+        return ~a ^ c;
+    default:
+        return 0;
+    }
+}
+
+/// Get the output of a comparison from the last carry
+uint64_t finalOutput(IntOp op, uint64_t c)
+{
+    switch (op) {
+    case IntOp::NE:
+    case IntOp::GE:
+    case IntOp::LE:
+        return ~c;
+    default:
+        return c;
+    }
+}
+
+/// Checks that a circuit computes an operation, one bit at a time
+class IdiomProver {
+    const Circuit& m_circuit;
+    const std::vector<Circuit::Node>& m_outputs;
+    IntOp m_op;
+    size_t m_width;
+    const std::vector<Signature>& m_values;
+    /// Simulated operand bits, least significant bit first
+    std::vector<Signature> m_a, m_b;
+    /// Simulated carries of the operation. m_carries[i] goes into bit i.
+    std::vector<Signature> m_carries;
+    /// Nodes that hold each carry, and whether they hold its negation. A
+    /// carry may be computed by more than one node.
+    std::vector<std::vector<std::pair<Circuit::Node, bool>>> m_carryNodes;
+
+    /// Get the node of an operand bit, counting from the least significant
+    Circuit::Node getA(size_t bit) const
+    {
+        return m_circuit.input(m_width - 1 - bit);
+    }
+
+    Circuit::Node getB(size_t bit) const
+    {
+        return m_circuit.input(2 * m_width - 1 - bit);
+    }
+
+    /// Evaluate a node, where only the given leaves may be reached. Returns
+    /// false if any other input bit is reached or the cone is too large.
+    bool evaluate(Circuit::Node node,
+        std::unordered_map<Circuit::Node, bool>& values, bool& value) const
+    {
+        auto iter = values.find(node);
+        if (iter != values.end()) {
+            value = iter->second;
+            return true;
+        }
+        if (m_circuit.isConstant(node)) {
+            value = node == Circuit::one;
+            return true;
+        }
+        if (m_circuit.isInput(node) || values.size() > maxConeSize) {
+            return false;
+        }
+        bool left, right;
+        if (!evaluate(m_circuit.getLeft(node), values, left)
+         || !evaluate(m_circuit.getRight(node), values, right)) {
+            return false;
+        }
+        value = !(left && right);
+        values[node] = value;
+        return true;
+    }
+
+    /// Check that a node is the given function of the bits at position bit,
+    /// for every value of the operand bits and the carry into that position.
+    bool checkBit(Circuit::Node node, size_t bit,
+        uint64_t (*expected)(IntOp, uint64_t, uint64_t, uint64_t),
+        bool negated) const
+    {
+        bool hasB = m_op != IntOp::NEG;
+        for (unsigned i = 0; i < 8; ++i) {
+            bool a = i & 1;
+            bool b = hasB && (i & 2);
+            bool c = i & 4;
+            if ((!hasB && (i & 2))
+             || (bit == 0 && c != getInitialCarry(m_op))) {
+                // the lowest bit only has the initial carry
+                continue;
+            }
+            std::unordered_map<Circuit::Node, bool> values;
+            values[getA(bit)] = a;
+            if (hasB) {
+                values[getB(bit)] = b;
+            }
+            if (bit > 0) {
+                for (const auto& carry : m_carryNodes[bit]) {
+                    values[carry.first] = c != carry.second;
+                }
+            }
+            bool value;
+            if (!evaluate(node, values, value)) {
+                return false;
+            }
+            bool want = expected(m_op, a, b, c) & 1;
+            if (value != (want != negated)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static uint64_t compareOutput(IntOp op, uint64_t a, uint64_t b,
+        uint64_t c)
+    {
+        return finalOutput(op, stepCarry(op, a, b, c));
+    }
+
+public:
+    IdiomProver(const Circuit& circuit,
+        const std::vector<Circuit::Node>& outputs, IntOp op, size_t width,
+        const std::vector<Signature>& values)
+    : m_circuit(circuit), m_outputs(outputs), m_op(op), m_width(width),
+      m_values(values)
+    {
+        for (size_t i = 0; i < width; ++i) {
+            m_a.push_back(values[getA(i)]);
+            m_b.push_back(op == IntOp::NEG ? Signature() : values[getB(i)]);
+        }
+        Signature carry;
+        carry.fill(getInitialCarry(op) ? ~uint64_t(0) : 0);
+        m_carries.push_back(carry);
+        for (size_t i = 0; i < width; ++i) {
+            for (size_t w = 0; w < simulationWords; ++w) {
+                carry[w] = stepCarry(op, m_a[i][w], m_b[i][w], carry[w]);
+            }
+            m_carries.push_back(carry);
+        }
+    }
+
+    /// Compare the simulated outputs against the operation
+    bool simulate() const
+    {
+        for (size_t w = 0; w < simulationWords; ++w) {
+            if (isCompare(m_op)) {
+                if (m_values[m_outputs[0]][w]
+                    != finalOutput(m_op, m_carries[m_width][w])) {
+                    return false;
+                }
+                continue;
+            }
+            for (size_t i = 0; i < m_width; ++i) {
+                uint64_t want = stepOutput(m_op, m_a[i][w], m_b[i][w],
+                    m_carries[i][w]);
+                if (m_values[m_outputs[m_width - 1 - i]][w] != want) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    /// Find the node of every carry and check every bit
+    bool prove()
+    {
+        m_carryNodes.assign(1, {});
+        for (size_t i = 1; i < m_width; ++i) {
+            // Any node that matches the carry in simulation is a candidate
+            m_carryNodes.emplace_back();
+            for (Circuit::Node node = 0; node < m_circuit.size(); ++node) {
+                if (m_circuit.isConstant(node) || m_circuit.isInput(node)) {
+                    continue;
+                }
+                Signature inverse;
+                for (size_t w = 0; w < simulationWords; ++w) {
+                    inverse[w] = ~m_values[node][w];
+                }
+                for (bool negated : {false, true}) {
+                    if ((negated ? inverse : m_values[node]) != m_carries[i]
+                     || !checkBit(node, i - 1, stepCarry, negated)) {
+                        continue;
+                    }
+                    m_carryNodes.back().emplace_back(node, negated);
+                    break;
+                }
+            }
+            if (m_carryNodes.back().empty()) {
+                return false;
+            }
+        }
+        if (isCompare(m_op)) {
+            return checkBit(m_outputs[0], m_width - 1, compareOutput, false);
+        }
+        for (size_t i = 0; i < m_width; ++i) {
+            if (!checkBit(m_outputs[m_width - 1 - i], i, stepOutput, false)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+/// Check that a circuit computes an operation for every possible input,
+/// 64 inputs at a time
+bool proveExhaustive(const Circuit& circuit,
+    const std::vector<Circuit::Node>& outputs, IntOp op, size_t width)
+{
+    // lane patterns of the lowest six input bits, which together go through
+    // every value within a single word
+    const uint64_t patterns[] = {
+        0xAAAAAAAAAAAAAAAA, 0xCCCCCCCCCCCCCCCC, 0xF0F0F0F0F0F0F0F0,
+        0xFF00FF00FF00FF00, 0xFFFF0000FFFF0000, 0xFFFFFFFF00000000
+    };
+    size_t inputs = circuit.getInputNum();
+    std::vector<Circuit::Node> live = circuit.getLive(outputs);
+    std::vector<uint64_t> values(circuit.size());
+    std::vector<uint64_t> results(outputs.size());
+    values[Circuit::one] = ~uint64_t(0);
+    size_t blocks = inputs > 6 ? size_t(1) << (inputs - 6) : 1;
+    for (size_t block = 0; block < blocks; ++block) {
+        for (size_t i = 0; i < inputs; ++i) {
+            values[circuit.input(i)] = i < 6 ? patterns[i]
+                : ((block >> (i - 6)) & 1) ? ~uint64_t(0) : 0;
+        }
+        for (Circuit::Node node : live) {
+            values[node] = ~(values[circuit.getLeft(node)]
+                           & values[circuit.getRight(node)]);
+        }
+        evalIntOpSliced(op, width, &values[circuit.input(0)], results.data());
+        for (size_t i = 0; i < outputs.size(); ++i) {
+            if (values[outputs[i]] != results[i]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+const char *getIntOpName(IntOp op)
+{
+    switch (op) {
+    case IntOp::ADD: return "add";
+    case IntOp::SUB: return "sub";
+    case IntOp::NEG: return "neg";
+    case IntOp::EQ: return "eq";
+    case IntOp::NE: return "ne";
+    case IntOp::LT: return "lt";
+    case IntOp::LE: return "le";
+    case IntOp::GT: return "gt";
+    case IntOp::GE: return "ge";
+    }
+    return "";
+}
+
+size_t getIntOpInputs(IntOp op, size_t width)
+{
+    return op == IntOp::NEG ? width : 2 * width;
+}
+
+size_t getIntOpOutputs(IntOp op, size_t width)
+{
+    return isCompare(op) ? 1 : width;
+}
+
+uint64_t evalIntOp(IntOp op, uint64_t a, uint64_t b, size_t width)
+{
+    uint64_t mask = lowMask(width);
+    a &= mask;
+    b &= mask;
+    switch (op) {
+    case IntOp::ADD: return (a + b) & mask;
+    case IntOp::SUB: return (a - b) & mask;
+    case IntOp::NEG: return (0 - a) & mask;
+    case IntOp::EQ: return a == b;
+    case IntOp::NE: return a != b;
+    case IntOp::LT: return a < b;
+    case IntOp::LE: return a <= b;
+    case IntOp::GT: return a > b;
+    case IntOp::GE: return a >= b;
+    }
+    return 0;
+}
+
+void evalIntOpSliced(IntOp op, size_t width, const uint64_t *operands,
+    uint64_t *results)
+{
+    uint64_t carry = getInitialCarry(op) ? ~uint64_t(0) : 0;
+    for (size_t i = 0; i < width; ++i) {
+        uint64_t a = operands[width - 1 - i];
+        uint64_t b = op == IntOp::NEG ? 0 : operands[2 * width - 1 - i];
+        if (!isCompare(op)) {
+            results[width - 1 - i] = stepOutput(op, a, b, carry);
+        }
+        carry = stepCarry(op, a, b, carry);
+    }
+    if (isCompare(op)) {
+        results[0] = finalOutput(op, carry);
+    }
+}
+
+void expandIntOp(Circuit& circuit, IntOp op, size_t width,
+    const Circuit::Node *operands, Circuit::Node *results)
+{
+    typedef Circuit::Node Node;
+    auto inv = [&](Node x) { return circuit.nand(x, x); };
+    auto xnor = [&](Node x, Node y) {
+        Node t = circuit.nand(x, y);
+        return inv(circuit.nand(circuit.nand(x, t), circuit.nand(y, t)));
+    };
+    Node carry = getInitialCarry(op) ? Circuit::one : Circuit::zero;
+    for (size_t i = 0; i < width; ++i) {
+        Node a = operands[width - 1 - i];
+        Node b = op == IntOp::NEG ? Circuit::zero
+                                  : operands[2 * width - 1 - i];
+        Node same = xnor(a, b);
+        switch (op) {
+        case IntOp::ADD:
+        case IntOp::SUB: {
+            if (op == IntOp::SUB) {
+                b = inv(b);
+                same = inv(same);
+            }
+            // sum = a ^ b ^ carry, carry = a & b | carry & (a ^ b)
+            results[width - 1 - i] = xnor(same, carry);
+            carry = circuit.nand(circuit.nand(a, b),
+                circuit.nand(carry, inv(same)));
+            break;
+        }
+        case IntOp::NEG:
+            results[width - 1 - i] = xnor(a, carry);
+            carry = inv(circuit.nand(inv(a), carry));
+            break;
+        case IntOp::EQ:
+        case IntOp::NE:
+            carry = inv(circuit.nand(carry, same));
+            break;
+        case IntOp::LT:
+        case IntOp::GE:
+            carry = circuit.nand(circuit.nand(same, carry),
+                circuit.nand(inv(a), b));
+            break;
+        case IntOp::GT:
+        case IntOp::LE:
+            carry = circuit.nand(circuit.nand(same, carry),
+                circuit.nand(a, inv(b)));
+            break;
+        }
+    }
+    if (isCompare(op)) {
+        results[0] = finalOutput(op, 1) & 1 ? carry : inv(carry);
+    }
+}
+
+bool recognizeIdiom(const Circuit& circuit,
+    const std::vector<Circuit::Node>& outputs, IntOp& op, size_t& width)
+{
+    size_t inputs = circuit.getInputNum();
+    if (outputs.empty() || inputs < minIdiomWidth) {
+        return false;
+    }
+    // Simulate the circuit on random inputs. The generator is seeded the
+    // same way every time, so that builds are reproducible.
+    std::mt19937_64 random(inputs * 31 + outputs.size());
+    std::vector<Signature> values(circuit.size());
+    values[Circuit::one].fill(~uint64_t(0));
+    for (size_t i = 0; i < inputs; ++i) {
+        for (auto& word : values[circuit.input(i)]) {
+            word = random();
+        }
+    }
+    for (Circuit::Node node = Circuit::Node(2 + inputs); node < circuit.size();
+            ++node) {
+        const Signature& left = values[circuit.getLeft(node)];
+        const Signature& right = values[circuit.getRight(node)];
+        for (size_t w = 0; w < simulationWords; ++w) {
+            values[node][w] = ~(left[w] & right[w]);
+        }
+    }
+    for (IntOp candidate : intOps) {
+        size_t n = candidate == IntOp::NEG ? inputs : inputs / 2;
+        if (n < minIdiomWidth || n > 64
+         || getIntOpInputs(candidate, n) != inputs
+         || getIntOpOutputs(candidate, n) != outputs.size()) {
+            continue;
+        }
+        IdiomProver prover(circuit, outputs, candidate, n, values);
+        if (!prover.simulate()) {
+            continue;
+        }
+        if (inputs <= maxExhaustiveInputs
+            ? proveExhaustive(circuit, outputs, candidate, n)
+            : prover.prove()) {
+            op = candidate;
+            width = n;
+            return true;
+        }
+    }
+    return false;
+}
+
+Bytecode lowerIdiom(const State& state, IntOp op, size_t width)
+{
+    size_t inputs = getIntOpInputs(op, width);
+    size_t outputs = getIntOpOutputs(op, width);
+    BytecodeBuilder builder(state, inputs + outputs);
+    builder.emit(Opcode::INT_OP, 0, width, ptrdiff_t(op));
+    builder.emit(Opcode::STORE_ARRAY, inputs, outputs);
+    return builder.finish();
+}
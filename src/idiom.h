@@ -0,0 +1,70 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "circuit.h"
+
+class State;
+class Bytecode;
+
+/// Integer operations that gate-level idioms are replaced with.
+/// Operands are unsigned integers of up to 64 bits, stored most significant
+/// bit first like every other Nandlang integer. Arithmetic wraps around.
+enum class IntOp : uint8_t {
+    ADD, // a + b
+    SUB, // a - b
+    NEG, // -a, the two's complement of a
+    EQ,  // a == b
+    NE,  // a != b
+    LT,  // a < b
+    LE,  // a <= b
+    GT,  // a > b
+    GE   // a >= b
+};
+
+/// Idioms narrower than this stay as gates, since a few gates are cheaper
+/// than an integer operation.
+const size_t minIdiomWidth = 4;
+
+/// Get the name of an integer operation
+const char *getIntOpName(IntOp op);
+/// Get the number of input bits of an integer operation on width bit values
+size_t getIntOpInputs(IntOp op, size_t width);
+/// Get the number of output bits of an integer operation on width bit values
+size_t getIntOpOutputs(IntOp op, size_t width);
+/// Evaluate an integer operation on width bit values. b is ignored by NEG.
+uint64_t evalIntOp(IntOp op, uint64_t a, uint64_t b, size_t width);
+/// Evaluate an integer operation on 64 independent values at once, with one
+/// word per bit and one bit of every word per value. operands holds the
+/// input bits and results receives the output bits, both most significant
+/// bit first.
+void evalIntOpSliced(IntOp op, size_t width, const uint64_t *operands,
+    uint64_t *results);
+/// Build the gates of an integer operation. operands holds the nodes of the
+/// input bits and results receives the nodes of the output bits, both most
+/// significant bit first.
+void expandIntOp(Circuit& circuit, IntOp op, size_t width,
+    const Circuit::Node *operands, Circuit::Node *results);
+
+/// A function that has been replaced by an integer operation
+struct IdiomStats {
+    std::string function;
+    IntOp op;
+    size_t width;
+};
+
+/// Find out whether a circuit computes an integer operation, where the
+/// inputs are one or two integers and the outputs are the result. The
+/// circuit is first compared against each operation on random inputs. A
+/// match is then proven, so that replacing the circuit never changes the
+/// program. Small circuits are run on every possible input. Larger ones must
+/// have a node for every carry of the operation, and each carry and output
+/// bit must be a function of only the previous carry and the operand bits at
+/// its position, which is checked for every value of those bits.
+bool recognizeIdiom(const Circuit& circuit,
+    const std::vector<Circuit::Node>& outputs, IntOp& op, size_t& width);
+
+/// Lower an integer operation into bytecode for a function whose inputs are
+/// the operands and whose outputs are the result
+Bytecode lowerIdiom(const State& state, IntOp op, size_t width);
@@ -0,0 +1,68 @@
+#include "inliner.h"
+#include "state.h"
+#include "bytecode.h"
+
+Inliner::Inliner(State& state, const InlineOptions& options)
+: m_state(state), m_options(options), m_callerSize(0), m_inlined(0) {}
+
+size_t Inliner::measure(const Function& function) const
+{
+    const std::vector<StatementPtr> *block = function.getBlock();
+    BytecodeBuilder builder(m_state,
+        function.getInputNum() + function.getOutputNum());
+    for (const auto& stmt : *block) {
+        stmt->compile(builder);
+    }
+    return builder.finish().size();
+}
+
+void Inliner::visit(Function& function)
+{
+    if (m_status.count(&function) || !function.getBlock()) {
+        return;
+    }
+    m_status[&function] = Status::VISITING;
+    size_t prevSize = m_callerSize;
+    m_callerSize = measure(function);
+    function.inlineCalls(*this);
+    m_callerSize = prevSize;
+    m_sizes[&function] = measure(function);
+    m_status[&function] = Status::DONE;
+}
+
+ExpressionPtr Inliner::inlineCall(const DebugInfo& info, Function& callee,
+    std::vector<ExpressionPtr>& arguments, size_t depth)
+{
+    if (m_options.maxSize == 0 || m_callerSize >= m_options.maxCallerSize) {
+        return nullptr;
+    }
+    const std::vector<StatementPtr> *block = callee.getBlock();
+    if (!block) {
+        return nullptr;
+    }
+    visit(callee);
+    if (m_status.at(&callee) != Status::DONE) {
+        // the callee is still being visited, so this call is recursive
+        return nullptr;
+    }
+    size_t size = m_sizes.at(&callee);
+    if (size > m_options.maxSize) {
+        return nullptr;
+    }
+    m_callerSize += size;
+    ++m_inlined;
+    return makeNode<ExpressionInline>(info, depth,
+        callee.getInputNum(), callee.getOutputNum(), callee.getFrameSize(),
+        std::move(arguments),
+        cloneStatements(*block, depth));
+}
+
+const State& Inliner::getState() const
+{
+    return m_state;
+}
+
+size_t Inliner::getInlined() const
+{
+    return m_inlined;
+}
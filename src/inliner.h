@@ -0,0 +1,54 @@
+#pragma once
+#include <cstddef>
+#include <map>
+#include "expression.h"
+#include "statement.h"
+
+class State;
+class Function;
+
+/// Limits on which calls are inlined
+struct InlineOptions {
+    /// Functions that lower into more bytecode instructions than this are not
+    /// inlined. 0 disables inlining.
+    size_t maxSize = 32;
+    /// Calls are no longer inlined into a function once it has grown to this
+    /// many bytecode instructions.
+    size_t maxCallerSize = 4096;
+};
+
+/// Splices the bodies of small functions into their callers.
+/// Functions are visited depth first, so a callee is finished before any call
+/// to it is inlined, and calls within a cycle of functions are never inlined.
+/// The variables of an inlined body are moved up to the stack depth of the
+/// call, so that they live in the caller's frame past its own variables.
+class Inliner {
+    enum class Status {
+        VISITING,
+        DONE
+    };
+    State& m_state;
+    InlineOptions m_options;
+    std::map<const Function*, Status> m_status;
+    std::map<const Function*, size_t> m_sizes;
+    /// Estimated size of the function that calls are being inlined into
+    size_t m_callerSize;
+    size_t m_inlined;
+    /// Get the number of bytecode instructions that a function lowers into
+    size_t measure(const Function& function) const;
+public:
+    Inliner(State& state, const InlineOptions& options);
+    /// Inline calls within the given function, after inlining calls within
+    /// every function that it calls.
+    void visit(Function& function);
+    /// Try to inline a call to the given function, with the given arguments,
+    /// at the given stack depth. Returns the expression that replaces the
+    /// call, or null if the call should stay. The arguments are only taken if
+    /// the call is inlined.
+    ExpressionPtr inlineCall(const DebugInfo& info, Function& callee,
+        std::vector<ExpressionPtr>& arguments, size_t depth);
+    /// Get the execution state that functions are looked up in
+    const State& getState() const;
+    /// Get the number of calls that have been inlined
+    size_t getInlined() const;
+};
@@ -0,0 +1,638 @@
+#include "jit.h"
+#include "state.h"
+#include "idiom.h"
+#include <stdexcept>
+#include <limits>
+#include <map>
+#include <cstring>
+#include <cstddef>
+#if defined(__x86_64__) && !defined(_WIN32)
+#include <sys/mman.h>
+#include <unistd.h>
+#define NANDLANG_JIT
+#endif
+
+namespace {
+
+/// Registers used by generated code
+enum Reg : uint8_t {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7
+};
+
+/// Thrown when a function can not be compiled
+class JitUnsupported : public std::runtime_error {
+public:
+    JitUnsupported(const std::string& what) : std::runtime_error(what) {}
+};
+
+/// Copies larger than this use rep movsb instead of separate moves
+const size_t maxInlineCopy = 64;
+
+/// Writes x86-64 machine code
+class Assembler {
+public:
+    std::vector<uint8_t> code;
+
+    void byte(uint8_t b)
+    {
+        code.push_back(b);
+    }
+
+    void bytes(std::initializer_list<uint8_t> list)
+    {
+        code.insert(code.end(), list);
+    }
+
+    void imm16(uint16_t value)
+    {
+        byte(value);
+        byte(value >> 8);
+    }
+
+    void imm32(int64_t value)
+    {
+        if (value < std::numeric_limits<int32_t>::min()
+         || value > std::numeric_limits<int32_t>::max()) {
+            throw JitUnsupported("Operand does not fit into 32 bits");
+        }
+        uint32_t v = uint32_t(int32_t(value));
+        for (int i = 0; i < 4; ++i) {
+            byte(v >> (8 * i));
+        }
+    }
+
+    void imm64(uint64_t value)
+    {
+        for (int i = 0; i < 8; ++i) {
+            byte(value >> (8 * i));
+        }
+    }
+
+    /// ModRM byte addressing [base + disp32]. base can not be RSP.
+    void mem(uint8_t reg, Reg base, int64_t disp)
+    {
+        byte(0x80 | (reg << 3) | base);
+        imm32(disp);
+    }
+
+    /// ModRM and SIB bytes addressing [base + index + disp32]
+    void memIndexed(uint8_t reg, Reg base, Reg index, int64_t disp)
+    {
+        byte(0x84 | (reg << 3));
+        byte((index << 3) | base);
+        imm32(disp);
+    }
+
+    /// ModRM and SIB bytes addressing [rsp + disp32]
+    void memStack(uint8_t reg, int64_t disp)
+    {
+        byte(0x84 | (reg << 3));
+        byte(0x24);
+        imm32(disp);
+    }
+
+    /// ModRM and SIB bytes addressing [r12 + disp32], which holds the
+    /// JitContext. The instruction needs a REX prefix with the B bit set.
+    void memContext(uint8_t reg, size_t disp)
+    {
+        memStack(reg, disp);
+    }
+
+    /// Return at once if the call that was just made stopped native code
+    void checkStopped(std::vector<size_t>& unwinds)
+    {
+        // cmp byte [r12 + stopped], 0; jne unwind
+        bytes({0x41, 0x80}); memContext(7, offsetof(JitContext, stopped));
+        byte(0);
+        bytes({0x0F, 0x85});
+        unwinds.push_back(rel32());
+    }
+
+    /// Emit a 32-bit relative jump target to be patched later.
+    /// Returns the position of the target.
+    size_t rel32()
+    {
+        size_t pos = code.size();
+        imm32(0);
+        return pos;
+    }
+
+    /// Make the relative target at pos point to target
+    void patch(size_t pos, size_t target)
+    {
+        int64_t rel = int64_t(target) - int64_t(pos + 4);
+        uint32_t v = uint32_t(int32_t(rel));
+        std::memcpy(&code[pos], &v, 4);
+    }
+
+    /// lea reg, [base + disp]
+    void lea(Reg reg, Reg base, int64_t disp)
+    {
+        bytes({0x48, 0x8D});
+        mem(reg, base, disp);
+    }
+
+    /// mov reg, imm64
+    void movImm64(Reg reg, uint64_t value)
+    {
+        bytes({0x48, uint8_t(0xB8 + reg)});
+        imm64(value);
+    }
+
+    /// Copy num bytes from [src + srcDisp] to [dst + dstDisp]. The copy is
+    /// done forwards, so overlapping ranges are fine when dst is lower. RAX,
+    /// RCX, RSI and RDI are clobbered; bases should be RBX or RDX.
+    void copy(Reg dst, int64_t dstDisp, Reg src, int64_t srcDisp, size_t num)
+    {
+        if (num > maxInlineCopy) {
+            lea(RSI, src, srcDisp);
+            lea(RDI, dst, dstDisp);
+            byte(0xB9); // mov ecx, imm32
+            imm32(num);
+            bytes({0xF3, 0xA4}); // rep movsb
+            return;
+        }
+        size_t i = 0;
+        while (i < num) {
+            size_t left = num - i;
+            if (left >= 8) {
+                byte(0x48); byte(0x8B); mem(RAX, src, srcDisp + i);
+                byte(0x48); byte(0x89); mem(RAX, dst, dstDisp + i);
+                i += 8;
+            } else if (left >= 4) {
+                byte(0x8B); mem(RAX, src, srcDisp + i);
+                byte(0x89); mem(RAX, dst, dstDisp + i);
+                i += 4;
+            } else if (left >= 2) {
+                bytes({0x66, 0x8B}); mem(RAX, src, srcDisp + i);
+                bytes({0x66, 0x89}); mem(RAX, dst, dstDisp + i);
+                i += 2;
+            } else {
+                byte(0x8A); mem(RAX, src, srcDisp + i);
+                byte(0x88); mem(RAX, dst, dstDisp + i);
+                i += 1;
+            }
+        }
+    }
+
+    /// Set num bytes at [rbx + disp] to 0. RAX, RCX, and RDI are clobbered.
+    void zero(int64_t disp, size_t num)
+    {
+        if (num > maxInlineCopy) {
+            lea(RDI, RBX, disp);
+            bytes({0x31, 0xC0}); // xor eax, eax
+            byte(0xB9); // mov ecx, imm32
+            imm32(num);
+            bytes({0xF3, 0xAA}); // rep stosb
+            return;
+        }
+        size_t i = 0;
+        while (i < num) {
+            size_t left = num - i;
+            if (left >= 8) {
+                bytes({0x48, 0xC7}); mem(0, RBX, disp + i); imm32(0);
+                i += 8;
+            } else if (left >= 4) {
+                byte(0xC7); mem(0, RBX, disp + i); imm32(0);
+                i += 4;
+            } else if (left >= 2) {
+                bytes({0x66, 0xC7}); mem(0, RBX, disp + i); imm16(0);
+                i += 2;
+            } else {
+                byte(0xC6); mem(0, RBX, disp + i); byte(0);
+                i += 1;
+            }
+        }
+    }
+
+    /// mov byte [rbx + disp], value
+    void storeByte(int64_t disp, uint8_t value)
+    {
+        byte(0xC6);
+        mem(0, RBX, disp);
+        byte(value);
+    }
+};
+
+/// Called by native code to run a function that was not compiled
+void callInterpreted(JitContext *context, const Function *function,
+    uint8_t *args)
+{
+    State *state = context->state;
+    size_t inputs = function->getInputNum();
+    size_t outputs = function->getOutputNum();
+    for (size_t i = 0; i < inputs; ++i) {
+        state->push(args[i]);
+    }
+    // native functions called from here put their frames past the arguments
+    uint8_t *prev = state->setJitTop(args);
+    try {
+        function->call(*state);
+    } catch (...) {
+        // the exception can not be thrown through native code
+        state->setJitTop(prev);
+        state->stopNative(std::current_exception());
+        return;
+    }
+    state->setJitTop(prev);
+    size_t i = outputs;
+    while (i > 0) {
+        --i;
+        args[i] = state->pop();
+    }
+}
+
+/// Called by native code to apply an integer operation to variables, which
+/// are one byte per bit
+void callIntOp(const uint8_t *operands, uint8_t *result, uint32_t width,
+    uint32_t op)
+{
+    IntOp intOp = IntOp(op);
+    size_t inputs = getIntOpInputs(intOp, width);
+    uint64_t a = 0, b = 0;
+    for (size_t i = 0; i < inputs; ++i) {
+        uint64_t& value = i < width ? a : b;
+        value = (value << 1) | operands[i];
+    }
+    uint64_t value = evalIntOp(intOp, a, b, width);
+    size_t i = getIntOpOutputs(intOp, width);
+    while (i > 0) {
+        --i;
+        result[i] = value & 1;
+        value >>= 1;
+    }
+}
+
+/// Called by native code to look up variables, which are one byte per bit,
+/// in a truth table
+void callLookup(const uint8_t *index, uint8_t *result, const TruthTable *table)
+{
+    size_t value = 0;
+    for (size_t i = 0; i < table->inputs; ++i) {
+        value = (value << 1) | index[i];
+    }
+    uint64_t entry = table->entries.getBits(value * table->outputs,
+        table->outputs);
+    for (size_t i = 0; i < table->outputs; ++i) {
+        result[i] = (entry >> i) & 1;
+    }
+}
+
+} // namespace
+
+Jit::Jit()
+: m_code(nullptr), m_codeSize(0) {}
+
+Jit::~Jit()
+{
+#ifdef NANDLANG_JIT
+    if (m_code) {
+        munmap(m_code, m_codeSize);
+    }
+#endif
+}
+
+bool Jit::isSupported()
+{
+#ifdef NANDLANG_JIT
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Jit::add(FunctionInternal& function, const Bytecode& bytecode)
+{
+    m_entries.push_back({&function, &bytecode});
+}
+
+std::vector<uint8_t> Jit::generate(
+    const std::set<const FunctionInternal*>& excluded,
+    std::vector<size_t>& entries)
+{
+    Assembler as;
+    std::map<const Function*, size_t> indices;
+    for (size_t i = 0; i < m_entries.size(); ++i) {
+        if (!excluded.count(m_entries[i].function)) {
+            indices[m_entries[i].function] = i;
+        }
+    }
+    entries.assign(m_entries.size(), 0);
+    // direct calls to compiled functions: code position and entry index
+    std::vector<std::pair<size_t, size_t>> calls;
+    for (size_t index = 0; index < m_entries.size(); ++index) {
+        const Entry& entry = m_entries[index];
+        if (excluded.count(entry.function)) {
+            continue;
+        }
+        try {
+            size_t inputs = entry.function->getInputNum();
+            size_t outputs = entry.function->getOutputNum();
+            const auto& code = entry.bytecode->getCode();
+            const auto& callTable = entry.bytecode->getCalls();
+            const BitStack& literals = entry.bytecode->getLiterals();
+            const auto& tables = entry.bytecode->getTables();
+            std::vector<size_t> depths = entry.bytecode->getDepths(
+                inputs + outputs);
+            // Count the loop nesting, so that counters can be kept in the
+            // native stack frame.
+            size_t levels = 0;
+            size_t level = 0;
+            for (const auto& inst : code) {
+                if (inst.op == Opcode::FOR_BEGIN) {
+                    levels = std::max(levels, ++level);
+                } else if (inst.op == Opcode::FOR_NEXT) {
+                    --level;
+                }
+            }
+            // rsp must be aligned to 16 bytes at calls. Two registers are
+            // pushed after the return address, so the frame size must be an
+            // odd number of 8 byte slots.
+            size_t stackSize = 8 * levels;
+            if (stackSize % 16 == 0) {
+                stackSize += 8;
+            }
+            entries[index] = as.code.size();
+            // jumps to the stops after the epilogue
+            std::vector<size_t> overflows;
+            std::vector<size_t> unwinds;
+            // prologue
+            as.byte(0x53);                 // push rbx
+            as.bytes({0x41, 0x54});        // push r12
+            as.bytes({0x48, 0x81, 0xEC});  // sub rsp, imm32
+            as.imm32(stackSize);
+            as.bytes({0x48, 0x89, 0xFB});  // mov rbx, rdi
+            as.bytes({0x49, 0x89, 0xF4});  // mov r12, rsi
+            // stop if the native stack is nearly full
+            // cmp rsp, [r12 + stackLimit]; jb overflow
+            as.bytes({0x49, 0x3B});
+            as.memContext(RSP, offsetof(JitContext, stackLimit));
+            as.bytes({0x0F, 0x82});
+            overflows.push_back(as.rel32());
+            // stop if the frame does not fit into the frames memory
+            // lea rax, [rbx + frame size]; cmp rax, [r12 + framesEnd]
+            // ja overflow
+            as.lea(RAX, RBX, depths.back());
+            as.bytes({0x49, 0x3B});
+            as.memContext(RAX, offsetof(JitContext, framesEnd));
+            as.bytes({0x0F, 0x87});
+            overflows.push_back(as.rel32());
+            as.zero(inputs, outputs);
+            // body
+            std::vector<size_t> offsets(code.size());
+            std::vector<std::pair<size_t, size_t>> jumps;
+            std::vector<size_t> returns;
+            level = 0;
+            for (size_t i = 0; i < code.size(); ++i) {
+                const Instruction& inst = code[i];
+                int64_t d = depths[i];
+                offsets[i] = as.code.size();
+                switch (inst.op) {
+                case Opcode::PUSH:
+                    as.storeByte(d, inst.a);
+                    break;
+                case Opcode::PUSH_ARRAY:
+                    if (inst.b > maxInlineCopy) {
+                        std::vector<uint8_t> table(inst.b);
+                        for (size_t j = 0; j < inst.b; ++j) {
+                            table[j] = literals.get(inst.a + j);
+                        }
+                        m_literals.push_back(std::move(table));
+                        as.movImm64(RSI, uintptr_t(m_literals.back().data()));
+                        as.lea(RDI, RBX, d);
+                        as.byte(0xB9); // mov ecx, imm32
+                        as.imm32(inst.b);
+                        as.bytes({0xF3, 0xA4}); // rep movsb
+                    } else {
+                        for (size_t j = 0; j < inst.b; ++j) {
+                            as.storeByte(d + j, literals.get(inst.a + j));
+                        }
+                    }
+                    break;
+                case Opcode::ALLOC:
+                    as.zero(d, inst.a);
+                    break;
+                case Opcode::LOAD:
+                    as.byte(0x8A); as.mem(RAX, RBX, inst.a); // mov al, [var]
+                    as.byte(0x88); as.mem(RAX, RBX, d);      // mov [top], al
+                    break;
+                case Opcode::LOAD_ARRAY:
+                    as.copy(RBX, d, RBX, inst.a, inst.b);
+                    break;
+                case Opcode::STORE:
+                    as.byte(0x8A); as.mem(RAX, RBX, d - 1);
+                    as.byte(0x88); as.mem(RAX, RBX, inst.a);
+                    break;
+                case Opcode::STORE_ARRAY:
+                    as.copy(RBX, inst.a, RBX, d - inst.b, inst.b);
+                    break;
+                case Opcode::DROP:
+                    // only changes the depth
+                    break;
+                case Opcode::TRUNCATE:
+                    if (int64_t(inst.a) > d) {
+                        as.zero(d, inst.a - d);
+                    }
+                    break;
+                case Opcode::NAND:
+                    as.byte(0x8A); as.mem(RAX, RBX, d - 2); // mov al, [left]
+                    as.byte(0x22); as.mem(RAX, RBX, d - 1); // and al, [right]
+                    as.bytes({0x34, 0x01});                 // xor al, 1
+                    as.byte(0x88); as.mem(RAX, RBX, d - 2); // mov [left], al
+                    break;
+                case Opcode::NAND_VARS:
+                    as.byte(0x8A); as.mem(RAX, RBX, inst.a);
+                    as.byte(0x22); as.mem(RAX, RBX, inst.b);
+                    as.bytes({0x34, 0x01});
+                    as.byte(0x88); as.mem(RAX, RBX, d);
+                    break;
+                case Opcode::CALL: {
+                    const Function *func = callTable[inst.a];
+                    int64_t frame = d - int64_t(func->getInputNum());
+                    auto iter = indices.find(func);
+                    if (iter != indices.end()) {
+                        as.lea(RDI, RBX, frame);
+                        as.bytes({0x4C, 0x89, 0xE6}); // mov rsi, r12
+                        as.byte(0xE8);                // call rel32
+                        calls.emplace_back(as.rel32(), iter->second);
+                    } else {
+                        as.bytes({0x4C, 0x89, 0xE7}); // mov rdi, r12
+                        as.movImm64(RSI, uintptr_t(func));
+                        as.lea(RDX, RBX, frame);
+                        as.movImm64(RAX, uintptr_t(&callInterpreted));
+                        as.bytes({0xFF, 0xD0});       // call rax
+                    }
+                    as.checkStopped(unwinds);
+                    break;
+                }
+                case Opcode::JUMP:
+                    as.byte(0xE9);
+                    jumps.emplace_back(as.rel32(), inst.a);
+                    break;
+                case Opcode::JUMP_IF_ZERO:
+                    // cmp byte [top], 0; je target
+                    as.byte(0x80); as.mem(7, RBX, d - 1); as.byte(0);
+                    as.bytes({0x0F, 0x84});
+                    jumps.emplace_back(as.rel32(), inst.a);
+                    break;
+                case Opcode::FOR_BEGIN:
+                    // mov qword [rsp + counter], 0
+                    as.bytes({0x48, 0xC7}); as.memStack(0, 8 * level);
+                    as.imm32(0);
+                    ++level;
+                    break;
+                case Opcode::FOR_LOAD:
+                case Opcode::FOR_STORE:
+                    // rdx = rbx + counter*step + a
+                    as.bytes({0x48, 0x8B}); as.memStack(RAX, 8 * (level-1));
+                    as.bytes({0x48, 0x69, 0xC0}); as.imm32(inst.c);
+                    as.bytes({0x48, 0x8D}); as.memIndexed(RDX, RBX, RAX, inst.a);
+                    if (inst.op == Opcode::FOR_LOAD) {
+                        as.copy(RBX, d, RDX, 0, inst.b);
+                    } else {
+                        as.copy(RDX, 0, RBX, d - inst.b, inst.b);
+                    }
+                    break;
+                case Opcode::FOR_NEXT:
+                    --level;
+                    // inc qword [rsp + counter]
+                    as.bytes({0x48, 0xFF}); as.memStack(0, 8 * level);
+                    // cmp qword [rsp + counter], iterations
+                    as.bytes({0x48, 0x81}); as.memStack(7, 8 * level);
+                    as.imm32(inst.b);
+                    // jb target
+                    as.bytes({0x0F, 0x82});
+                    jumps.emplace_back(as.rel32(), inst.a);
+                    break;
+                case Opcode::INT_OP:
+                    as.lea(RDI, RBX, inst.a);
+                    as.lea(RSI, RBX, d);
+                    as.byte(0xBA); // mov edx, imm32
+                    as.imm32(inst.b);
+                    as.byte(0xB9); // mov ecx, imm32
+                    as.imm32(uint32_t(inst.c));
+                    as.movImm64(RAX, uintptr_t(&callIntOp));
+                    as.bytes({0xFF, 0xD0}); // call rax
+                    break;
+                case Opcode::TABLE:
+                    as.lea(RDI, RBX, inst.a);
+                    as.lea(RSI, RBX, d);
+                    as.movImm64(RDX, uintptr_t(&tables[inst.b]));
+                    as.movImm64(RAX, uintptr_t(&callLookup));
+                    as.bytes({0xFF, 0xD0}); // call rax
+                    break;
+                case Opcode::RETURN:
+                    if (i + 1 < code.size()) {
+                        as.byte(0xE9);
+                        returns.push_back(as.rel32());
+                    }
+                    break;
+                }
+            }
+            // epilogue, outputs are moved to the start of the frame
+            size_t epilogue = as.code.size();
+            for (auto& jump : jumps) {
+                as.patch(jump.first, offsets[jump.second]);
+            }
+            for (size_t pos : returns) {
+                as.patch(pos, epilogue);
+            }
+            as.copy(RBX, 0, RBX, inputs, outputs);
+            as.bytes({0x48, 0x81, 0xC4});  // add rsp, imm32
+            as.imm32(stackSize);
+            as.bytes({0x41, 0x5C});        // pop r12
+            as.byte(0x5B);                 // pop rbx
+            as.byte(0xC3);                 // ret
+            // stops, which return without moving the outputs
+            for (size_t pos : overflows) {
+                as.patch(pos, as.code.size());
+            }
+            // mov byte [r12 + stopped], 1
+            as.bytes({0x41, 0xC6});
+            as.memContext(0, offsetof(JitContext, stopped));
+            as.byte(1);
+            for (size_t pos : unwinds) {
+                as.patch(pos, as.code.size());
+            }
+            as.bytes({0x48, 0x81, 0xC4});  // add rsp, imm32
+            as.imm32(stackSize);
+            as.bytes({0x41, 0x5C});        // pop r12
+            as.byte(0x5B);                 // pop rbx
+            as.byte(0xC3);                 // ret
+        } catch (JitUnsupported& e) {
+            // try again without this function
+            std::set<const FunctionInternal*> next = excluded;
+            next.insert(entry.function);
+            return generate(next, entries);
+        }
+    }
+    for (auto& call : calls) {
+        as.patch(call.first, entries[call.second]);
+    }
+    for (size_t i = 0; i < m_entries.size(); ++i) {
+        if (excluded.count(m_entries[i].function)) {
+            entries[i] = std::numeric_limits<size_t>::max();
+        }
+    }
+    return as.code;
+}
+
+size_t Jit::finish()
+{
+#ifdef NANDLANG_JIT
+    std::vector<size_t> entries;
+    std::vector<uint8_t> code = generate({}, entries);
+    m_codeSize = std::max<size_t>(code.size(), 1);
+    void *mem = mmap(nullptr, m_codeSize, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        throw std::runtime_error("Could not allocate memory for native code");
+    }
+    m_code = mem;
+    std::memcpy(m_code, code.data(), code.size());
+    if (mprotect(m_code, m_codeSize, PROT_READ | PROT_EXEC) != 0) {
+        throw std::runtime_error("Could not make native code executable");
+    }
+    size_t compiled = 0;
+    for (size_t i = 0; i < m_entries.size(); ++i) {
+        if (entries[i] != std::numeric_limits<size_t>::max()) {
+            uint8_t *entry = static_cast<uint8_t*>(m_code) + entries[i];
+            m_entries[i].function->setNative(
+                reinterpret_cast<JitFunction>(entry));
+            ++compiled;
+        }
+    }
+    return compiled;
+#else
+    return 0;
+#endif
+}
+
+uint8_t *Jit::allocateFrames()
+{
+#ifdef NANDLANG_JIT
+    size_t page = sysconf(_SC_PAGESIZE);
+    void *mem = mmap(nullptr, framesSize + page, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        throw std::runtime_error("Could not allocate memory for native frames");
+    }
+    uint8_t *frames = static_cast<uint8_t*>(mem);
+    // native code checks that its frames fit, and the guard page turns any
+    // access that still goes past them into a crash
+    if (mprotect(frames + framesSize, page, PROT_NONE) != 0) {
+        munmap(mem, framesSize + page);
+        throw std::runtime_error("Could not protect memory for native frames");
+    }
+    return frames;
+#else
+    throw std::runtime_error("Native code is not supported");
+#endif
+}
+
+void Jit::freeFrames(uint8_t *frames)
+{
+#ifdef NANDLANG_JIT
+    munmap(frames, framesSize + sysconf(_SC_PAGESIZE));
+#endif
+}
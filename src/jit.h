@@ -0,0 +1,75 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <set>
+
+class State;
+class FunctionInternal;
+class Bytecode;
+
+/// Shared by native code and the state that runs it. Every native function
+/// checks the limits when it starts, and stops instead of passing them.
+struct JitContext {
+    /// State that runs the native code
+    State *state;
+    /// Lowest address that the native stack may grow down to
+    uintptr_t stackLimit;
+    /// End of the memory for native frames
+    uint8_t *framesEnd;
+    /// Set when native code has stopped, because a limit was reached or a
+    /// function that was called through the bridge threw an exception. Every
+    /// native function returns at once when a call sets it, and the outputs
+    /// are left undefined.
+    uint8_t stopped;
+};
+
+/// Entry point of a natively compiled function.
+/// The frame holds one byte per bit, starting with the function's inputs. When
+/// the function returns, its outputs are at the start of the frame. Anything
+/// past the frame may be used by the function.
+typedef void (*JitFunction)(uint8_t *frame, JitContext *context);
+
+/// Compiles bytecode into native x86-64 code.
+/// Functions are added first, then compiled all at once so that calls between
+/// compiled functions can be direct calls. Anything that can not be compiled
+/// is left to the bytecode interpreter, and is called through a bridge.
+/// Generated code has no unwind information, so exceptions must not be thrown
+/// through it. Errors stop native code through JitContext instead, and are
+/// thrown once it has returned.
+class Jit {
+    struct Entry {
+        FunctionInternal *function;
+        const Bytecode *bytecode;
+    };
+    std::vector<Entry> m_entries;
+    /// Executable memory
+    void *m_code;
+    size_t m_codeSize;
+    /// Literal arrays too large to be stored as immediates, one byte per bit.
+    std::vector<std::vector<uint8_t>> m_literals;
+    /// Generate code for every added function, except the excluded ones
+    std::vector<uint8_t> generate(const std::set<const FunctionInternal*>&
+        excluded, std::vector<size_t>& entries);
+public:
+    Jit();
+    ~Jit();
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+    /// Returns true if native code can be generated on this platform
+    static bool isSupported();
+    /// Add a function to be compiled
+    void add(FunctionInternal& function, const Bytecode& bytecode);
+    /// Compile every added function, and set their native entry points.
+    /// Returns the number of functions that were compiled.
+    size_t finish();
+    /// Size of the memory for native frames. Pages are only used once they
+    /// are touched.
+    static const size_t framesSize = size_t(1) << 30;
+    /// Allocate memory for native frames, followed by a guard page that can
+    /// not be accessed. Every thread that runs native code needs frames of
+    /// its own.
+    static uint8_t *allocateFrames();
+    /// Free memory that was allocated for native frames
+    static void freeFrames(uint8_t *frames);
+};
@@ -2,11 +2,16 @@
 #include "state.h"
 #include "debug.h"
 #include "arg.h"
+#include "batch.h"
+#include "cache.h"
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <stdexcept>
 #include <iomanip>
 #include <chrono>
+#include <algorithm>
+#include <cctype>
 
 /// Replace every tab character with the given number of spaces
 std::string replaceTabs(const std::string& str, size_t spaces)
@@ -25,28 +30,23 @@ std::string replaceTabs(const std::string& str, size_t spaces)
 }
 
 /// handle the given error
-void handleError(const DebugError& e)
+void handleError(const DebugError& e, SourceMap& sources)
 {
-    // Output error message
-    std::cout << e.what() << std::endl;
-    // Re-open file
-    std::ifstream stream(*e.getDebugInfo().filename);
-    // Seek to the given position, then go one past the last newline
-    // character, so that the entire line can be loaded.
-    stream.seekg(e.getDebugInfo().position, std::ios_base::beg);
-    while (stream.tellg() > 0) {
-        stream.unget();
-        if (stream.peek() == '\n') {
-            stream.get();
-            break;
-        }
-    }
-    // read the line in question
-    std::string line;
-    std::getline(stream, line);
+    SourceLocation location = sources.locate(e.getDebugInfo());
+    // Output error message, with the file and line only if they are known
+    std::cout << "Error";
+    if (!location.filename.empty()) {
+        std::cout << " in file " << location.filename
+                  << " on line " << location.line << ":" << location.column;
+    }
+    std::cout << ":\n" << e.what() << std::endl;
+    if (location.line == 0) {
+        return;
+    }
     // the error line is every character up to and including the
     // point of error
-    std::string errline = line.substr(0, e.getDebugInfo().column);
+    std::string line = location.text;
+    std::string errline = line.substr(0, location.column);
     // format line so that tabs are predictable
     line = replaceTabs(line, 4);
     errline = replaceTabs(errline, 4);
@@ -55,6 +55,9 @@ void handleError(const DebugError& e)
         c = '-';
     }
     // The error line points to the error
+    if (errline.empty()) {
+        errline = " ";
+    }
     errline.back() = '^';
     // output error line
     std::cout << line << std::endl;
@@ -75,40 +78,418 @@ void printTime(std::ostream& stream, const std::string& s, std::chrono::duration
     }
 }
 
-void run(std::istream& stream, const DebugInfo& info, bool benchmark,
-    bool optimize)
+/// Compile the state into native code, if the platform supports it
+void compileNative(State& state)
+{
+    if (Jit::isSupported()) {
+        state.jit();
+    } else {
+        std::cerr << "Note: the JIT is not supported on this platform, "
+                  << "using the bytecode interpreter instead" << std::endl;
+    }
+}
+
+/// Run the main function of a reference state with the bytecode interpreter,
+/// then the main function of a state compiled into native code, and compare
+/// their outputs. The optimizer may run external functions such as malloc
+/// ahead of time, so each run needs its own state. Standard input is read up
+/// front so that both runs get the same input.
+void verifyNative(State& reference, State& state)
+{
+    std::stringstream buffer;
+    buffer << std::cin.rdbuf();
+    std::string input = buffer.str();
+    // reference run
+    std::istringstream expectedInput(input);
+    std::ostringstream expected;
+    reference.setInput(expectedInput);
+    reference.setOutput(expected);
+    reference.getFunction("main").call(reference);
+    reference.flushOutput();
+    // native run
+    std::istringstream actualInput(input);
+    std::ostringstream actual;
+    state.setInput(actualInput);
+    state.setOutput(actual);
+    state.getFunction("main").call(state);
+    state.flushOutput();
+    state.setInput(std::cin);
+    state.setOutput(std::cout);
+    std::cout << actual.str();
+    if (actual.str() == expected.str()) {
+        std::cout << "JIT verify: output matches the interpreter" << std::endl;
+    } else {
+        std::cout << "JIT verify: output does NOT match the interpreter"
+                  << std::endl;
+    }
+}
+
+/// Read input vectors, one per line. Each vector is a line of 0s and 1s;
+/// whitespace is ignored, as are empty lines.
+std::vector<std::vector<bool>> readVectors(std::istream& stream, size_t bits)
 {
+    std::vector<std::vector<bool>> ret;
+    std::string line;
+    size_t lineNum = 0;
+    while (std::getline(stream, line)) {
+        ++lineNum;
+        std::vector<bool> vec;
+        for (char c : line) {
+            if (c == '0' || c == '1') {
+                vec.push_back(c == '1');
+            } else if (!std::isspace(c)) {
+                std::stringstream s;
+                s << "Invalid character '" << c << "' in input vector on line "
+                  << lineNum;
+                throw std::runtime_error(s.str());
+            }
+        }
+        if (vec.empty()) {
+            continue;
+        }
+        if (vec.size() != bits) {
+            std::stringstream s;
+            s << "Input vector on line " << lineNum << " has " << vec.size()
+              << " bits; expected " << bits;
+            throw std::runtime_error(s.str());
+        }
+        ret.push_back(std::move(vec));
+    }
+    return ret;
+}
 
+/// Evaluate a function over every input vector of a file, and write one
+/// output vector per line.
+template <size_t Words>
+void runBatch(const Function& function, std::istream& input,
+    std::ostream& output)
+{
+    BatchEvaluator<Words> evaluator(function);
+    auto inputs = readVectors(input, evaluator.getInputNum());
+    auto outputs = evaluator.evaluate(inputs);
+    for (const auto& vec : outputs) {
+        for (bool b : vec) {
+            output << (b ? '1' : '0');
+        }
+        output << '\n';
+    }
+    output.flush();
+}
+
+/// Parse the argument of --flush
+FlushPolicy parseFlushPolicy(const std::string& value)
+{
+    if (value == "full") {
+        return FlushPolicy::FULL;
+    } else if (value == "line") {
+        return FlushPolicy::LINE;
+    } else if (value == "exit") {
+        return FlushPolicy::EXIT;
+    }
+    throw std::runtime_error("--flush must be full, line or exit");
+}
+
+/// Parse the argument of a numeric option
+size_t parseSize(const std::string& value, const std::string& option)
+{
+    std::istringstream stream(value);
+    size_t ret;
+    if (!(stream >> ret) || !stream.eof()) {
+        throw std::runtime_error(option + " must be a number");
+    }
+    return ret;
+}
+
+/// Options that control how a script is run
+struct RunOptions {
+    /// Output benchmark information
+    bool benchmark;
+    /// Optimize the script before running it
+    bool optimize;
+    /// Run the syntax tree instead of bytecode
+    bool interpret;
+    /// Bounds check variables and check the stack while running
+    bool checked;
+    /// Compile the bytecode into native code
+    bool jit;
+    /// Compare the output of the JIT against the bytecode interpreter
+    bool verify;
+    /// If not empty, write the script as C to this path instead of running it
+    std::string emitC;
+    /// If not empty, evaluate this function over input vectors instead of
+    /// running the script
+    std::string batch;
+    /// File to read input vectors from
+    std::string batchInput;
+    /// File to write output vectors to. Standard output is used if empty.
+    std::string batchOutput;
+    /// Number of lanes to evaluate at once, either 64 or 256
+    size_t lanes;
+    /// Cache the results of functions without global effects
+    bool memoize;
+    /// Number of results to cache per function
+    size_t memoSize;
+    /// Number of threads for checking, optimizing and building tables. 0
+    /// uses one per processor.
+    size_t threads;
+    /// Limits on which calls are inlined by the optimizer
+    InlineOptions inlining;
+    /// Limits on which functions are flattened into circuits
+    CircuitOptions circuits;
+    /// Limits on which functions are compiled into truth tables
+    TableOptions tables;
+    /// If not empty, compiled programs are cached in this directory
+    std::string cache;
+    /// When the output of the script is written out
+    FlushPolicy flush;
+};
+
+/// Describe every option that changes how a program is compiled, so that
+/// programs compiled with different options are cached apart
+std::string describeCompile(const RunOptions& options,
+    const std::vector<std::string>& roots)
+{
+    std::stringstream s;
+    s << "optimize=" << options.optimize
+      << " checked=" << options.checked
+      << " inline=" << options.inlining.maxSize
+      << "," << options.inlining.maxCallerSize
+      << " gates=" << options.circuits.maxGates
+      << " tables=" << options.tables.maxInputs
+      << "," << options.tables.maxBytes
+      << "," << options.tables.minSize
+      << "," << options.tables.maxSteps
+      << " roots=";
+    for (const std::string& root : roots) {
+        s << root.size() << ":" << root;
+    }
+    return s.str();
+}
+
+void run(const SourceFile& source, uint32_t file, const RunOptions& options)
+{
+    bool benchmark = options.benchmark;
+    bool optimize = options.optimize;
+    bool verify = options.verify;
+    bool emit = !options.emitC.empty();
+    bool batch = !options.batch.empty();
+    bool memoize = options.memoize && !emit && !batch;
+    // native code is never checked, so checked runs stay interpreted
+    bool native = (options.jit || verify) && !emit && !batch
+        && !options.checked;
+    // functions are lowered into bytecode, which the JIT also works from
+    bool lower = !options.interpret || native || emit || batch;
+    // only bytecode is cached, without the statements that checked runs
+    // check, and verifying always compiles from source
+    bool cache = !options.cache.empty() && lower && !verify
+        && !options.checked;
+    if (cache && !isCacheSupported()) {
+        std::cerr << "Note: compiled programs can not be cached by this "
+                  << "build, so the script is compiled every time" << std::endl;
+        cache = false;
+    }
+    std::vector<std::string> roots = {"main"};
+    if (batch) {
+        roots.push_back(options.batch);
+    }
     // Get time start
     auto time_start = std::chrono::system_clock::now();
-    // parse characters into tokens
-    TokenBlock block = parseTokens(stream, info);
-    auto time_parse = std::chrono::system_clock::now();
     // create execution state
     State state;
-    // load functions from token block
-    state.parse(std::move(block));
-    auto time_compile = std::chrono::system_clock::now();
-    // check for integrity issues
-    state.check();
-    auto time_check = std::chrono::system_clock::now();
-    // optimize
-    if (optimize) {
-        state.optimize();
-    }
-    auto time_optimize = std::chrono::system_clock::now();
+    state.setChecked(options.checked);
+    state.setFlushPolicy(options.flush);
+    // load the compiled program if an earlier run has cached it
+    uint64_t key = 0;
+    std::string cache_path;
+    bool loaded = false;
+    if (cache) {
+        key = getCacheKey(source, describeCompile(options, roots));
+        cache_path = getCachePath(options.cache, key);
+        loaded = loadProgram(state, cache_path, key);
+    }
+    auto time_load = std::chrono::system_clock::now();
+    auto time_parse = time_load;
+    auto time_compile = time_load;
+    auto time_link = time_load;
+    auto time_check = time_load;
+    auto time_optimize = time_load;
+    auto time_lower = time_load;
+    size_t removed = 0;
+    size_t inlined = 0;
+    std::vector<CircuitStats> circuits;
+    std::vector<IdiomStats> idioms;
+    std::vector<TableStats> tables;
+    if (!loaded) {
+        // parse characters into tokens
+        TokenBlock block = parseTokens(source, file);
+        time_parse = std::chrono::system_clock::now();
+        // load functions from token block
+        state.parse(block);
+        time_compile = std::chrono::system_clock::now();
+        // resolve calls
+        state.link();
+        time_link = std::chrono::system_clock::now();
+        // check for integrity issues, then remove functions that are never
+        // called
+        state.check(options.threads);
+        state.checkMain();
+        removed = state.removeUnused(roots);
+        time_check = std::chrono::system_clock::now();
+        // optimize
+        if (optimize) {
+            inlined = state.optimize(options.inlining, options.threads);
+        }
+        time_optimize = std::chrono::system_clock::now();
+        if (lower) {
+            state.compile();
+            if (optimize) {
+                circuits = state.flatten(options.circuits);
+                idioms = state.replaceIdioms();
+                tables = state.tabulate(options.tables);
+            }
+        }
+        time_lower = std::chrono::system_clock::now();
+        // the cache is only there to save time, so failing to write it is
+        // not an error
+        if (cache && !saveProgram(state, cache_path, key)) {
+            std::cerr << "Note: could not write the compiled program to "
+                      << cache_path << std::endl;
+        }
+    }
+    auto time_save = std::chrono::system_clock::now();
+    // memoized functions are left out of the JIT, so this comes first
+    if (memoize) {
+        state.memoize(options.memoSize);
+    }
+    auto time_memoize = std::chrono::system_clock::now();
+    // compile bytecode into native code
+    if (native) {
+        compileNative(state);
+    }
+    auto time_jit = std::chrono::system_clock::now();
     // call main function
-    state.getFunction("main").call(state);
+    if (emit) {
+        std::ofstream file(options.emitC);
+        if (!file.is_open()) {
+            throw std::runtime_error("Could not open " + options.emitC);
+        }
+        state.transpile(file);
+    } else if (batch) {
+        const Function& func = state.getFunction(options.batch);
+        std::ifstream input(options.batchInput);
+        if (!input.is_open()) {
+            throw std::runtime_error("Could not open " + options.batchInput);
+        }
+        std::ofstream file;
+        if (!options.batchOutput.empty()) {
+            file.open(options.batchOutput);
+            if (!file.is_open()) {
+                throw std::runtime_error("Could not open "
+                    + options.batchOutput);
+            }
+        }
+        std::ostream& output = file.is_open() ? file : std::cout;
+        if (options.lanes == 64) {
+            runBatch<1>(func, input, output);
+        } else {
+            runBatch<4>(func, input, output);
+        }
+    } else if (verify) {
+        State reference;
+        reference.setChecked(options.checked);
+        reference.parse(parseTokens(source, file));
+        reference.link();
+        reference.check(options.threads);
+        reference.checkMain();
+        reference.removeUnused(roots);
+        if (optimize) {
+            reference.optimize(options.inlining, options.threads);
+        }
+        reference.compile();
+        if (optimize) {
+            reference.flatten(options.circuits);
+            reference.replaceIdioms();
+            reference.tabulate(options.tables);
+        }
+        if (memoize) {
+            reference.memoize(options.memoSize);
+        }
+        time_jit = std::chrono::system_clock::now();
+        verifyNative(reference, state);
+    } else {
+        state.getFunction("main").call(state);
+    }
+    state.flushOutput();
     auto time_run = std::chrono::system_clock::now();
     if (benchmark) {
         std::cout << "Step      | Duration" << std::endl;
-        printTime(std::cout, "Parsing   | ", time_parse-time_start);
-        printTime(std::cout, "Compiling | ", time_compile-time_parse);
-        printTime(std::cout, "Checking  | ", time_check-time_compile);
-        if (optimize) {
-            printTime(std::cout, "Optimize  | ", time_optimize-time_check);
+        if (loaded) {
+            printTime(std::cout, "Loading   | ", time_load-time_start);
+        } else {
+            printTime(std::cout, "Parsing   | ", time_parse-time_load);
+            std::chrono::duration<double> lexing = time_parse-time_load;
+            std::cout << "Lexing    | " << std::setw(8)
+                      << source.size() / 1e6 / std::max(lexing.count(), 1e-9)
+                      << " MB/s" << std::endl;
+            printTime(std::cout, "Compiling | ", time_compile-time_parse);
+            printTime(std::cout, "Linking   | ", time_link-time_compile);
+            printTime(std::cout, "Checking  | ", time_check-time_link);
+            if (optimize) {
+                printTime(std::cout, "Optimize  | ",
+                    time_optimize-time_check);
+            }
+            if (lower) {
+                printTime(std::cout, "Lowering  | ",
+                    time_lower-time_optimize);
+            }
+            if (cache) {
+                printTime(std::cout, "Saving    | ", time_save-time_lower);
+            }
+        }
+        if (memoize) {
+            printTime(std::cout, "Memoize   | ", time_memoize-time_save);
+        }
+        if (native) {
+            printTime(std::cout, "JIT       | ", time_jit-time_memoize);
+        }
+        if (emit) {
+            printTime(std::cout, "Emitting  | ", time_run-time_jit);
+        } else {
+            printTime(std::cout, "Running   | ", time_run-time_jit);
+        }
+        size_t nodes, bytes;
+        state.getProgram()->getArenaStats(nodes, bytes);
+        std::cout << "Nodes     | " << std::setw(8) << nodes
+                  << " in " << bytes << " bytes" << std::endl;
+        if (!loaded) {
+            std::cout << "Removed   | " << std::setw(8) << removed
+                      << " unused functions" << std::endl;
+        }
+        if (optimize && !loaded) {
+            std::cout << "Inlined   | " << std::setw(8) << inlined
+                      << " calls" << std::endl;
+        }
+        for (const auto& stats : circuits) {
+            std::cout << "Circuit   | " << std::setw(8) << stats.before
+                      << " -> " << stats.after << " gates in "
+                      << stats.function << std::endl;
+        }
+        for (const auto& stats : idioms) {
+            std::cout << "Idiom     | " << std::setw(8)
+                      << (std::to_string(stats.width) + "-bit")
+                      << " " << getIntOpName(stats.op) << " in "
+                      << stats.function << std::endl;
+        }
+        for (const auto& stats : tables) {
+            std::cout << "Table     | " << std::setw(8) << stats.bytes
+                      << " bytes for " << stats.function << std::endl;
+        }
+        if (memoize) {
+            size_t hits, misses;
+            state.getMemoStats(hits, misses);
+            std::cout << "Memo hits | " << std::setw(8) << hits << std::endl;
+            std::cout << "Memo miss | " << std::setw(8) << misses << std::endl;
         }
-        printTime(std::cout, "Running   | ", time_run-time_optimize);
     }
 }
 
@@ -123,14 +504,82 @@ const char* coolstuff =
 "Nandlang v1.2, An esoteric programming language based on NAND completeness\n"
 "\n"
 "Usage:\n"
-"    nandlang path_to_script.nand [--bench] [--no-optimize]\n"
+"    nandlang path_to_script.nand [--bench] [--no-optimize] [--interpret]\n"
+"                                 [--checked] [--jit] [--jit-verify]\n"
+"                                 [--emit-c out.c]\n"
+"                                 [--memoize [--memo-size n]]\n"
+"                                 [--inline-size n] [--inline-limit n]\n"
+"                                 [--max-gates n] [--table-size n]\n"
+"                                 [--threads n] [--cache dir]\n"
+"                                 [--flush full|line|exit]\n"
+"                                 [--batch function --batch-input in.txt\n"
+"                                  [--batch-output out.txt] [--lanes 64|256]]\n"
 "\n"
 "Flags:\n"
 "    -C, --no-optimize  Do not optimize the program before running\n"
-"    -b, --bench        Output benchmark information after executing script";
+"    -b, --bench        Output benchmark information after executing script\n"
+"    -I, --interpret    Run the syntax tree directly instead of compiling it\n"
+"                       to bytecode. Much slower, but useful as a reference\n"
+"    --checked          Bounds check every variable access, and check that\n"
+"                       every statement and call leaves the stack as\n"
+"                       expected. Native code is not used. Debug builds are\n"
+"                       always checked\n"
+"    -j, --jit          Compile the bytecode into native x86-64 code. Falls\n"
+"                       back to the bytecode interpreter on other platforms\n"
+"    --jit-verify       Run the script with the bytecode interpreter, then\n"
+"                       with the JIT, and report whether their outputs match.\n"
+"                       Standard input is read in full before running\n"
+"    --inline-size n    Inline functions that lower into at most n bytecode\n"
+"                       instructions. Defaults to 32; 0 disables inlining\n"
+"    --inline-limit n   Stop inlining into a function once it has grown to n\n"
+"                       bytecode instructions. Defaults to 4096\n"
+"    --max-gates n      Replace functions without branches on variables by a\n"
+"                       circuit of at most n NAND gates. Defaults to 4096;\n"
+"                       0 disables this\n"
+"    --table-size n     Replace functions without global effects by a lookup\n"
+"                       into a truth table of at most n bytes. Tables are\n"
+"                       only built for up to 16 input bits. Defaults to\n"
+"                       262144; 0 disables this\n"
+"    --threads n        Number of threads that check, optimize and build\n"
+"                       tables. Defaults to one per processor\n"
+"    -m, --memoize      Cache the results of functions that have no global\n"
+"                       effects, keyed on their inputs. Functions that run\n"
+"                       too few instructions to be worth it are not cached\n"
+"    --memo-size n      Number of results to cache per function. Defaults to\n"
+"                       65536\n"
+"    --cache dir        Keep compiled programs in dir, and load them instead\n"
+"                       of compiling the script again when it, the options\n"
+"                       and this build of nandlang are unchanged. dir is\n"
+"                       made if it does not exist. Not used with\n"
+"                       --interpret unless the JIT is, or with --checked or\n"
+"                       --jit-verify\n"
+"    --flush policy     When the script's output is written out: full when\n"
+"                       the buffer is full, line at the end of every line,\n"
+"                       or exit once the script has finished. Output is\n"
+"                       always written out before input is read from a\n"
+"                       terminal. Defaults to line on a terminal and full\n"
+"                       otherwise\n"
+"    --emit-c out.c     Write the script as a self-contained C program to\n"
+"                       out.c instead of running it. Only functions that\n"
+"                       main can call are written, with one byte per bit\n"
+"    --batch function   Evaluate the function over every input vector in the\n"
+"                       file given by --batch-input, many vectors at once,\n"
+"                       instead of running the script. Vectors are lines of\n"
+"                       0s and 1s, one bit per input. Output vectors are\n"
+"                       written to --batch-output, or standard output.\n"
+"                       The function must not call external functions\n"
+"    --lanes n          Number of vectors to evaluate at once, 64 or 256.\n"
+"                       Defaults to 64. 256 lanes are faster when built for\n"
+"                       AVX2";
 
 int main(int argc, char **argv)
 {
+    // Errors refer to the files that were read, so these outlive the errors
+    SourceFile source;
+    SourceMap sources;
+    // scripts write through their own buffers, and standard output is only
+    // used through std::cout otherwise
+    std::ios::sync_with_stdio(false);
     try {
         std::vector<std::string> arguments;
         for (int i = 1; i < argc; ++i) {
@@ -139,30 +588,100 @@ int main(int argc, char **argv)
         ArgChain argchain(arguments);
         ArgBlock argblock = argchain.parse(1, false, {
             {"bench", false, 'b'},
-            {"no-optimize", false, 'C'}
+            {"no-optimize", false, 'C'},
+            {"interpret", false, 'I'},
+            {"checked", false, '\0'},
+            {"jit", false, 'j'},
+            {"jit-verify", false, '\0'},
+            {"emit-c", true, '\0'},
+            {"batch", true, '\0'},
+            {"batch-input", true, '\0'},
+            {"batch-output", true, '\0'},
+            {"lanes", true, '\0'},
+            {"memoize", false, 'm'},
+            {"memo-size", true, '\0'},
+            {"inline-size", true, '\0'},
+            {"inline-limit", true, '\0'},
+            {"max-gates", true, '\0'},
+            {"table-size", true, '\0'},
+            {"threads", true, '\0'},
+            {"cache", true, '\0'},
+            {"flush", true, '\0'}
         });
         if (argblock.size() == 0) {
             argchain.assert_finished();
             std::cout << coolstuff << std::endl;
         } else {
             argchain.assert_finished();
-            bool do_benchmark = argblock.has_option("bench");
-            bool do_optimize = !argblock.has_option("no-optimize");
-            std::ifstream file(argblock[0]);
-            if (!file.is_open()) {
+            RunOptions options;
+            options.benchmark = argblock.has_option("bench");
+            options.optimize = !argblock.has_option("no-optimize");
+            options.interpret = argblock.has_option("interpret");
+            options.checked = argblock.has_option("checked");
+            options.jit = argblock.has_option("jit");
+            options.verify = argblock.has_option("jit-verify");
+            options.emitC = argblock.get_option("emit-c");
+            options.batch = argblock.get_option("batch");
+            options.batchInput = argblock.get_option("batch-input");
+            options.batchOutput = argblock.get_option("batch-output");
+            options.lanes = 64;
+            if (argblock.has_option("lanes")) {
+                const std::string& lanes = argblock.get_option("lanes");
+                if (lanes == "256") {
+                    options.lanes = 256;
+                } else if (lanes != "64") {
+                    throw std::runtime_error("--lanes must be 64 or 256");
+                }
+            }
+            options.memoize = argblock.has_option("memoize");
+            options.memoSize = 65536;
+            if (argblock.has_option("memo-size")) {
+                options.memoSize = parseSize(argblock.get_option("memo-size"),
+                    "--memo-size");
+                if (options.memoSize == 0) {
+                    throw std::runtime_error("--memo-size must be a positive "
+                        "number");
+                }
+            }
+            if (argblock.has_option("inline-size")) {
+                options.inlining.maxSize = parseSize(
+                    argblock.get_option("inline-size"), "--inline-size");
+            }
+            if (argblock.has_option("inline-limit")) {
+                options.inlining.maxCallerSize = parseSize(
+                    argblock.get_option("inline-limit"), "--inline-limit");
+            }
+            if (argblock.has_option("max-gates")) {
+                options.circuits.maxGates = parseSize(
+                    argblock.get_option("max-gates"), "--max-gates");
+            }
+            if (argblock.has_option("table-size")) {
+                options.tables.maxBytes = parseSize(
+                    argblock.get_option("table-size"), "--table-size");
+            }
+            options.threads = 0;
+            if (argblock.has_option("threads")) {
+                options.threads = parseSize(argblock.get_option("threads"),
+                    "--threads");
+            }
+            options.tables.threads = options.threads;
+            options.cache = argblock.get_option("cache");
+            options.flush = getDefaultFlushPolicy();
+            if (argblock.has_option("flush")) {
+                options.flush = parseFlushPolicy(argblock.get_option("flush"));
+            }
+            if (!options.batch.empty() && options.batchInput.empty()) {
+                throw std::runtime_error("--batch requires --batch-input");
+            }
+            if (!source.open(argblock[0])) {
                 std::cout << "Could not open file." << std::endl;
             } else {
-                // Create debug info
-                DebugInfo info;
-                info.filename = std::make_shared<std::string>(argblock[0]);
-                info.line = 1;
-                info.column = 1;
-                info.position = 0;
-                run(file, info, do_benchmark, do_optimize);
+                uint32_t file = sources.addFile(argblock[0], source);
+                run(source, file, options);
             }
         }
     } catch (DebugError& e) {
-        handleError(e);
+        handleError(e, sources);
     } catch (std::exception& e) {
         // generic, unknown error
         std::cout << "Error: " << e.what() << std::endl;
@@ -0,0 +1,136 @@
+#include "memo.h"
+#include "bytecode.h"
+#include "state.h"
+#include <algorithm>
+#include <set>
+
+namespace {
+
+/// Instructions that a function must run for a cache lookup, which hashes
+/// the inputs and takes a lock, to be worth it
+const size_t minMemoCost = 64;
+
+/// Count the instructions that a function runs, up to limit. Loops and
+/// recursion count as the limit.
+size_t estimateCost(const Function& function, size_t limit,
+    std::set<const Function*>& calling)
+{
+    const Bytecode *bytecode = function.getBytecode();
+    if (!bytecode) {
+        // external functions are a single step
+        return 1;
+    }
+    if (!calling.insert(&function).second) {
+        return limit;
+    }
+    const std::vector<Instruction>& code = bytecode->getCode();
+    size_t cost = code.size();
+    for (size_t i = 0; i < code.size() && cost < limit; ++i) {
+        const Instruction& inst = code[i];
+        if (inst.op == Opcode::FOR_NEXT || ((inst.op == Opcode::JUMP
+         || inst.op == Opcode::JUMP_IF_ZERO) && inst.a <= i)) {
+            cost = limit;
+        } else if (inst.op == Opcode::CALL) {
+            cost += estimateCost(*bytecode->getCalls()[inst.a],
+                limit - std::min(cost, limit), calling);
+        }
+    }
+    calling.erase(&function);
+    return std::min(cost, limit);
+}
+
+} // namespace
+
+bool isWorthMemoizing(const Function& function)
+{
+    if (!function.getBytecode()) {
+        return true;
+    }
+    std::set<const Function*> calling;
+    return estimateCost(function, minMemoCost, calling) >= minMemoCost;
+}
+
+size_t MemoKeyHash::operator()(const std::vector<uint64_t>& key) const
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (uint64_t word : key) {
+        hash ^= word;
+        hash *= 0x100000001b3;
+        hash ^= hash >> 32;
+    }
+    return size_t(hash);
+}
+
+MemoCache::MemoCache(size_t inputs, size_t outputs, size_t capacity)
+: m_inputs(inputs), m_outputs(outputs), m_capacity(std::max<size_t>(capacity, 1))
+, m_hand(0), m_hits(0), m_misses(0) {}
+
+std::vector<uint64_t> MemoCache::getKey(const State& state) const
+{
+    std::vector<uint64_t> key((m_inputs + 63) / 64);
+    size_t base = state.size() - m_inputs;
+    for (size_t i = 0; i < m_inputs; i += 64) {
+        key[i / 64] = state.getBits(base + i, std::min<size_t>(64, m_inputs - i));
+    }
+    return key;
+}
+
+bool MemoCache::lookup(State& state, const std::vector<uint64_t>& key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto iter = m_index.find(key);
+    if (iter == m_index.end()) {
+        ++m_misses;
+        return false;
+    }
+    ++m_hits;
+    Entry& entry = m_entries[iter->second];
+    entry.referenced = true;
+    state.resize(state.size() - m_inputs);
+    state.pushBits(entry.outputs, 0, m_outputs);
+    return true;
+}
+
+void MemoCache::store(const State& state, std::vector<uint64_t>&& key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // A recursive call may have stored this key already
+    if (m_index.count(key)) {
+        return;
+    }
+    size_t slot;
+    if (m_entries.size() < m_capacity) {
+        slot = m_entries.size();
+        m_entries.emplace_back();
+    } else {
+        while (m_entries[m_hand].referenced) {
+            m_entries[m_hand].referenced = false;
+            m_hand = (m_hand + 1) % m_capacity;
+        }
+        slot = m_hand;
+        m_hand = (m_hand + 1) % m_capacity;
+        m_index.erase(m_entries[slot].key);
+    }
+    Entry& entry = m_entries[slot];
+    entry.outputs.resize(m_outputs);
+    size_t base = state.size() - m_outputs;
+    for (size_t i = 0; i < m_outputs; i += 64) {
+        size_t n = std::min<size_t>(64, m_outputs - i);
+        entry.outputs.setBits(i, n, state.getBits(base + i, n));
+    }
+    entry.referenced = false;
+    entry.key = std::move(key);
+    m_index[entry.key] = slot;
+}
+
+size_t MemoCache::getHits() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_hits;
+}
+
+size_t MemoCache::getMisses() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_misses;
+}
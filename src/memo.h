@@ -0,0 +1,64 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include "bitstack.h"
+
+class State;
+class Function;
+
+/// Hash for the packed input bits of a memo key
+struct MemoKeyHash {
+    size_t operator()(const std::vector<uint64_t>& key) const;
+};
+
+/// Get whether a function runs long enough for looking up its results in a
+/// cache to cost less than running it. Functions that loop or recurse always
+/// do; other functions must run enough instructions, counting those of the
+/// functions they call. Functions without bytecode are assumed to.
+bool isWorthMemoizing(const Function& function);
+
+/// A bounded table of the results of a function that has no global effects.
+/// Entries are keyed on the function's input bits, packed 64 to a word, and
+/// store its output bits. Once the table is full, entries are evicted with
+/// the clock algorithm: every entry has a reference bit that is set when it
+/// is used, and the clock hand skips over (and clears) referenced entries
+/// until it finds one that has not been used since the hand last passed it.
+/// The table grows as results are stored, so a cache that is rarely used
+/// stays small.
+/// A cache may be used by several threads that run the same program, so it
+/// is locked while it is looked up or stored to.
+class MemoCache {
+    struct Entry {
+        std::vector<uint64_t> key;
+        BitStack outputs;
+        bool referenced;
+    };
+    size_t m_inputs;
+    size_t m_outputs;
+    size_t m_capacity;
+    std::vector<Entry> m_entries;
+    std::unordered_map<std::vector<uint64_t>, size_t, MemoKeyHash> m_index;
+    /// Next entry to be considered for eviction
+    size_t m_hand;
+    size_t m_hits;
+    size_t m_misses;
+    mutable std::mutex m_mutex;
+public:
+    /// Create a cache for a function with the given number of inputs and
+    /// outputs, which holds up to capacity results.
+    MemoCache(size_t inputs, size_t outputs, size_t capacity);
+    /// Read the key for the inputs on top of the stack
+    std::vector<uint64_t> getKey(const State& state) const;
+    /// Look up the given key. On a hit, the inputs on top of the stack are
+    /// replaced with the stored outputs and true is returned.
+    bool lookup(State& state, const std::vector<uint64_t>& key);
+    /// Store the outputs on top of the stack as the result for the given key
+    void store(const State& state, std::vector<uint64_t>&& key);
+    /// Get the number of calls that were answered by the cache
+    size_t getHits() const;
+    /// Get the number of calls that had to be run
+    size_t getMisses() const;
+};
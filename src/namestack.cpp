@@ -1,11 +1,12 @@
 #include "namestack.h"
 #include <sstream>
+#include <algorithm>
 
 NameStack::NameStack()
-: m_prev(nullptr), m_size(0) {}
+: m_prev(nullptr), m_size(0), m_frameSize(0) {}
 
 NameStack::NameStack(NameStack& other)
-: m_prev(&other), m_size(0) {}
+: m_prev(&other), m_size(0), m_frameSize(0) {}
 
 bool NameStack::isNameInUse(const std::string& name) const
 {
@@ -49,6 +50,7 @@ NameStackDef NameStack::insertIndexed(const Token& token, size_t index)
         def.pos = size();
         m_size += index;
         m_names[token.getIdentifier()] = def;
+        reserve(size());
     }
     return def;
 }
@@ -122,3 +124,16 @@ size_t NameStack::size()
         return m_size;
     }
 }
+
+size_t NameStack::getFrameSize() const
+{
+    return m_frameSize;
+}
+
+void NameStack::reserve(size_t size)
+{
+    m_frameSize = std::max(m_frameSize, size);
+    if (m_prev) {
+        m_prev->reserve(size);
+    }
+}
@@ -11,6 +11,10 @@ class NameStack {
     NameStack *m_prev;
     std::map<std::string, NameStackDef> m_names;
     size_t m_size;
+    /// Largest size of this NameStack and of every NameStack inside of it
+    size_t m_frameSize;
+    /// Make sure that the frame has room for size variables
+    void reserve(size_t size);
 public:
     NameStack();
     NameStack(NameStack&);
@@ -32,4 +36,8 @@ public:
     void removeName(const std::string& name);
     /// Get the number of elements in this specific NameStack (not parents)
     size_t size();
+    /// Get the number of variables needed by this NameStack and every
+    /// NameStack inside of it. Sibling scopes share positions, so this is the
+    /// size of the deepest scope rather than the total.
+    size_t getFrameSize() const;
 };
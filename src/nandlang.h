@@ -0,0 +1,108 @@
+#ifndef NANDLANG_H
+#define NANDLANG_H
+/* C API for embedding Nandlang.
+ *
+ * A program is loaded and compiled once, and its functions can then be
+ * called any number of times. Calls are made through a state, which holds
+ * the stack and the I/O callbacks. A program can be shared by several
+ * states, each used by a thread of its own; a single state must only be
+ * used by one thread at a time.
+ *
+ * Bits are passed packed into bytes or 64-bit words, most significant bit
+ * first: the first bit of a function's inputs is the highest bit of the
+ * first byte or word. This is the order that Nandlang uses for integers, so
+ * e.g. an 8 bit input is passed as the byte of the same value. When the
+ * number of bits is not a multiple of the size of a byte or word, the last
+ * one uses its highest bits, and the rest of its bits are ignored on input
+ * and set to 0 on output.
+ *
+ * Functions that can fail return NULL or a non-zero value, and
+ * nand_get_error() then describes the error.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A compiled program */
+typedef struct nand_program nand_program;
+/* A function of a program. It belongs to the program, and is valid for as
+ * long as the program is. */
+typedef struct nand_function nand_function;
+/* A stack to call functions on, with its own I/O */
+typedef struct nand_state nand_state;
+
+/* Flags that control how a program is compiled */
+enum {
+    /* Optimize the program. This is almost always wanted. */
+    NAND_OPTIMIZE = 1,
+    /* Compile the program into native code, where the JIT is supported */
+    NAND_JIT = 2,
+    /* Bounds check every variable access while running. Native code is not
+     * used. */
+    NAND_CHECKED = 4
+};
+
+/* Reads a character for getc. Returns a value from 0 to 255, or -1 at the
+ * end of the input. */
+typedef int (*nand_read_fn)(void *user);
+/* Writes characters from putc, putb, puti8 and endl. Output is buffered,
+ * and written out before a call returns. */
+typedef void (*nand_write_fn)(void *user, const char *data, size_t size);
+
+/* Get the version of the library, e.g. "1.2" */
+const char *nand_version(void);
+
+/* Get a description of the last error on this thread */
+const char *nand_get_error(void);
+
+/* Load and compile a program from source text. name is the file name that
+ * errors refer to. The text is copied. Returns NULL on error. */
+nand_program *nand_load_buffer(const char *source, size_t size,
+    const char *name, int flags);
+
+/* Load and compile a program from a file. Returns NULL on error. */
+nand_program *nand_load_file(const char *path, int flags);
+
+/* Free a program. Every state that runs it must be freed first. */
+void nand_program_free(nand_program *program);
+
+/* Look up a function by name. Returns NULL if there is none. */
+const nand_function *nand_find_function(const nand_program *program,
+    const char *name);
+
+/* Get the number of input bits of a function */
+size_t nand_function_inputs(const nand_function *function);
+
+/* Get the number of output bits of a function */
+size_t nand_function_outputs(const nand_function *function);
+
+/* Create a state to run a program. I/O goes to standard input and output
+ * until callbacks are set. Returns NULL on error. */
+nand_state *nand_state_new(nand_program *program);
+
+/* Free a state */
+void nand_state_free(nand_state *state);
+
+/* Set the callbacks that the state's I/O goes through. user is passed to
+ * both. A NULL callback restores standard input or output. */
+void nand_state_set_io(nand_state *state, nand_read_fn read,
+    nand_write_fn write, void *user);
+
+/* Call a function of the state's program. inputs holds
+ * nand_function_inputs() bits, and outputs receives
+ * nand_function_outputs() bits. Returns 0 on success. */
+int nand_call(nand_state *state, const nand_function *function,
+    const uint8_t *inputs, uint8_t *outputs);
+
+/* Call a function, the same as nand_call, with bits packed into words */
+int nand_call_words(nand_state *state, const nand_function *function,
+    const uint64_t *inputs, uint64_t *outputs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
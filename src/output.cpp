@@ -0,0 +1,109 @@
+#include "output.h"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#if !defined(_WIN32)
+#include <unistd.h>
+#define NANDLANG_WRITE
+#endif
+
+FlushPolicy getDefaultFlushPolicy()
+{
+#ifdef NANDLANG_WRITE
+    return isatty(STDOUT_FILENO) ? FlushPolicy::LINE : FlushPolicy::FULL;
+#else
+    return FlushPolicy::LINE;
+#endif
+}
+
+bool isInteractive(const std::istream& stream)
+{
+    if (&stream != &std::cin) {
+        return false;
+    }
+#ifdef NANDLANG_WRITE
+    return isatty(STDIN_FILENO);
+#else
+    return true;
+#endif
+}
+
+Output::Output()
+: m_stream(&std::cout), m_direct(false), m_policy(getDefaultFlushPolicy())
+, m_limit(bufferSize)
+{
+#ifdef NANDLANG_WRITE
+    m_direct = true;
+#endif
+}
+
+Output::~Output()
+{
+    flush();
+}
+
+void Output::setStream(std::ostream& stream)
+{
+    flush();
+    m_stream = &stream;
+    m_direct = false;
+#ifdef NANDLANG_WRITE
+    m_direct = &stream == &std::cout;
+#endif
+}
+
+void Output::setPolicy(FlushPolicy policy)
+{
+    flush();
+    m_policy = policy;
+    m_limit = policy == FlushPolicy::EXIT ? std::numeric_limits<size_t>::max()
+                                          : bufferSize;
+}
+
+FlushPolicy Output::getPolicy() const
+{
+    return m_policy;
+}
+
+void Output::flush()
+{
+    if (m_buffer.empty()) {
+        return;
+    }
+#ifdef NANDLANG_WRITE
+    if (m_direct) {
+        // anything written to std::cout before must come out first
+        std::cout.flush();
+        const char *data = m_buffer.data();
+        size_t size = m_buffer.size();
+        while (size > 0) {
+            ssize_t written = ::write(STDOUT_FILENO, data, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // output that can not be written is dropped, as std::cout
+                // would do
+                break;
+            }
+            data += written;
+            size -= size_t(written);
+        }
+        m_buffer.clear();
+        return;
+    }
+#endif
+    m_stream->write(m_buffer.data(), m_buffer.size());
+    m_stream->flush();
+    m_buffer.clear();
+}
+
+void Output::write(const char *data, size_t size)
+{
+    m_buffer.append(data, size);
+    if (m_buffer.size() >= m_limit || (m_policy == FlushPolicy::LINE
+     && std::memchr(data, '\n', size))) {
+        flush();
+    }
+}
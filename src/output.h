@@ -0,0 +1,69 @@
+#pragma once
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+
+/// When buffered output is written out
+enum class FlushPolicy {
+    /// Whenever the buffer is full
+    FULL,
+    /// At the end of every line, and whenever the buffer is full
+    LINE,
+    /// Only once the program has finished, or when input is read from a
+    /// terminal. The buffer grows to hold everything until then.
+    EXIT
+};
+
+/// Get the flush policy for standard output: LINE when it is a terminal, so
+/// that output appears as it is written, and FULL otherwise
+FlushPolicy getDefaultFlushPolicy();
+
+/// Get whether reading from a stream may wait on a person typing, so that
+/// output should be written out before it is read
+bool isInteractive(const std::istream& stream);
+
+/// Output of the standard library functions. Characters are gathered in a
+/// buffer, and written out in large blocks according to the flush policy.
+/// Standard output is written with write(2) where it is available, so the
+/// buffer goes straight to the file without passing through std::cout; any
+/// other stream is written to as a whole buffer at a time.
+class Output {
+    /// Stream to write to
+    std::ostream *m_stream;
+    /// Write to the file descriptor of standard output instead of m_stream
+    bool m_direct;
+    FlushPolicy m_policy;
+    /// Characters that have not been written out yet
+    std::string m_buffer;
+    /// Size at which the buffer is written out
+    size_t m_limit;
+public:
+    /// Size of the buffer, unless the policy is EXIT
+    static const size_t bufferSize = 65536;
+    /// Create an output that writes to standard output
+    Output();
+    /// Write out everything that is left
+    ~Output();
+    Output(const Output&) = delete;
+    Output& operator=(const Output&) = delete;
+    /// Write out the buffer, then write to another stream
+    void setStream(std::ostream& stream);
+    /// Write out the buffer, then follow another policy
+    void setPolicy(FlushPolicy policy);
+    FlushPolicy getPolicy() const;
+    /// Write out everything in the buffer
+    void flush();
+    /// Put a character
+    void put(char c);
+    /// Put several characters
+    void write(const char *data, size_t size);
+};
+
+inline void Output::put(char c)
+{
+    m_buffer.push_back(c);
+    if (m_buffer.size() >= m_limit
+     || (c == '\n' && m_policy == FlushPolicy::LINE)) {
+        flush();
+    }
+}
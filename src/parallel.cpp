@@ -0,0 +1,110 @@
+#include "parallel.h"
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+
+size_t getThreadCount(size_t threads)
+{
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    return threads;
+}
+
+namespace {
+
+/// Tasks that are ready to run on one thread
+struct TaskQueue {
+    std::mutex mutex;
+    std::deque<size_t> tasks;
+};
+
+} // namespace
+
+void runTasks(size_t count,
+    const std::vector<std::vector<size_t>>& dependencies, size_t threads,
+    const std::function<void(size_t task, size_t thread)>& task)
+{
+    if (count == 0) {
+        return;
+    }
+    size_t workers = std::min(getThreadCount(threads), count);
+    // number of unfinished dependencies of each task, and the tasks that
+    // wait on each task
+    std::unique_ptr<std::atomic<size_t>[]> waiting(
+        new std::atomic<size_t>[count]);
+    std::vector<std::vector<size_t>> dependents(count);
+    for (size_t i = 0; i < count; ++i) {
+        waiting[i] = 0;
+        if (i < dependencies.size()) {
+            waiting[i] = dependencies[i].size();
+            for (size_t dependency : dependencies[i]) {
+                dependents[dependency].push_back(i);
+            }
+        }
+    }
+    std::vector<TaskQueue> queues(workers);
+    for (size_t i = 0; i < count; ++i) {
+        if (waiting[i] == 0) {
+            queues[i % workers].tasks.push_back(i);
+        }
+    }
+    std::atomic<size_t> remaining(count);
+    std::vector<std::exception_ptr> errors(count);
+    auto work = [&](size_t worker) {
+        while (remaining > 0) {
+            // take the newest task of this thread, or the oldest of another
+            bool found = false;
+            size_t current;
+            for (size_t i = 0; i < workers && !found; ++i) {
+                TaskQueue& queue = queues[(worker + i) % workers];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (!queue.tasks.empty()) {
+                    if (i == 0) {
+                        current = queue.tasks.back();
+                        queue.tasks.pop_back();
+                    } else {
+                        current = queue.tasks.front();
+                        queue.tasks.pop_front();
+                    }
+                    found = true;
+                }
+            }
+            if (!found) {
+                // the remaining tasks are running or waiting on running ones
+                std::this_thread::yield();
+                continue;
+            }
+            try {
+                task(current, worker);
+            } catch (...) {
+                errors[current] = std::current_exception();
+            }
+            for (size_t dependent : dependents[current]) {
+                if (--waiting[dependent] == 0) {
+                    TaskQueue& queue = queues[worker];
+                    std::lock_guard<std::mutex> lock(queue.mutex);
+                    queue.tasks.push_back(dependent);
+                }
+            }
+            --remaining;
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < workers; ++i) {
+        pool.emplace_back(work, i);
+    }
+    work(0);
+    for (auto& thread : pool) {
+        thread.join();
+    }
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
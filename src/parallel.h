@@ -0,0 +1,21 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+/// Get the number of threads to use when threads are asked for. 0 uses one
+/// per processor.
+size_t getThreadCount(size_t threads);
+
+/// Run count tasks on a pool of threads, with up to the given number of
+/// threads, including the calling one. A task is only started once every task
+/// that dependencies lists for it has finished; dependencies may be empty if
+/// there are none. Each thread keeps its own queue of tasks that are ready,
+/// and steals from the other queues when it runs out.
+/// task is called with the index of the task and of the thread running it,
+/// which is less than getThreadCount(threads). If tasks throw, every other
+/// task is still run, and then the exception of the lowest numbered task that
+/// threw is rethrown, so that the error does not depend on the thread count.
+void runTasks(size_t count,
+    const std::vector<std::vector<size_t>>& dependencies, size_t threads,
+    const std::function<void(size_t task, size_t thread)>& task);
@@ -1,5 +1,6 @@
 #include "parse.h"
-#include <cctype>
+#include <cstdint>
+#include <cstring>
 #include <stdexcept>
 #include <sstream>
 #include <limits>
@@ -10,23 +11,7 @@ const char SQUOTE = '\'';
 const char ESCAPE = '\\';
 const char INDEX_BEGIN = '[';
 const char INDEX_END = ']';
-
-size_t strToNumber(const std::string& str, const std::string& err,
-    const DebugInfo& info)
-{
-    if (str == pointerIdentifier) {
-        return pointerSize;
-    }
-    size_t value;
-    std::stringstream indexstream(str);
-    indexstream >> value;
-    if (!indexstream.eof() || indexstream.bad()) {
-        std::stringstream s;
-        s << err << " " << str;
-        throwError(info, s.str());
-    }
-    return value;
-}
+const char COMMENT = '/';
 
 /// Maps character escape codes to their representations
 const std::map<char, char> ESCAPE_LOOKUP = {
@@ -38,12 +23,6 @@ const std::map<char, char> ESCAPE_LOOKUP = {
     {'r', '\f'},
 };
 
-/// Returns true if the given character is allowed to be used for an identifier
-bool isCharacterAllowed(char c)
-{
-    return std::isalnum(c) || c == UNDERSCORE;
-}
-
 /// Get the actual char value from a char string
 /// Given string should NOT be surrounded in single quotes
 /// Returns true if the character was successfully parsed.
@@ -77,198 +56,336 @@ bool getCharLiteralFromString(const std::string& id, char& c)
     }
 }
 
-/// Return true if the given string is a valid identifier
-/// This means all characters in the string are alphanumeric or underscores, and
-/// does not begin with a digit.
-bool isStringIdentifier(const std::string& id)
+/// Read a decimal number. Returns false if the text is empty or not made of
+/// digits, or if the number is too large.
+bool getNumberFromString(const char *text, size_t length, size_t& value)
 {
-    for (auto c : id) {
-        if (!std::isalnum(c) && c != UNDERSCORE) {
+    value = 0;
+    if (length == 0) {
+        return false;
+    }
+    for (size_t i = 0; i < length; ++i) {
+        if (text[i] < '0' || text[i] > '9') {
             return false;
         }
+        size_t digit = size_t(text[i] - '0');
+        if (value > (std::numeric_limits<size_t>::max() - digit) / 10) {
+            return false;
+        }
+        value = value * 10 + digit;
     }
-    return (id.size() > 0 && !std::isdigit(id[0]));
+    return true;
 }
 
-/// Append the given identifier to the token block. The given identifier may
-/// be transformed into other token types, e.g. Symbol::WHILE if it matches a
-/// keyword, or a literal if it is a boolean literal.
-void appendIdentifier(TokenBlock& block, std::string& id, const DebugInfo& info)
+namespace {
+
+/// How the lexer treats a character
+enum class CharClass : uint8_t {
+    INVALID, SPACE, IDENTIFIER, SYMBOL, QUOTE, INDEX, COMMENT
+};
+
+/// Classes of every character, and the symbols of single character symbols,
+/// so that each character is classified with a single lookup.
+struct CharTable {
+    CharClass classes[256];
+    Symbol symbols[256];
+    /// Character that ends a block symbol, or 0
+    char endings[256];
+    CharTable();
+};
+
+CharTable::CharTable()
 {
-    if (id.empty()) {
-        return;
+    for (size_t i = 0; i < 256; ++i) {
+        classes[i] = CharClass::INVALID;
+        symbols[i] = Symbol::NONE;
+        endings[i] = 0;
     }
-    // if (id == "0") {
-    //     block.push_back(Token(Symbol::LITERAL, false, info));
-    // } else if (id == "1") {
-    //     block.push_back(Token(Symbol::LITERAL, true, info));
-    // } else
-    if (keywordMap.count(id)) {
-        block.push_back(Token(keywordMap.at(id), info));
-    } else if (isStringIdentifier(id)) {
-        block.push_back(Token(Symbol::IDENTIFIER, id, info));
-    } else {
-        size_t value = strToNumber(id, "Bad identifier", info);
-        block.push_back(Token(Symbol::LITERAL, value, info));
+    // lines are only counted when an error is reported, so newlines are
+    // plain whitespace
+    for (unsigned char c : {' ', '\t', '\n', '\v', '\f', '\r'}) {
+        classes[c] = CharClass::SPACE;
+    }
+    for (size_t c = 0; c < 256; ++c) {
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+         || (c >= '0' && c <= '9') || c == UNDERSCORE) {
+            classes[c] = CharClass::IDENTIFIER;
+        }
     }
-    id = "";
+    for (const auto& p : symbolMap) {
+        uint8_t c = uint8_t(p.first);
+        classes[c] = CharClass::SYMBOL;
+        symbols[c] = p.second;
+        if (symbolBlocks.count(p.second)) {
+            endings[c] = symbolBlocks.at(p.second);
+        }
+    }
+    classes[uint8_t(SQUOTE)] = CharClass::QUOTE;
+    classes[uint8_t(INDEX_BEGIN)] = CharClass::INDEX;
+    classes[uint8_t(COMMENT)] = CharClass::COMMENT;
 }
 
-/// parse an index, e.g. [4]
-void parseIndex(std::istream& stream, TokenBlock& block, DebugInfo& context)
+/// Keywords, found with a perfect hash of their length and first two
+/// characters. An identifier is a keyword only if it matches the entry that
+/// it hashes to.
+struct KeywordTable {
+    static const size_t size = 8;
+    struct Entry {
+        const std::string *name;
+        Symbol symbol;
+    };
+    Entry entries[size];
+    KeywordTable();
+    static size_t hash(const char *text, size_t length);
+    /// Get the keyword symbol of an identifier, or Symbol::NONE
+    Symbol find(const char *text, size_t length) const;
+};
+
+KeywordTable::KeywordTable()
 {
-    char c;
-    std::string indexstring;
-    const DebugInfo info = context;
-    while (stream.get(c)) {
-        context.column += 1;
-        context.position += 1;
-        if (c == INDEX_END) {
-            break;
-        }
-        if (std::isspace(c)) {
-            if (c == '\n') {
-                context.line += 1;
-                context.column = 1;
-            }
-        } else if (std::isprint(c)) {
-            indexstring += c;
-        } else  {
-            std::stringstream s;
-            s << "Unexpected character " << "0x" << std::hex << std::setw(2)
-              << std::setfill('0') << std::uppercase << int(c) << " in index";
-            throwError(info, s.str());
+    for (size_t i = 0; i < size; ++i) {
+        entries[i] = {nullptr, Symbol::NONE};
+    }
+    for (const auto& p : keywordMap) {
+        Entry& entry = entries[hash(p.first.data(), p.first.size())];
+        if (entry.name) {
+            throw std::logic_error("Keywords " + *entry.name + " and "
+                + p.first + " have the same hash");
         }
+        entry = {&p.first, p.second};
     }
-    size_t index = strToNumber(indexstring, "Invalid index", info);
-    block.push_back(Token(Symbol::INDEX, index, info));
 }
 
-/// parse a character literal, e.g. 'a', from the given stream.
-void parseChar(std::istream& stream, TokenBlock& block, DebugInfo& context)
+size_t KeywordTable::hash(const char *text, size_t length)
 {
-    char c;
-    std::string charstring;
-    DebugInfo info = context;
-    while (stream.get(c)) {
-        info = context;
-        context.column += 1;
-        context.position += 1;
-        if (c == SQUOTE) {
-            break;
-        }
-        if (std::isprint(c)) {
-            // isprint allows all text characters and space
-            charstring += c;
+    return (length + uint8_t(text[0]) + uint8_t(text[1])) % size;
+}
+
+Symbol KeywordTable::find(const char *text, size_t length) const
+{
+    // every keyword has at least two characters
+    if (length < 2) {
+        return Symbol::NONE;
+    }
+    const Entry& entry = entries[hash(text, length)];
+    if (entry.name && entry.name->size() == length
+     && std::memcmp(entry.name->data(), text, length) == 0) {
+        return entry.symbol;
+    }
+    return Symbol::NONE;
+}
+
+/// The tables are built on first use, since they are built from maps in
+/// another file.
+const CharTable& getCharTable()
+{
+    static const CharTable table;
+    return table;
+}
+
+const KeywordTable& getKeywordTable()
+{
+    static const KeywordTable table;
+    return table;
+}
+
+/// Returns true if the character can be part of an index or character literal
+bool isPrintable(char c)
+{
+    return c >= 0x20 && c < 0x7f;
+}
+
+/// Splits source text into tokens. Tokens refer to the text instead of
+/// copying it, and debug information is only worked out for characters that
+/// tokens are made from.
+class Lexer {
+    const CharTable& m_chars;
+    const KeywordTable& m_keywords;
+    const char *m_begin;
+    const char *m_pos;
+    const char *m_end;
+    /// Index of the file in the source map
+    uint32_t m_file;
+    /// Tokens that have been read
+    TokenBlock m_tokens;
+public:
+    Lexer(const SourceFile& source, uint32_t file)
+    : m_chars(getCharTable()), m_keywords(getKeywordTable())
+    , m_begin(source.data()), m_pos(m_begin), m_end(m_begin + source.size())
+    , m_file(file)
+    {
+        // a rough guess, so that the array is rarely grown
+        m_tokens.reserve(source.size() / 8 + 16);
+    }
+
+    /// Get the debug information of a character
+    DebugInfo getInfo(const char *pos) const
+    {
+        return DebugInfo(m_file, uint32_t(pos - m_begin));
+    }
+
+    /// Append an identifier to the tokens. It may be transformed into
+    /// other token types, e.g. Symbol::WHILE if it matches a keyword, or a
+    /// literal if it starts with a digit.
+    void appendIdentifier(const char *text, size_t length)
+    {
+        DebugInfo info = getInfo(text);
+        Symbol keyword = m_keywords.find(text, length);
+        if (keyword != Symbol::NONE) {
+            m_tokens.push_back(Token(keyword, info));
+        } else if (text[0] < '0' || text[0] > '9') {
+            m_tokens.push_back(Token(Symbol::IDENTIFIER, text, length, info));
         } else {
-            std::stringstream s;
-            s << "Unexpected character 0x" << std::hex << std::setw(2)
-              << std::setfill('0') << std::uppercase << int(c)
-              << " in character literal";
-            throwError(info, s.str());
+            size_t value;
+            if (!getNumberFromString(text, length, value)) {
+                throwError(info, "Bad identifier " + std::string(text, length));
+            }
+            m_tokens.push_back(Token(Symbol::LITERAL, value, info));
         }
     }
-    if (getCharLiteralFromString(charstring, c)) {
-        // Character literals are expanded to 8 bool literals
-        for (size_t i = 0; i < 8; ++i) {
-            // Most significant bit comes first, since this language behaves in
-            // a big-endian way.
-            bool b = c & 0x80;
-            c <<= 1;
-            if (i != 0) {
-                // only 7 commas need be inserted, so only insert it when the
-                // index is not 0
-                block.push_back(Token(Symbol::COMMA, info));
+
+    /// parse an index, e.g. [4]. The opening bracket has been read.
+    void parseIndex()
+    {
+        std::string indexstring;
+        const DebugInfo info = getInfo(m_pos);
+        while (m_pos < m_end) {
+            char c = *m_pos++;
+            if (c == INDEX_END) {
+                break;
+            }
+            CharClass type = m_chars.classes[uint8_t(c)];
+            if (type == CharClass::SPACE) {
+                continue;
+            } else if (isPrintable(c)) {
+                indexstring += c;
+            } else  {
+                std::stringstream s;
+                s << "Unexpected character " << "0x" << std::hex
+                  << std::setw(2) << std::setfill('0') << std::uppercase
+                  << int(c) << " in index";
+                throwError(info, s.str());
             }
-            block.push_back(Token(Symbol::LITERAL, b, info));
         }
-    } else {
-        std::stringstream s;
-        s << "Invalid character literal " << charstring;
-        throwError(info, s.str());
+        size_t index;
+        if (indexstring.empty()) {
+            throwError(info, "Index can not be empty");
+        } else if (indexstring == pointerIdentifier) {
+            index = pointerSize;
+        } else if (!getNumberFromString(indexstring.data(),
+                indexstring.size(), index)) {
+            throwError(info, "Invalid index " + indexstring);
+        }
+        m_tokens.push_back(Token(Symbol::INDEX, index, info));
     }
-}
 
-/// Parse tokens until the given ending chracter.
-TokenBlock _parseTokens(std::istream& stream, DebugInfo& context, char endc)
-{
-    TokenBlock block;
-    std::string identifier;
-    DebugInfo id_info;
-    // Having three different DebugInfo objects is a little confusing, but there
-    // is VERY good reason for doing so. Here they are explained:
-    //  * id_info - DebugInfo for the beginning of the identifier
-    //  * context - DebugInfo that gets incremented whenever an end of line
-    //              character is met and whenever a character is read.
-    //  * info    - Per-character information. Since context must be increment
-    //              right after every read, context can not be used as it
-    //              will actually point to the NEXT character. So, there must be
-    //              an info object that points to the current one.
-    char c;
-    while (stream.get(c)) {
-        const DebugInfo info = context;
-        context.column += 1;
-        context.position += 1;
-        if (c == '/' && stream.peek() == '/') {
-            while (stream) {
-                context.position += 1;
-                if (stream.get() == '\n') {
-                    break;
-                }
-            }
-            context.line += 1;
-            // column set to 0 since it will be incremented later
-            context.column = 1;
-        } else if (c == endc) {
-            appendIdentifier(block, identifier, id_info);
-            return block;
-        } else if (c == SQUOTE) {
-            appendIdentifier(block, identifier, id_info);
-            parseChar(stream, block, context);
-        } else if (c == INDEX_BEGIN) {
-            appendIdentifier(block, identifier, id_info);
-            parseIndex(stream, block, context);
-        } else if (std::isspace(c)) {
-            appendIdentifier(block, identifier, id_info);
-            if (c == '\n') {
-                context.line += 1;
-                // column set to 0 since it will be incremented later
-                context.column = 1;
+    /// parse a character literal, e.g. 'a'. The opening quote has been read.
+    void parseChar()
+    {
+        const char *start = m_pos;
+        const char *last = m_pos;
+        const char *end = m_end;
+        while (m_pos < m_end) {
+            last = m_pos;
+            char c = *m_pos++;
+            if (c == SQUOTE) {
+                end = last;
+                break;
             }
-        } else if (symbolMap.count(c)) {
-            appendIdentifier(block, identifier, id_info);
-            Symbol symbol = symbolMap.at(c);
-            if (symbolBlocks.count(symbol)) {
-                // Next few characters as the inside of this symbol
-                char ending = symbolBlocks.at(symbol);
-                TokenBlock inner = _parseTokens(stream, context, ending);
-                block.push_back(Token(symbol, inner, info));
-            } else {
-                block.push_back(Token(symbol, info));
+            if (!isPrintable(c)) {
+                std::stringstream s;
+                s << "Unexpected character 0x" << std::hex << std::setw(2)
+                  << std::setfill('0') << std::uppercase << int(c)
+                  << " in character literal";
+                throwError(getInfo(last), s.str());
             }
+        }
+        DebugInfo info = getInfo(last);
+        std::string charstring(start, end);
+        char c;
+        if (getCharLiteralFromString(charstring, c)) {
+            // Character literals are 8 bool literals, packed into one token
+            Token token(Symbol::LITERAL, uint8_t(c), info);
+            token.setPacked(8);
+            m_tokens.push_back(token);
         } else {
-            if (isCharacterAllowed(c)) {
-                if (identifier.empty()) {
-                    id_info = info;
+            throwError(info, "Invalid character literal " + charstring);
+        }
+    }
+
+    /// Parse tokens until the given ending character
+    void parse(char endc)
+    {
+        while (m_pos < m_end) {
+            const char *pos = m_pos;
+            char c = *m_pos++;
+            if (c == endc) {
+                return;
+            }
+            switch (m_chars.classes[uint8_t(c)]) {
+            case CharClass::IDENTIFIER:
+                while (m_pos < m_end
+                    && m_chars.classes[uint8_t(*m_pos)]
+                        == CharClass::IDENTIFIER) {
+                    ++m_pos;
+                }
+                appendIdentifier(pos, size_t(m_pos - pos));
+                break;
+            case CharClass::SPACE:
+                break;
+            case CharClass::SYMBOL: {
+                Symbol symbol = m_chars.symbols[uint8_t(c)];
+                char ending = m_chars.endings[uint8_t(c)];
+                m_tokens.push_back(Token(symbol, getInfo(pos)));
+                if (ending) {
+                    // Next few characters as the inside of this symbol
+                    size_t index = m_tokens.size() - 1;
+                    parse(ending);
+                    m_tokens[index].setBlock(index + 1, m_tokens.size());
+                }
+                break;
+            }
+            case CharClass::QUOTE:
+                parseChar();
+                break;
+            case CharClass::INDEX:
+                parseIndex();
+                break;
+            case CharClass::COMMENT:
+                if (m_pos < m_end && *m_pos == COMMENT) {
+                    const void *newline = std::memchr(m_pos, '\n',
+                        size_t(m_end - m_pos));
+                    m_pos = newline ? static_cast<const char*>(newline) + 1
+                                    : m_end;
+                    break;
                 }
-                identifier += c;
-            } else {
+                // fall through
+            case CharClass::INVALID: {
                 std::stringstream s;
                 s << "Unknown character '" << c << "'";
-                throwError(info, s.str());
+                throwError(getInfo(pos), s.str());
             }
+            }
+        }
+        if (endc) {
+            std::stringstream s;
+            s << "Expected " << endc << " before end of file.";
+            throwError(getInfo(m_pos), s.str());
         }
     }
-    if (endc) {
-        std::stringstream s;
-        s << "Expected " << endc << " before end of file.";
-        throwError(context, s.str());
+
+    /// Take the tokens that have been read
+    TokenBlock takeTokens()
+    {
+        return std::move(m_tokens);
     }
-    appendIdentifier(block, identifier, id_info);
-    return block;
-}
+};
+
+} // namespace
 
-TokenBlock parseTokens(std::istream& stream, DebugInfo info)
+TokenBlock parseTokens(const SourceFile& source, uint32_t file)
 {
-    return _parseTokens(stream, info, 0);
+    Lexer lexer(source, file);
+    lexer.parse(0);
+    return lexer.takeTokens();
 }
@@ -1,8 +1,10 @@
 #pragma once
 #include "symbol.h"
 #include "debug.h"
+#include "source.h"
 #include <vector>
 #include <iostream>
 
-/// Takes an input stream and parses it into tokens.
-TokenBlock parseTokens(std::istream& stream, DebugInfo info);
+/// Splits source text into tokens. The tokens refer to the text, so it must
+/// outlive them. file is the index of the source in the source map.
+TokenBlock parseTokens(const SourceFile& source, uint32_t file);
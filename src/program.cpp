@@ -0,0 +1,78 @@
+#include "program.h"
+#include "jit.h"
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+Program::Program() {}
+
+Program::~Program() {}
+
+bool Program::hasFunction(const std::string& name) const
+{
+    return m_functions.count(name) > 0;
+}
+
+Function& Program::getFunction(const std::string& name)
+{
+    if (m_functions.count(name)) {
+        return *m_functions.at(name);
+    } else {
+        std::stringstream s;
+        s << "No function of name \"" << name << "\"";
+        throw std::runtime_error(s.str());
+    }
+}
+
+const Function& Program::getFunction(const std::string& name) const
+{
+    if (m_functions.count(name)) {
+        return *m_functions.at(name);
+    } else {
+        std::stringstream s;
+        s << "No function of name \"" << name << "\"";
+        throw std::runtime_error(s.str());
+    }
+}
+
+std::map<std::string, FunctionPtr>& Program::getFunctions()
+{
+    return m_functions;
+}
+
+const std::map<std::string, FunctionPtr>& Program::getFunctions() const
+{
+    return m_functions;
+}
+
+void Program::setJit(std::unique_ptr<Jit> jit)
+{
+    m_jit = std::move(jit);
+}
+
+Arena& Program::addArena()
+{
+    std::lock_guard<std::mutex> lock(m_arenaMutex);
+    m_arenas.push_back(std::make_unique<Arena>());
+    return *m_arenas.back();
+}
+
+void Program::releaseArenas(const Arena& keep)
+{
+    std::lock_guard<std::mutex> lock(m_arenaMutex);
+    auto end = std::remove_if(m_arenas.begin(), m_arenas.end(),
+        [&](const std::unique_ptr<Arena>& arena) {
+        return arena.get() != &keep;
+    });
+    m_arenas.erase(end, m_arenas.end());
+}
+
+void Program::getArenaStats(size_t& allocations, size_t& bytes) const
+{
+    allocations = 0;
+    bytes = 0;
+    for (const auto& arena : m_arenas) {
+        allocations += arena->getAllocations();
+        bytes += arena->getBytes();
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <map>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <string>
+#include "function.h"
+#include "arena.h"
+
+class Jit;
+
+/// The functions of a loaded program, and their native code.
+/// A program can be shared by several states, each running it on a thread of
+/// its own. Nothing in it is changed by running it, so it must not be changed
+/// while any of them are running.
+class Program {
+    /// Memory that the statements of the functions are allocated from. These
+    /// are declared first so that they outlive the functions, whose
+    /// statements are destroyed before their memory is released.
+    std::vector<std::unique_ptr<Arena>> m_arenas;
+    std::mutex m_arenaMutex;
+    /// Maps names to functions
+    std::map<std::string, FunctionPtr> m_functions;
+    /// Native code, if the JIT is used
+    std::unique_ptr<Jit> m_jit;
+public:
+    Program();
+    ~Program();
+    Program(const Program&) = delete;
+    Program& operator=(const Program&) = delete;
+    /// Returns true if there is a function of this name
+    bool hasFunction(const std::string& name) const;
+    /// Get a function from name
+    Function& getFunction(const std::string& name);
+    /// Get a constant function from name
+    const Function& getFunction(const std::string& name) const;
+    /// Get every function, by name
+    std::map<std::string, FunctionPtr>& getFunctions();
+    /// Get every constant function, by name
+    const std::map<std::string, FunctionPtr>& getFunctions() const;
+    /// Set the native code of the functions, replacing any previous code
+    void setJit(std::unique_ptr<Jit> jit);
+    /// Create a new arena to allocate statements from. Safe to call from
+    /// several threads.
+    Arena& addArena();
+    /// Release every arena except the given one. No statement may be left in
+    /// the arenas that are released.
+    void releaseArenas(const Arena& keep);
+    /// Get the number of nodes and bytes that are allocated in the arenas
+    void getArenaStats(size_t& allocations, size_t& bytes) const;
+};
@@ -0,0 +1,123 @@
+#include "source.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define NANDLANG_MMAP
+#endif
+
+SourceFile::SourceFile()
+: m_mapping(nullptr), m_mappingSize(0), m_data(""), m_size(0) {}
+
+SourceFile::SourceFile(std::string text)
+: SourceFile()
+{
+    m_text = std::move(text);
+    m_data = m_text.data();
+    m_size = m_text.size();
+}
+
+SourceFile::~SourceFile()
+{
+#ifdef NANDLANG_MMAP
+    if (m_mapping) {
+        munmap(m_mapping, m_mappingSize);
+    }
+#endif
+}
+
+bool SourceFile::open(const std::string& path)
+{
+#ifdef NANDLANG_MMAP
+    if (m_mapping) {
+        munmap(m_mapping, m_mappingSize);
+        m_mapping = nullptr;
+    }
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    // empty files and anything that is not a regular file, such as a pipe,
+    // are read instead
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mem != MAP_FAILED) {
+            close(fd);
+            m_mapping = mem;
+            m_mappingSize = st.st_size;
+            m_data = static_cast<const char*>(mem);
+            m_size = m_mappingSize;
+            return true;
+        }
+    }
+    close(fd);
+#endif
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    m_text = buffer.str();
+    m_data = m_text.data();
+    m_size = m_text.size();
+    return true;
+}
+
+const char *SourceFile::data() const
+{
+    return m_data;
+}
+
+size_t SourceFile::size() const
+{
+    return m_size;
+}
+
+uint32_t SourceMap::addFile(const std::string& name, const SourceFile& source)
+{
+    if (source.size() > UINT32_MAX) {
+        throw std::runtime_error(name + " is too large");
+    }
+    m_files.push_back(File{name, &source, {}});
+    // 0 is left for unknown files
+    return uint32_t(m_files.size());
+}
+
+SourceLocation SourceMap::locate(const DebugInfo& info)
+{
+    SourceLocation location{"", 0, 0, ""};
+    if (info.file == 0 || info.file > m_files.size()) {
+        return location;
+    }
+    File& file = m_files[info.file - 1];
+    const char *data = file.source->data();
+    size_t size = file.source->size();
+    if (file.lines.empty()) {
+        file.lines.push_back(0);
+        for (size_t i = 0; i < size; ++i) {
+            if (data[i] == '\n') {
+                file.lines.push_back(uint32_t(i + 1));
+            }
+        }
+    }
+    // the last line that starts at or before the position
+    auto line = std::upper_bound(file.lines.begin(), file.lines.end(),
+        info.position) - 1;
+    size_t begin = *line;
+    size_t end = begin;
+    while (end < size && data[end] != '\n') {
+        ++end;
+    }
+    location.filename = file.name;
+    location.line = size_t(line - file.lines.begin()) + 1;
+    location.column = info.position - begin + 1;
+    location.text.assign(data + begin, end - begin);
+    return location;
+}
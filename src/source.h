@@ -0,0 +1,61 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "debug.h"
+
+/// The text of a script. Files are mapped into memory where possible, so that
+/// they are never copied. Tokens refer to the text, so it must outlive them.
+class SourceFile {
+    /// Mapped memory, or null if the text is held in m_text
+    void *m_mapping;
+    size_t m_mappingSize;
+    /// Text of scripts that could not be mapped
+    std::string m_text;
+    const char *m_data;
+    size_t m_size;
+public:
+    SourceFile();
+    /// Create a source from text in memory
+    SourceFile(std::string text);
+    ~SourceFile();
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+    /// Open the file at the given path, replacing any previous text. Returns
+    /// false if it could not be read.
+    bool open(const std::string& path);
+    /// Get the text
+    const char *data() const;
+    /// Get the number of bytes of text
+    size_t size() const;
+};
+
+/// Where something is in a source file, worked out from its DebugInfo
+struct SourceLocation {
+    /// Name of the file, or empty if it is unknown
+    std::string filename;
+    /// Line and column, both counted from 1, or 0 if they are unknown
+    size_t line;
+    size_t column;
+    /// Text of the line, without the newline
+    std::string text;
+};
+
+/// The files of a program. DebugInfo refers to these by index, and lines are
+/// only counted when a location is looked up, which is rare since it is only
+/// done to report errors. The files must outlive the map.
+class SourceMap {
+    struct File {
+        std::string name;
+        const SourceFile *source;
+        /// Positions that each line starts at, or empty if not counted yet
+        std::vector<uint32_t> lines;
+    };
+    std::vector<File> m_files;
+public:
+    /// Add a file to the map and get its index. Throws an exception if the
+    /// file is too large for positions to fit in a DebugInfo.
+    uint32_t addFile(const std::string& name, const SourceFile& source);
+    /// Look up the location of the given debug info
+    SourceLocation locate(const DebugInfo& info);
+};
@@ -1,43 +1,60 @@
 #include "state.h"
 #include "compiler.h"
+#include "effects.h"
+#include "parallel.h"
 #include <stdexcept>
 #include <sstream>
+#include <set>
+#if defined(__linux__) && defined(__GLIBC__)
+#include <pthread.h>
+#define NANDLANG_STACK_BOUNDS
+#endif
 
 /// Put bit function
 void fn_putb(State& state)
 {
     bool b = state.pop();
-    std::cout << b;
+    state.getOutput().put(b ? '1' : '0');
 }
 
 /// Put endline function
 void fn_endl(State& state)
 {
-    std::cout << std::endl;
+    state.getOutput().put('\n');
 }
 
 /// Put 8-bit integer function
 void fn_puti8(State& state) {
     uint8_t value = state.popValue<uint8_t>();
-    std::cout << int(value);
+    char digits[3];
+    size_t size = 0;
+    if (value >= 100) {
+        digits[size++] = char('0' + value / 100);
+    }
+    if (value >= 10) {
+        digits[size++] = char('0' + value / 10 % 10);
+    }
+    digits[size++] = char('0' + value % 10);
+    state.getOutput().write(digits, size);
 }
 
 /// Put character function
 void fn_putc(State& state) {
     uint8_t value = state.popValue<uint8_t>();
-    std::cout << value;
+    state.getOutput().put(char(value));
 }
 
 /// Get character function
 void fn_getc(State& state) {
-    char c;
-    std::cin.get(c);
+    char c = 0;
+    state.flushForInput();
+    state.getInput().get(c);
     state.pushValue<char>(c);
 }
 
-/// Gets whether or not std::cin is able to be read
+/// Gets whether or not the input is able to be read
 void fn_iogood(State& state) {
-    state.push(bool(std::cin));
+    state.push(bool(state.getInput()));
 }
 
 /// Allocate memory
@@ -79,60 +96,60 @@ const std::map<std::string, FunctionExternal> stdlib = {
     {"putc",   {fn_putc,   8, 0, ConstantLevel::GLOBAL}},
     {"getc",   {fn_getc,   0, 8, ConstantLevel::GLOBAL}},
     {"iogood", {fn_iogood, 0, 1, ConstantLevel::GLOBAL}},
-    {"malloc", {fn_malloc,   pointerSize, pointerSize, ConstantLevel::LOCAL}},
-    {"free",   {fn_free,     pointerSize, 0, ConstantLevel::LOCAL}},
-    {"deref",  {fn_deref,    pointerSize, 1, ConstantLevel::LOCAL}},
-    {"assign", {fn_assign, 1+pointerSize, 0, ConstantLevel::LOCAL}}
+    {"malloc", {fn_malloc,   pointerSize, pointerSize, ConstantLevel::GLOBAL}},
+    {"free",   {fn_free,     pointerSize, 0, ConstantLevel::GLOBAL}},
+    {"deref",  {fn_deref,    pointerSize, 1, ConstantLevel::GLOBAL}},
+    {"assign", {fn_assign, 1+pointerSize, 0, ConstantLevel::GLOBAL}}
 };
 
 State::State()
-: m_varOffset(0)
+: State(std::make_shared<Program>())
 {
     // load functions
     for (const auto& p : stdlib) {
         // FunctionExternal is copy-able, since std::function is copyable and
         // Debuggable is copyable.
-        m_functions[p.first] = std::make_unique<FunctionExternal>(p.second);
+        m_program->getFunctions()[p.first] =
+            std::make_unique<FunctionExternal>(p.second);
     }
 }
 
-bool State::hasFunction(const std::string& name) const
+State::State(std::shared_ptr<Program> program)
+: m_program(std::move(program)), m_varOffset(0), m_input(&std::cin)
+, m_interactive(isInteractive(std::cin)), m_checked(false), m_frames(nullptr), m_jitTop(nullptr)
+, m_calls(0), m_jit{this, 0, nullptr, 0}
+{}
+
+State::~State()
 {
-    return m_functions.count(name) > 0;
+    if (m_frames) {
+        Jit::freeFrames(m_frames);
+    }
 }
 
-Function& State::getFunction(const std::string& name)
+std::shared_ptr<Program> State::getProgram() const
 {
-    if (m_functions.count(name)) {
-        return *m_functions.at(name);
-    } else {
-        std::stringstream s;
-        s << "No function of name \"" << name << "\"";
-        throw std::runtime_error(s.str());
-    }
+    return m_program;
 }
 
-const Function& State::getFunction(const std::string& name) const
+bool State::hasFunction(const std::string& name) const
 {
-    if (m_functions.count(name)) {
-        return *m_functions.at(name);
-    } else {
-        std::stringstream s;
-        s << "No function of name \"" << name << "\"";
-        throw std::runtime_error(s.str());
-    }
+    return m_program->hasFunction(name);
+}
+
+Function& State::getFunction(const std::string& name)
+{
+    return m_program->getFunction(name);
 }
 
-void State::push(bool value)
+const Function& State::getFunction(const std::string& name) const
 {
-    m_stack.push_back(value);
+    return m_program->getFunction(name);
 }
 
-bool State::pop()
+void State::setChecked(bool checked)
 {
-    bool ret = m_stack.back();
-    m_stack.pop_back();
-    return ret;
+    m_checked = checked;
 }
 
 size_t State::setVarOffset(size_t pos)
@@ -142,33 +159,76 @@ size_t State::setVarOffset(size_t pos)
     return ret;
 }
 
-void State::setVar(size_t pos, bool value)
+void State::parse(const TokenBlock& tokens)
 {
-    m_stack.at(m_varOffset + pos) = value;
+    Arena::Scope scope(m_program->addArena());
+    TokenTaker taker(tokens);
+    while (taker) {
+        std::string name;
+        FunctionPtr func;
+        std::tie(name, func) = parseFunction(taker);
+        m_program->getFunctions()[name] = std::move(func);
+    }
 }
 
-bool State::getVar(size_t pos) const
+void State::link()
 {
-    return m_stack.at(m_varOffset + pos);
+    for (auto& func : m_program->getFunctions()) {
+        func.second->link(*this);
+    }
 }
 
-void State::parse(TokenBlock&& tokens)
+size_t State::removeUnused(const std::vector<std::string>& roots)
 {
-    TokenTaker taker(std::move(tokens));
-    while (taker) {
-        std::string name;
-        FunctionPtr func;
-        std::tie(name, func) = parseFunction(taker);
-        m_functions[name] = std::move(func);
+    std::set<const Function*> reached;
+    std::vector<const Function*> pending;
+    for (const auto& name : roots) {
+        // missing roots are reported by checkMain, or when they are called
+        if (hasFunction(name)) {
+            pending.push_back(&getFunction(name));
+        }
+    }
+    while (!pending.empty()) {
+        const Function *function = pending.back();
+        pending.pop_back();
+        if (!reached.insert(function).second) {
+            continue;
+        }
+        std::set<const Function*> calls;
+        function->getCalls(*this, calls);
+        for (const Function *callee : calls) {
+            if (!reached.count(callee)) {
+                pending.push_back(callee);
+            }
+        }
+    }
+    size_t removed = 0;
+    auto& all = m_program->getFunctions();
+    for (auto iter = all.begin(); iter != all.end();) {
+        if (reached.count(iter->second.get())) {
+            ++iter;
+        } else {
+            iter = all.erase(iter);
+            ++removed;
+        }
     }
+    return removed;
 }
 
-void State::check() const
+void State::check(size_t threads) const
 {
-    for (const auto& func : m_functions) {
-        func.second->check(*this);
+    std::vector<const Function*> functions;
+    for (const auto& func : m_program->getFunctions()) {
+        functions.push_back(func.second.get());
     }
-    if (m_functions.count("main") == 0) {
+    runTasks(functions.size(), {}, threads, [&](size_t i, size_t) {
+        functions[i]->check(*this);
+    });
+}
+
+void State::checkMain() const
+{
+    if (!hasFunction("main")) {
         throwErrorNoInfo("No main function has been declared");
     }
     const Function& mainfunc = getFunction("main");
@@ -180,18 +240,358 @@ void State::check() const
     }
 }
 
-void State::optimize()
+size_t State::optimize(const InlineOptions& options, size_t threads)
+{
+    // Effects are all worked out first, so that they are only read while
+    // optimizing
+    std::map<const Function*, Function*> functions;
+    std::vector<const Function*> roots;
+    for (auto& func : m_program->getFunctions()) {
+        func.second->getConstantLevel(*this);
+        functions[func.second.get()] = func.second.get();
+        roots.push_back(func.second.get());
+    }
+    // Each component of the call graph is a task, which waits on the
+    // components that it calls
+    auto components = getCallComponents(*this, roots);
+    std::map<const Function*, size_t> componentOf;
+    for (size_t i = 0; i < components.size(); ++i) {
+        for (const Function *member : components[i]) {
+            componentOf[member] = i;
+        }
+    }
+    std::vector<std::vector<size_t>> dependencies(components.size());
+    for (size_t i = 0; i < components.size(); ++i) {
+        std::set<size_t> callees;
+        for (const Function *member : components[i]) {
+            std::set<const Function*> calls;
+            member->getCalls(*this, calls);
+            for (const Function *callee : calls) {
+                if (componentOf.at(callee) != i) {
+                    callees.insert(componentOf.at(callee));
+                }
+            }
+        }
+        dependencies[i].assign(callees.begin(), callees.end());
+    }
+    // Constant folding runs code, so each thread folds on a stack of its own
+    // and allocates the statements that it makes from an arena of its own
+    std::vector<std::unique_ptr<State>> scratch(getThreadCount(threads));
+    std::vector<Arena*> arenas;
+    for (size_t i = 0; i < scratch.size(); ++i) {
+        arenas.push_back(&m_program->addArena());
+    }
+    runTasks(components.size(), dependencies, threads,
+        [&](size_t i, size_t thread) {
+        Arena::Scope scope(*arenas[thread]);
+        if (!scratch[thread]) {
+            scratch[thread] = std::make_unique<State>();
+            scratch[thread]->setChecked(m_checked);
+        }
+        for (const Function *member : components[i]) {
+            functions.at(member)->optimize(*scratch[thread]);
+        }
+    });
+    size_t inlined;
+    {
+        Arena::Scope scope(m_program->addArena());
+        Inliner inliner(*this, options);
+        for (auto& func : m_program->getFunctions()) {
+            inliner.visit(*func.second);
+        }
+        inlined = inliner.getInlined();
+    }
+    // Folding and inlining leave statements spread over several arenas, so
+    // every function is copied into one, in the order that it runs
+    Arena& layout = m_program->addArena();
+    {
+        Arena::Scope scope(layout);
+        for (auto& func : m_program->getFunctions()) {
+            func.second->layout();
+        }
+    }
+    m_program->releaseArenas(layout);
+    return inlined;
+}
+
+void State::compile()
+{
+    for (auto& func : m_program->getFunctions()) {
+        func.second->compile(*this);
+    }
+}
+
+std::vector<CircuitStats> State::flatten(const CircuitOptions& options)
+{
+    std::vector<CircuitStats> stats;
+    if (options.maxGates == 0) {
+        return stats;
+    }
+    // Every circuit is built before any bytecode is replaced, so that the
+    // counts from before are of the original functions.
+    std::vector<std::pair<Function*, std::unique_ptr<Bytecode>>> circuits;
+    for (auto& func : m_program->getFunctions()) {
+        size_t before, after;
+        auto bytecode = func.second->flatten(*this, options, before, after);
+        if (bytecode) {
+            circuits.emplace_back(func.second.get(), std::move(bytecode));
+            stats.push_back({func.first, before, after});
+        }
+    }
+    for (auto& circuit : circuits) {
+        circuit.first->setBytecode(std::move(circuit.second));
+    }
+    return stats;
+}
+
+std::vector<IdiomStats> State::replaceIdioms()
+{
+    std::vector<IdiomStats> stats;
+    // Nothing is replaced until every function is checked, so that each
+    // circuit is built from the same bytecode whatever the order.
+    std::vector<std::pair<Function*, std::unique_ptr<Bytecode>>> idioms;
+    for (auto& func : m_program->getFunctions()) {
+        IntOp op;
+        size_t width;
+        auto bytecode = func.second->replaceIdiom(*this, op, width);
+        if (bytecode) {
+            idioms.emplace_back(func.second.get(), std::move(bytecode));
+            stats.push_back({func.first, op, width});
+        }
+    }
+    for (auto& idiom : idioms) {
+        idiom.first->setBytecode(std::move(idiom.second));
+    }
+    return stats;
+}
+
+std::vector<TableStats> State::tabulate(const TableOptions& options)
+{
+    struct Job {
+        const std::string *name;
+        Function *function;
+        TruthTable table;
+        bool built;
+    };
+    std::vector<Job> jobs;
+    std::vector<TableStats> stats;
+    if (options.maxBytes == 0) {
+        return stats;
+    }
+    for (auto& func : m_program->getFunctions()) {
+        const Function& function = *func.second;
+        const Bytecode *bytecode = function.getBytecode();
+        size_t inputs = function.getInputNum();
+        size_t outputs = function.getOutputNum();
+        if (!bytecode || bytecode->size() <= options.minSize
+         || inputs == 0 || inputs > options.maxInputs
+         || outputs == 0 || outputs > 64
+         || ((size_t(1) << inputs) * outputs + 7) / 8 > options.maxBytes
+         || function.getConstantLevel(*this) < ConstantLevel::LOCAL) {
+            continue;
+        }
+        jobs.push_back({&func.first, func.second.get(), TruthTable(), false});
+    }
+    runTasks(jobs.size(), {}, options.threads, [&](size_t i, size_t) {
+        jobs[i].built = buildTable(*jobs[i].function, options,
+            jobs[i].table);
+    });
+    // Tables are only put in once they are all built, since they are built
+    // from the bytecode of the functions that they call.
+    for (auto& job : jobs) {
+        if (job.built) {
+            stats.push_back({*job.name, (job.table.entries.size() + 7) / 8});
+            job.function->setBytecode(std::make_unique<Bytecode>(
+                lowerTable(*this, std::move(job.table))));
+        }
+    }
+    return stats;
+}
+
+size_t State::jit()
+{
+    auto jit = std::make_unique<Jit>();
+    for (auto& func : m_program->getFunctions()) {
+        func.second->jit(*jit);
+    }
+    size_t compiled = jit->finish();
+    m_program->setJit(std::move(jit));
+    return compiled;
+}
+
+size_t State::memoize(size_t capacity)
+{
+    size_t memoized = 0;
+    for (auto& func : m_program->getFunctions()) {
+        func.second->memoize(*this, capacity);
+        if (func.second->getMemo()) {
+            ++memoized;
+        }
+    }
+    return memoized;
+}
+
+void State::getMemoStats(size_t& hits, size_t& misses) const
+{
+    hits = 0;
+    misses = 0;
+    for (const auto& func : m_program->getFunctions()) {
+        const MemoCache *memo = func.second->getMemo();
+        if (memo) {
+            hits += memo->getHits();
+            misses += memo->getMisses();
+        }
+    }
+}
+
+void State::transpile(std::ostream& stream) const
+{
+    Transpiler transpiler;
+    for (const auto& func : m_program->getFunctions()) {
+        func.second->transpile(transpiler, func.first);
+    }
+    transpiler.write(stream);
+}
+
+void State::callNative(JitFunction function, size_t inputs, size_t outputs)
+{
+    if (!m_jitTop) {
+        m_frames = Jit::allocateFrames();
+        m_jitTop = m_frames;
+        m_jit.framesEnd = m_frames + Jit::framesSize;
+    }
+    // native frames use one byte per bit
+    uint8_t *frame = m_jitTop;
+    if (size_t(m_jit.framesEnd - frame) < inputs + outputs) {
+        throw StackOverflow();
+    }
+    size_t base = m_stack.size() - inputs;
+    for (size_t i = 0; i < inputs; ++i) {
+        frame[i] = m_stack.get(base + i);
+    }
+    m_stack.resize(base);
+    function(frame, &m_jit);
+    if (m_jit.stopped) {
+        m_jit.stopped = 0;
+        std::exception_ptr error = m_nativeError;
+        m_nativeError = nullptr;
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        throw StackOverflow();
+    }
+    for (size_t i = 0; i < outputs; ++i) {
+        m_stack.push(frame[i]);
+    }
+}
+
+uint8_t *State::setJitTop(uint8_t *top)
+{
+    uint8_t *ret = m_jitTop;
+    m_jitTop = top;
+    return ret;
+}
+
+void State::stopNative(std::exception_ptr error)
+{
+    m_nativeError = error;
+    m_jit.stopped = 1;
+}
+
+namespace {
+
+/// Stack that is left free below the deepest call, for the standard library
+/// and for the calls between two checks
+const uintptr_t stackReserve = 256 * 1024;
+
+/// Stack that calls may use when the bounds of the stack are unknown
+const uintptr_t stackFallback = 512 * 1024;
+
+/// Get the lowest address of this thread's stack, or 0 if it is unknown.
+/// Finding it may read /proc/self/maps, so it is only done once per thread.
+uintptr_t getStackBottom()
+{
+    static thread_local bool known = false;
+    static thread_local uintptr_t bottom = 0;
+    if (known) {
+        return bottom;
+    }
+    known = true;
+#ifdef NANDLANG_STACK_BOUNDS
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        void *address;
+        size_t size;
+        if (pthread_attr_getstack(&attr, &address, &size) == 0) {
+            bottom = uintptr_t(address);
+        }
+        pthread_attr_destroy(&attr);
+    }
+#endif
+    return bottom;
+}
+
+} // namespace
+
+uintptr_t getStackLimit()
 {
-    for (auto& func : m_functions) {
-        func.second->optimize(*this);
+    char position;
+    uintptr_t top = uintptr_t(&position);
+    uintptr_t usable = stackFallback;
+    uintptr_t bottom = getStackBottom();
+    if (bottom != 0 && bottom < top) {
+        usable = top - bottom;
+        usable = usable > stackReserve ? usable - stackReserve : 0;
     }
+    return top > usable ? top - usable : 0;
 }
 
-size_t State::size() const
+void State::startCalls()
 {
-    return m_stack.size();
+    m_jit.stackLimit = getStackLimit();
+}
+
+StackOverflow::StackOverflow()
+: std::runtime_error("Stack overflow: calls are nested too deeply") {}
+
+std::istream& State::getInput()
+{
+    return *m_input;
+}
+
+Output& State::getOutput()
+{
+    return m_output;
+}
+
+void State::setInput(std::istream& stream)
+{
+    m_input = &stream;
+    m_interactive = isInteractive(stream);
+}
+
+void State::setOutput(std::ostream& stream)
+{
+    m_output.setStream(stream);
+}
+
+void State::setFlushPolicy(FlushPolicy policy)
+{
+    m_output.setPolicy(policy);
+}
+
+void State::flushOutput()
+{
+    m_output.flush();
+}
+
+void State::flushForInput()
+{
+    if (m_interactive) {
+        m_output.flush();
+    }
 }
 
 void State::resize(size_t size) {
-    m_stack.resize(size, 0);
+    m_stack.resize(size);
 }
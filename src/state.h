@@ -2,20 +2,63 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <exception>
+#include "bitstack.h"
 #include "function.h"
 #include "symbol.h"
+#include "inliner.h"
+#include "table.h"
+#include "program.h"
+#include "output.h"
 
 /// Represents the execution state
 /// Always push in forward order, and always pop in reverse order.
+/// The functions belong to a program, which may be shared with other states.
+/// Everything else is private to this state, so states that share a program
+/// can run it on separate threads.
 class State {
     /// Value stack
-    std::vector<bool> m_stack;
-    /// Maps names to functions
-    std::map<std::string, FunctionPtr> m_functions;
+    BitStack m_stack;
+    /// Functions being run
+    std::shared_ptr<Program> m_program;
     /// Offset pointer for variables
     size_t m_varOffset;
+    /// Iteration counters for for loops run by the bytecode interpreter
+    std::vector<size_t> m_counters;
+    /// Stream that standard library functions read from
+    std::istream *m_input;
+    /// Whether reading from m_input may wait on a person typing
+    bool m_interactive;
+    /// Output of standard library functions
+    Output m_output;
+    /// Check every variable access and the stack after every statement
+    bool m_checked;
+    /// Memory for native frames, allocated when native code is first called
+    uint8_t *m_frames;
+    /// Start of free memory for native frames
+    uint8_t *m_jitTop;
+    /// Number of calls being run
+    size_t m_calls;
+    /// Limits of native code. Its stack limit is the limit of every call.
+    JitContext m_jit;
+    /// Exception that stopped native code, see stopNative
+    std::exception_ptr m_nativeError;
+    /// Find the stack limit, when the outermost call starts
+    void startCalls();
 public:
+    /// Create a state with a new program, which holds the standard library
     State();
+    /// Create a state that runs the given program, with a stack and streams
+    /// of its own
+    State(std::shared_ptr<Program> program);
+    ~State();
+    State(const State&) = delete;
+    State& operator=(const State&) = delete;
+    /// Get the program that this state runs
+    std::shared_ptr<Program> getProgram() const;
     /// Get a function from name
     bool hasFunction(const std::string& name) const;
     /// Get a function from name
@@ -28,24 +71,118 @@ public:
     bool pop();
     /// Set the variable offset. Returns the previous variable offset.
     size_t setVarOffset(size_t);
+    /// Get the variable offset
+    size_t getVarOffset() const;
     /// Set a variable
     void setVar(size_t, bool);
     /// Get a variable
     bool getVar(size_t) const;
+    /// Push the values of num variables, starting at pos
+    void pushVars(size_t pos, size_t num);
+    /// Pop num values into the variables starting at pos. Values keep the
+    /// order that they were pushed in.
+    void popVars(size_t pos, size_t num);
+    /// Pop one value into each of the variables at the given positions, the
+    /// last position first. Ignored positions drop their value.
+    void popVarsInto(const std::vector<size_t>& positions);
+    /// Copy num variables from src to dst
+    void copyVars(size_t dst, size_t src, size_t num);
+    /// Push num bits from the given bits, starting at pos
+    void pushBits(const BitStack& bits, size_t pos, size_t num);
+    /// Read up to 64 bits of the stack, starting at the absolute position pos.
+    /// The first bit is the lowest bit of the returned value.
+    uint64_t getBits(size_t pos, size_t num) const;
+    /// Read num variables, starting at pos, as an integer of up to 64 bits.
+    /// The first variable is the most significant bit.
+    uint64_t getVarInt(size_t pos, size_t num) const;
+    /// Push the lowest num bits of value, most significant bit first
+    void pushInt(uint64_t value, size_t num);
     /// Parse a file to create functions
-    void parse(TokenBlock&& tokens);
+    void parse(const TokenBlock& tokens);
+    /// Resolve every function call in every function
+    void link();
+    /// Remove the functions that can never be called from the given
+    /// functions. Every function must have been linked and checked, so that
+    /// errors in the functions that are removed are still reported. Returns
+    /// the number of functions that were removed.
+    size_t removeUnused(const std::vector<std::string>& roots);
     /// check this state for consistency and integrity
     /// will throw an exception if one of the following rules are broken:
     /// * inputs and outputs are mismatched in number
     /// * a variable is defined more than once
     /// * attempt to use an undefined variable
     /// * attempt to call an undefined function
-    void check() const;
+    /// Functions are checked in parallel on up to the given number of
+    /// threads, 0 using one per processor.
+    void check(size_t threads = 0) const;
+    /// check that there is a main function that can be run, i.e. that it has
+    /// no inputs or outputs. Will throw an exception if there is not.
+    void checkMain() const;
     /// Attempt to optimize functions within this state
     /// The goal of optimizing is generally to reduce the total number of
     /// operations performed, meaning fewer function calls, fewer
     /// expression/statement resolutions, and fewer stack operations.
-    void optimize();
+    /// Functions are optimized in parallel on up to the given number of
+    /// threads, 0 using one per processor. A function is only optimized once
+    /// the functions that it calls are, since constant folding runs them.
+    /// Small functions are then inlined into their callers, within the given
+    /// limits. Returns the number of calls that were inlined.
+    size_t optimize(const InlineOptions& options = InlineOptions(),
+        size_t threads = 0);
+    /// Lower every function into bytecode. Functions will be run by the
+    /// bytecode interpreter from then on.
+    void compile();
+    /// Replace the bytecode of every function that is a combinational
+    /// circuit with a minimal sequence of NAND gates. Returns the gate counts
+    /// of every function that was flattened.
+    std::vector<CircuitStats> flatten(const CircuitOptions& options);
+    /// Replace the bytecode of every function that computes an integer
+    /// operation, such as an adder or a comparator, with a single
+    /// instruction. Returns the functions that were replaced.
+    std::vector<IdiomStats> replaceIdioms();
+    /// Replace the bytecode of every function that has no global effects and
+    /// few enough inputs with a lookup into its truth table. Tables are built
+    /// in parallel. Returns the size of every table.
+    std::vector<TableStats> tabulate(const TableOptions& options);
+    /// Compile every function that has been lowered into bytecode into
+    /// native code. Returns the number of functions that were compiled.
+    /// Must only be called when Jit::isSupported() is true.
+    size_t jit();
+    /// Cache the results of every function that has no global effects,
+    /// keeping up to capacity results per function. Returns the number of
+    /// functions that are memoized.
+    size_t memoize(size_t capacity);
+    /// Get the total number of memoized calls that were answered from a cache,
+    /// and the number that had to be run.
+    void getMemoStats(size_t& hits, size_t& misses) const;
+    /// Write every function as a self-contained C program. Functions must
+    /// have been lowered into bytecode first.
+    void transpile(std::ostream& stream) const;
+    /// Call native code. The inputs are popped from the stack, and the
+    /// outputs are pushed.
+    void callNative(JitFunction function, size_t inputs, size_t outputs);
+    /// Set the start of free memory for native frames. Returns the previous
+    /// value.
+    uint8_t *setJitTop(uint8_t *top);
+    /// Stop native code because of an exception, which is thrown again once
+    /// native code has returned
+    void stopNative(std::exception_ptr error);
+    /// Called when a function starts to run. Throws an exception instead if
+    /// the native stack is nearly full, so that deep recursion is an error
+    /// rather than a crash. Every call that started must be ended, even if it
+    /// throws.
+    void startCall();
+    /// Called when a function has finished running
+    void endCall();
+    /// Turn checked mode on or off. In checked mode, every variable access is
+    /// bounds checked, and the stack is checked after every statement and
+    /// call. Builds without NDEBUG are always checked.
+    void setChecked(bool checked);
+    /// Returns true if checked mode is on
+    bool isChecked() const;
+    /// Throw an exception if variables up to end are not below size, when
+    /// checked mode is on
+    void checkVars(size_t end, size_t size) const;
     /// Get number of values on stack
     size_t size() const;
     /// Resize the stack
@@ -56,8 +193,199 @@ public:
     /// Put an integer value
     template <class T>
     void pushValue(T value);
+    /// Get the input stream
+    std::istream& getInput();
+    /// Get the buffered output
+    Output& getOutput();
+    /// Set the stream that input is read from. Defaults to std::cin.
+    void setInput(std::istream& stream);
+    /// Set the stream that output is written to. Defaults to std::cout.
+    /// Output that is still buffered goes to the previous stream.
+    void setOutput(std::ostream& stream);
+    /// Set when buffered output is written out
+    void setFlushPolicy(FlushPolicy policy);
+    /// Write out all buffered output. Output is written out when the state
+    /// is destroyed as well.
+    void flushOutput();
+    /// Write out buffered output before input is read, if a person may be
+    /// waiting on it to know what to type
+    void flushForInput();
+    /// Start a new loop counter at 0
+    void pushCounter();
+    /// Get the innermost loop counter
+    size_t& getCounter();
+    /// Remove the innermost loop counter
+    void popCounter();
 };
 
+/// Starts a call, and ends it when it goes out of scope
+class CallScope {
+    State& m_state;
+public:
+    CallScope(State& state) : m_state(state)
+    {
+        m_state.startCall();
+    }
+    ~CallScope()
+    {
+        m_state.endCall();
+    }
+    CallScope(const CallScope&) = delete;
+    CallScope& operator=(const CallScope&) = delete;
+};
+
+/// Thrown when calls are nested too deeply for the native stack
+class StackOverflow : public std::runtime_error {
+public:
+    StackOverflow();
+};
+
+/// Get the lowest address of the native stack that calls made from here on
+/// this thread may reach. Below it, enough is left for the standard library
+/// and for the work between two checks. Calls check the address of a local
+/// variable against it, and throw StackOverflow once they pass it.
+uintptr_t getStackLimit();
+
+inline void State::startCall()
+{
+    // the stack grows down on every supported platform
+    char position;
+    if (m_calls == 0) {
+        startCalls();
+    } else if (uintptr_t(&position) < m_jit.stackLimit) {
+        throw StackOverflow();
+    }
+    ++m_calls;
+}
+
+inline void State::endCall()
+{
+    --m_calls;
+}
+
+// These are called for almost every operation, so they are defined here so
+// that they can be inlined.
+
+inline void State::push(bool value)
+{
+    m_stack.push(value);
+}
+
+inline bool State::pop()
+{
+    return m_stack.pop();
+}
+
+/// Make sure that the given range of variables is on the stack
+inline void checkVarRange(size_t end, size_t size)
+{
+    if (end > size) {
+        throw std::out_of_range("Variable is out of the stack's range");
+    }
+}
+
+inline bool State::isChecked() const
+{
+#ifdef NDEBUG
+    return m_checked;
+#else
+    return true;
+#endif
+}
+
+inline void State::checkVars(size_t end, size_t size) const
+{
+    if (isChecked()) {
+        checkVarRange(end, size);
+    }
+}
+
+inline void State::setVar(size_t pos, bool value)
+{
+    checkVars(m_varOffset + pos + 1, m_stack.size());
+    m_stack.set(m_varOffset + pos, value);
+}
+
+inline bool State::getVar(size_t pos) const
+{
+    checkVars(m_varOffset + pos + 1, m_stack.size());
+    return m_stack.get(m_varOffset + pos);
+}
+
+inline void State::pushVars(size_t pos, size_t num)
+{
+    checkVars(m_varOffset + pos + num, m_stack.size());
+    m_stack.pushRange(m_varOffset + pos, num);
+}
+
+inline void State::popVars(size_t pos, size_t num)
+{
+    checkVars(m_varOffset + pos + num, m_stack.size() - num);
+    m_stack.popRange(m_varOffset + pos, num);
+}
+
+inline void State::popVarsInto(const std::vector<size_t>& positions)
+{
+    for (auto iter = positions.rbegin(); iter != positions.rend(); ++iter) {
+        bool value = pop();
+        if (*iter != ignorePosition) {
+            setVar(*iter, value);
+        }
+    }
+}
+
+inline void State::copyVars(size_t dst, size_t src, size_t num)
+{
+    checkVars(m_varOffset + std::max(dst, src) + num, m_stack.size());
+    m_stack.copy(m_varOffset + dst, m_varOffset + src, num);
+}
+
+inline void State::pushBits(const BitStack& bits, size_t pos, size_t num)
+{
+    m_stack.pushRange(bits, pos, num);
+}
+
+inline uint64_t State::getBits(size_t pos, size_t num) const
+{
+    return m_stack.getBits(pos, num);
+}
+
+inline uint64_t State::getVarInt(size_t pos, size_t num) const
+{
+    checkVars(m_varOffset + pos + num, m_stack.size());
+    return reverseBits(m_stack.getBits(m_varOffset + pos, num), num);
+}
+
+inline void State::pushInt(uint64_t value, size_t num)
+{
+    m_stack.pushBits(reverseBits(value, num), num);
+}
+
+inline size_t State::getVarOffset() const
+{
+    return m_varOffset;
+}
+
+inline size_t State::size() const
+{
+    return m_stack.size();
+}
+
+inline void State::pushCounter()
+{
+    m_counters.push_back(0);
+}
+
+inline size_t& State::getCounter()
+{
+    return m_counters.back();
+}
+
+inline void State::popCounter()
+{
+    m_counters.pop_back();
+}
+
 template <class T>
 T State::popValue()
 {
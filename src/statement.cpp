@@ -1,5 +1,7 @@
 #include "statement.h"
 #include "state.h"
+#include "bytecode.h"
+#include "inliner.h"
 #include <stdexcept>
 #include <sstream>
 #include <algorithm>
@@ -12,6 +14,34 @@ void checkStatements(const State& state,
     }
 }
 
+void resolveStatements(State& state,
+    const std::vector<StatementPtr>& statements)
+{
+    if (!state.isChecked()) {
+        for (const auto& stmt : statements) {
+            stmt->resolve(state);
+        }
+        return;
+    }
+    size_t size = state.size();
+    for (const auto& stmt : statements) {
+        stmt->resolve(state);
+        if (state.size() != size) {
+            std::stringstream s;
+            s << "Statement changed the stack size from " << size << " to "
+              << state.size();
+            stmt->throwError(s.str());
+        }
+    }
+}
+
+void linkStatements(State& state, std::vector<StatementPtr>& statements)
+{
+    for (auto& stmt : statements) {
+        stmt->link(state);
+    }
+}
+
 void optimizeStatements(State& state,
     std::vector<StatementPtr>& statements)
 {
@@ -25,6 +55,56 @@ void optimizeStatements(State& state,
     }
 }
 
+void compileStatement(BytecodeBuilder& builder, const Statement& statement)
+{
+    // a statement leaves the stack as it found it, apart from its variables
+    size_t depth = builder.getDepth() + statement.getDeclared();
+    statement.compile(builder);
+    builder.endStatement(depth, statement.getDebugInfo());
+}
+
+void compileStatements(BytecodeBuilder& builder,
+    const std::vector<StatementPtr>& statements)
+{
+    size_t depth = builder.getDepth();
+    for (const auto& stmt : statements) {
+        compileStatement(builder, *stmt);
+    }
+    builder.emitTruncate(depth);
+}
+
+void inlineStatements(Inliner& inliner,
+    std::vector<StatementPtr>& statements, size_t depth)
+{
+    for (auto& stmt : statements) {
+        depth = stmt->inlineCalls(inliner, depth);
+    }
+}
+
+std::vector<StatementPtr> cloneStatements(
+    const std::vector<StatementPtr>& statements, size_t offset)
+{
+    std::vector<StatementPtr> ret;
+    ret.reserve(statements.size());
+    for (const auto& stmt : statements) {
+        ret.push_back(stmt->clone(offset));
+    }
+    return ret;
+}
+
+/// Move the given variable positions up by offset. Ignored positions stay
+/// ignored.
+std::vector<size_t> offsetPositions(const std::vector<size_t>& positions,
+    size_t offset)
+{
+    std::vector<size_t> ret;
+    ret.reserve(positions.size());
+    for (size_t pos : positions) {
+        ret.push_back(pos == ignorePosition ? pos : pos + offset);
+    }
+    return ret;
+}
+
 ConstantLevel getStatementsConstantLevel(const State& state,
     const std::vector<StatementPtr>& statements)
 {
@@ -38,8 +118,22 @@ ConstantLevel getStatementsConstantLevel(const State& state,
     return ret;
 }
 
+void getStatementsCalls(const State& state,
+    const std::vector<StatementPtr>& statements,
+    std::set<const Function*>& calls)
+{
+    for (const auto& stmt : statements) {
+        stmt->getCalls(state, calls);
+    }
+}
+
 Statement::Statement(const DebugInfo& info) : Debuggable(info) {}
 
+size_t Statement::getDeclared() const
+{
+    return 0;
+}
+
 StatementAssign::StatementAssign(const DebugInfo& info,
     std::vector<size_t>&& vars,
     std::vector<ExpressionPtr>&& expressions)
@@ -49,15 +143,16 @@ StatementAssign::StatementAssign(const DebugInfo& info,
 
 void StatementAssign::resolve(State& state) const
 {
+    if (m_expressions.size() == 1) {
+        // nothing else is read after this expression, so its outputs can go
+        // straight into the variables
+        m_expressions[0]->resolveInto(state, m_variables);
+        return;
+    }
     for (const auto& expr : m_expressions) {
         expr->resolve(state);
     }
-    for (auto iter = m_variables.rbegin(); iter != m_variables.rend(); ++iter) {
-        bool value = state.pop();
-        if (*iter != ignorePosition) {
-            state.setVar(*iter, value);
-        }
-    }
+    state.popVarsInto(m_variables);
 }
 
 void StatementAssign::check(const State& state) const
@@ -83,11 +178,43 @@ ConstantLevel StatementAssign::getConstantLevel(const State& state) const
     return std::min(ret, getExpressionsConstantLevel(state, m_expressions));
 }
 
+void StatementAssign::getCalls(const State& state,
+    std::set<const Function*>& calls) const
+{
+    getExpressionsCalls(state, m_expressions, calls);
+}
+
+void StatementAssign::link(State& state)
+{
+    linkExpressions(state, m_expressions);
+}
+
 void StatementAssign::optimize(State& state)
 {
     optimizeExpressions(state, m_expressions);
 }
 
+void StatementAssign::compile(BytecodeBuilder& builder) const
+{
+    for (const auto& expr : m_expressions) {
+        expr->compile(builder);
+    }
+    builder.emitStores(m_variables);
+}
+
+size_t StatementAssign::inlineCalls(Inliner& inliner, size_t depth)
+{
+    inlineExpressions(inliner, m_expressions, depth);
+    return depth;
+}
+
+StatementPtr StatementAssign::clone(size_t offset) const
+{
+    return makeNode<StatementAssign>(getDebugInfo(),
+        offsetPositions(m_variables, offset),
+        cloneExpressions(m_expressions, offset));
+}
+
 StatementVariable::StatementVariable(const DebugInfo& info,
     std::vector<size_t>&& vars,
     std::vector<ExpressionPtr>&& expressions)
@@ -97,20 +224,15 @@ StatementVariable::StatementVariable(const DebugInfo& info,
 
 void StatementVariable::resolve(State& state) const
 {
-    for (auto iter = m_variables.rbegin(); iter != m_variables.rend(); ++iter) {
-        if (*iter != ignorePosition) {
-            state.push(0);
-        }
+    // the variables already have slots in the function's frame
+    if (m_expressions.size() == 1) {
+        m_expressions[0]->resolveInto(state, m_variables);
+        return;
     }
     for (const auto& expr : m_expressions) {
         expr->resolve(state);
     }
-    for (auto iter = m_variables.rbegin(); iter != m_variables.rend(); ++iter) {
-        bool value = state.pop();
-        if (*iter != ignorePosition) {
-            state.setVar(*iter, value);
-        }
-    }
+    state.popVarsInto(m_variables);
 }
 
 void StatementVariable::check(const State& state) const
@@ -136,11 +258,64 @@ ConstantLevel StatementVariable::getConstantLevel(const State& state) const
     return std::min(ret, getExpressionsConstantLevel(state, m_expressions));
 }
 
+void StatementVariable::getCalls(const State& state,
+    std::set<const Function*>& calls) const
+{
+    getExpressionsCalls(state, m_expressions, calls);
+}
+
+void StatementVariable::link(State& state)
+{
+    linkExpressions(state, m_expressions);
+}
+
 void StatementVariable::optimize(State& state)
 {
     optimizeExpressions(state, m_expressions);
 }
 
+void StatementVariable::compile(BytecodeBuilder& builder) const
+{
+    size_t count = getDeclared();
+    if (count > 0) {
+        builder.emit(Opcode::ALLOC, count);
+    }
+    for (const auto& expr : m_expressions) {
+        expr->compile(builder);
+    }
+    builder.emitStores(m_variables);
+}
+
+size_t StatementVariable::getDeclared() const
+{
+    size_t count = 0;
+    for (size_t pos : m_variables) {
+        if (pos != ignorePosition) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+size_t StatementVariable::inlineCalls(Inliner& inliner, size_t depth)
+{
+    // the variables are pushed before the expressions are resolved
+    for (size_t pos : m_variables) {
+        if (pos != ignorePosition) {
+            ++depth;
+        }
+    }
+    inlineExpressions(inliner, m_expressions, depth);
+    return depth;
+}
+
+StatementPtr StatementVariable::clone(size_t offset) const
+{
+    return makeNode<StatementVariable>(getDebugInfo(),
+        offsetPositions(m_variables, offset),
+        cloneExpressions(m_expressions, offset));
+}
+
 StatementIf::StatementIf(const DebugInfo& info, ExpressionPtr cond,
     std::vector<StatementPtr>&& block,
     std::vector<StatementPtr>&& elseblock)
@@ -151,21 +326,15 @@ StatementIf::StatementIf(const DebugInfo& info, ExpressionPtr cond,
 
 void StatementIf::resolve(State& state) const
 {
-    size_t prev = state.size();
     // check condition
     m_condition->resolve(state);
     if (state.pop()) {
         // call statements
-        for (const auto& stmt : m_block) {
-            stmt->resolve(state);
-        }
+        resolveStatements(state, m_block);
     } else {
         // call else statements
-        for (const auto& stmt : m_else) {
-            stmt->resolve(state);
-        }
+        resolveStatements(state, m_else);
     }
-    state.resize(prev);
 }
 
 void StatementIf::check(const State& state) const
@@ -188,11 +357,26 @@ ConstantLevel StatementIf::getConstantLevel(const State& state) const
         m_condition->getConstantLevel(state)});
 }
 
+void StatementIf::getCalls(const State& state,
+    std::set<const Function*>& calls) const
+{
+    m_condition->getCalls(state, calls);
+    getStatementsCalls(state, m_block, calls);
+    getStatementsCalls(state, m_else, calls);
+}
+
+void StatementIf::link(State& state)
+{
+    m_condition->link(state);
+    linkStatements(state, m_block);
+    linkStatements(state, m_else);
+}
+
 void StatementIf::optimize(State& state)
 {
     if (m_condition->getConstantLevel(state) == ConstantLevel::CONSTANT) {
         m_condition->resolve(state);
-        m_condition = std::move(std::make_unique<ExpressionLiteral>(
+        m_condition = std::move(makeNode<ExpressionLiteral>(
             m_condition->getDebugInfo(), state.pop()));
     } else {
         m_condition->optimize(state);
@@ -201,6 +385,38 @@ void StatementIf::optimize(State& state)
     optimizeStatements(state, m_else);
 }
 
+void StatementIf::compile(BytecodeBuilder& builder) const
+{
+    size_t depth = builder.getDepth();
+    m_condition->compile(builder);
+    size_t jump_else = builder.emit(Opcode::JUMP_IF_ZERO);
+    compileStatements(builder, m_block);
+    if (m_else.empty()) {
+        builder.patch(jump_else, builder.here());
+    } else {
+        size_t jump_end = builder.emit(Opcode::JUMP);
+        builder.patch(jump_else, builder.here());
+        builder.setDepth(depth);
+        compileStatements(builder, m_else);
+        builder.patch(jump_end, builder.here());
+    }
+}
+
+size_t StatementIf::inlineCalls(Inliner& inliner, size_t depth)
+{
+    inlineExpression(inliner, m_condition, depth);
+    inlineStatements(inliner, m_block, depth);
+    inlineStatements(inliner, m_else, depth);
+    return depth;
+}
+
+StatementPtr StatementIf::clone(size_t offset) const
+{
+    return makeNode<StatementIf>(getDebugInfo(),
+        m_condition->clone(offset), cloneStatements(m_block, offset),
+        cloneStatements(m_else, offset));
+}
+
 StatementWhile::StatementWhile(const DebugInfo& info, ExpressionPtr cond,
     std::vector<StatementPtr>&& block)
 : Statement(info)
@@ -210,18 +426,14 @@ StatementWhile::StatementWhile(const DebugInfo& info, ExpressionPtr cond,
 void StatementWhile::resolve(State& state) const
 {
     // same as for if, but in a loop
-    size_t prev = state.size();
     for (;;) {
         m_condition->resolve(state);
         if (!state.pop()) {
             // only difference is how the exit condition is handled
             return;
         }
-        for (const auto& stmt : m_block) {
-            stmt->resolve(state);
-        }
+        resolveStatements(state, m_block);
     }
-    state.resize(prev);
 }
 
 void StatementWhile::check(const State& state) const
@@ -242,11 +454,24 @@ ConstantLevel StatementWhile::getConstantLevel(const State& state) const
         m_condition->getConstantLevel(state));
 }
 
+void StatementWhile::getCalls(const State& state,
+    std::set<const Function*>& calls) const
+{
+    m_condition->getCalls(state, calls);
+    getStatementsCalls(state, m_block, calls);
+}
+
+void StatementWhile::link(State& state)
+{
+    m_condition->link(state);
+    linkStatements(state, m_block);
+}
+
 void StatementWhile::optimize(State& state)
 {
     if (m_condition->getConstantLevel(state) == ConstantLevel::CONSTANT) {
         m_condition->resolve(state);
-        m_condition = std::move(std::make_unique<ExpressionLiteral>(
+        m_condition = std::move(makeNode<ExpressionLiteral>(
             m_condition->getDebugInfo(), state.pop()));
     } else {
         m_condition->optimize(state);
@@ -254,6 +479,31 @@ void StatementWhile::optimize(State& state)
     optimizeStatements(state, m_block);
 }
 
+void StatementWhile::compile(BytecodeBuilder& builder) const
+{
+    size_t start = builder.here();
+    m_condition->compile(builder);
+    size_t jump_end = builder.emit(Opcode::JUMP_IF_ZERO);
+    // Variables declared in the block are removed after every iteration, so
+    // that the stack does not grow with each iteration.
+    compileStatements(builder, m_block);
+    builder.emit(Opcode::JUMP, start);
+    builder.patch(jump_end, builder.here());
+}
+
+size_t StatementWhile::inlineCalls(Inliner& inliner, size_t depth)
+{
+    inlineExpression(inliner, m_condition, depth);
+    inlineStatements(inliner, m_block, depth);
+    return depth;
+}
+
+StatementPtr StatementWhile::clone(size_t offset) const
+{
+    return makeNode<StatementWhile>(getDebugInfo(),
+        m_condition->clone(offset), cloneStatements(m_block, offset));
+}
+
 StatementExpression::StatementExpression(
     ExpressionPtr&& expr)
 : Statement(expr->getDebugInfo())
@@ -279,11 +529,38 @@ ConstantLevel StatementExpression::getConstantLevel(const State& state) const
     return m_expression->getConstantLevel(state);
 }
 
+void StatementExpression::getCalls(const State& state,
+    std::set<const Function*>& calls) const
+{
+    m_expression->getCalls(state, calls);
+}
+
+void StatementExpression::link(State& state)
+{
+    m_expression->link(state);
+}
+
 void StatementExpression::optimize(State& state)
 {
     m_expression->optimize(state);
 }
 
+void StatementExpression::compile(BytecodeBuilder& builder) const
+{
+    m_expression->compile(builder);
+}
+
+size_t StatementExpression::inlineCalls(Inliner& inliner, size_t depth)
+{
+    inlineExpression(inliner, m_expression, depth);
+    return depth;
+}
+
+StatementPtr StatementExpression::clone(size_t offset) const
+{
+    return makeNode<StatementExpression>(m_expression->clone(offset));
+}
+
 StatementFor::StatementFor(const DebugInfo& debug, size_t iterations,
     std::vector<ForData>&& fordata, std::vector<StatementPtr> block)
 : Statement(debug), m_iterations(iterations), m_fordata(std::move(fordata))
@@ -297,25 +574,15 @@ StatementFor::StatementFor(const DebugInfo& debug, size_t iterations,
 void StatementFor::resolve(State& state) const
 {
     for (size_t i = 0; i < m_iterations; i ++) {
-        // push values
+        // copy values into the loop variables
         for (const auto& data : m_fordata) {
-            for (size_t j = 0; j < data.size; j ++) {
-                size_t pos = data.begin + data.step*i + j;
-                state.push(state.getVar(pos));
-            }
+            state.copyVars(data.slot, data.begin + data.step*i, data.size);
         }
         // execute statements
-        for (const auto& stmt : m_block) {
-            stmt->resolve(state);
-        }
+        resolveStatements(state, m_block);
         // put values back (reverse order)
         for (auto data = m_fordata.rbegin(); data != m_fordata.rend(); ++data) {
-            size_t j = data->size;
-            while (j > 0) {
-                j --;
-                size_t pos = data->begin + data->step*i + j;
-                state.setVar(pos, state.pop());
-            }
+            state.copyVars(data->begin + data->step*i, data->slot, data->size);
         }
     }
 }
@@ -330,7 +597,58 @@ ConstantLevel StatementFor::getConstantLevel(const State& state) const
     return getStatementsConstantLevel(state, m_block);
 }
 
+void StatementFor::getCalls(const State& state,
+    std::set<const Function*>& calls) const
+{
+    getStatementsCalls(state, m_block, calls);
+}
+
+void StatementFor::link(State& state)
+{
+    linkStatements(state, m_block);
+}
+
 void StatementFor::optimize(State& state)
 {
     optimizeStatements(state, m_block);
 }
+
+void StatementFor::compile(BytecodeBuilder& builder) const
+{
+    if (m_iterations == 0) {
+        return;
+    }
+    size_t depth = builder.getDepth();
+    builder.emit(Opcode::FOR_BEGIN);
+    size_t start = builder.here();
+    for (const auto& data : m_fordata) {
+        builder.emit(Opcode::FOR_LOAD, data.begin, data.size, data.step);
+    }
+    for (const auto& stmt : m_block) {
+        compileStatement(builder, *stmt);
+    }
+    // remove any variables declared in the block before putting values back
+    builder.emitTruncate(depth + m_size);
+    for (auto data = m_fordata.rbegin(); data != m_fordata.rend(); ++data) {
+        builder.emit(Opcode::FOR_STORE, data->begin, data->size, data->step);
+    }
+    builder.emit(Opcode::FOR_NEXT, start, m_iterations);
+}
+
+size_t StatementFor::inlineCalls(Inliner& inliner, size_t depth)
+{
+    // the captured values are pushed before the block
+    inlineStatements(inliner, m_block, depth + m_size);
+    return depth;
+}
+
+StatementPtr StatementFor::clone(size_t offset) const
+{
+    std::vector<ForData> fordata = m_fordata;
+    for (auto& data : fordata) {
+        data.begin += offset;
+        data.slot += offset;
+    }
+    return makeNode<StatementFor>(getDebugInfo(), m_iterations,
+        std::move(fordata), cloneStatements(m_block, offset));
+}
@@ -4,11 +4,15 @@
 #include "expression.h"
 
 class State;
+class BytecodeBuilder;
+class Inliner;
 
 /// A statement. Unlike an expression, a statement does not have any outputs.
+/// Statements are allocated from an arena with makeNode.
 class Statement : public Debuggable {
 public:
     Statement(const DebugInfo& info);
+    virtual ~Statement() = default;
     /// Resolve this statement. This is similar to calling a function.
     virtual void resolve(State&) const = 0;
     /// Check the statement to ensure consistency and integrity.
@@ -17,24 +21,63 @@ public:
     virtual void check(const State&) const = 0;
     /// Returns the constant-ness of this statement
     virtual ConstantLevel getConstantLevel(const State&) const = 0;
+    /// Add every function that this statement calls directly to the set
+    virtual void getCalls(const State&,
+        std::set<const Function*>&) const = 0;
+    /// Resolve the names of the functions that this statement calls.
+    /// Calls to functions that do not exist are left for check to report.
+    virtual void link(State&) = 0;
     /// Optimize this statement
     virtual void optimize(State& state) = 0;
+    /// Lower this statement into bytecode
+    virtual void compile(BytecodeBuilder&) const = 0;
+    /// Get the number of variables that this statement declares, which stay
+    /// on the stack after its bytecode
+    virtual size_t getDeclared() const;
+    /// Inline calls within this statement, which starts at the given stack
+    /// depth past the variable offset. Returns the depth after the statement.
+    virtual size_t inlineCalls(Inliner&, size_t depth) = 0;
+    /// Copy this statement, moving every variable position up by offset
+    virtual NodePtr<Statement> clone(size_t offset) const = 0;
 };
 
 /// Unique pointer to a statement
-typedef std::unique_ptr<Statement> StatementPtr;
+typedef NodePtr<Statement> StatementPtr;
 
 /// Check the given statements to integrity errors. Since checkStatement is used
 /// for blocks and blocks may declare their own variables, the given namecheck
 /// will not be modified.
 void checkStatements(const State& state,
     const std::vector<StatementPtr>& statements);
+/// Resolve the given block of statements. In checked mode, every statement
+/// must leave the stack as it found it.
+void resolveStatements(State& state,
+    const std::vector<StatementPtr>& statements);
+/// Link all of the given statements
+void linkStatements(State& state, std::vector<StatementPtr>& statements);
 /// Optimize the given block of statements
 void optimizeStatements(State& state,
     std::vector<StatementPtr>& statements);
+/// Lower a statement into bytecode, and mark where it ends
+void compileStatement(BytecodeBuilder& builder, const Statement& statement);
+/// Lower the given block of statements into bytecode. The stack is restored
+/// to its previous depth afterwards.
+void compileStatements(BytecodeBuilder& builder,
+    const std::vector<StatementPtr>& statements);
+/// Inline calls within the given block of statements, which starts at the
+/// given stack depth
+void inlineStatements(Inliner& inliner,
+    std::vector<StatementPtr>& statements, size_t depth);
+/// Copy the given block of statements, moving variable positions up by offset
+std::vector<StatementPtr> cloneStatements(
+    const std::vector<StatementPtr>& statements, size_t offset);
 /// Get the constant level for the given list of statements
 ConstantLevel getStatementsConstantLevel(const State& state,
     const std::vector<StatementPtr>& statements);
+/// Add every function that the given statements call directly to calls
+void getStatementsCalls(const State& state,
+    const std::vector<StatementPtr>& statements,
+    std::set<const Function*>& calls);
 
 /// An assignment statement. Assigns a value to a variable
 class StatementAssign : public Statement {
@@ -46,7 +89,12 @@ public:
     void resolve(State& state) const override;
     void check(const State&) const override;
     ConstantLevel getConstantLevel(const State&) const override;
+    void getCalls(const State&, std::set<const Function*>&) const override;
+    void link(State&) override;
     void optimize(State& state) override;
+    void compile(BytecodeBuilder&) const override;
+    size_t inlineCalls(Inliner&, size_t depth) override;
+    StatementPtr clone(size_t offset) const override;
 };
 
 /// A var statement. Declares a variable.
@@ -59,7 +107,13 @@ public:
     void resolve(State& state) const override;
     void check(const State&) const override;
     ConstantLevel getConstantLevel(const State&) const override;
+    void getCalls(const State&, std::set<const Function*>&) const override;
+    void link(State&) override;
     void optimize(State& state) override;
+    void compile(BytecodeBuilder&) const override;
+    size_t getDeclared() const override;
+    size_t inlineCalls(Inliner&, size_t depth) override;
+    StatementPtr clone(size_t offset) const override;
 };
 
 /// An if statement. Checks a condition to execute a block of statements
@@ -74,7 +128,12 @@ public:
     void resolve(State& state) const override;
     void check(const State&) const override;
     ConstantLevel getConstantLevel(const State&) const override;
+    void getCalls(const State&, std::set<const Function*>&) const override;
+    void link(State&) override;
     void optimize(State& state) override;
+    void compile(BytecodeBuilder&) const override;
+    size_t inlineCalls(Inliner&, size_t depth) override;
+    StatementPtr clone(size_t offset) const override;
 };
 
 /// A while statement. Executes a block of statements while a condition is true.
@@ -87,7 +146,12 @@ public:
     void resolve(State& state) const override;
     void check(const State&) const override;
     ConstantLevel getConstantLevel(const State&) const override;
+    void getCalls(const State&, std::set<const Function*>&) const override;
+    void link(State&) override;
     void optimize(State& state) override;
+    void compile(BytecodeBuilder&) const override;
+    size_t inlineCalls(Inliner&, size_t depth) override;
+    StatementPtr clone(size_t offset) const override;
 };
 
 /// A statement that is simply an expression
@@ -98,7 +162,12 @@ public:
     void resolve(State& state) const override;
     void check(const State&) const override;
     ConstantLevel getConstantLevel(const State&) const override;
+    void getCalls(const State&, std::set<const Function*>&) const override;
+    void link(State&) override;
     void optimize(State& state) override;
+    void compile(BytecodeBuilder&) const override;
+    size_t inlineCalls(Inliner&, size_t depth) override;
+    StatementPtr clone(size_t offset) const override;
 };
 
 /// Represents a single variable in a For statement
@@ -110,6 +179,7 @@ struct ForData {
     size_t begin;   // starting position to read/write each value
     size_t size;    // size of each variable
     ptrdiff_t step; // position difference for each iteration
+    size_t slot;    // position of the loop variable in the frame
 };
 
 /// For loop statement
@@ -124,5 +194,10 @@ public:
     void resolve(State& state) const override;
     void check(const State&) const override;
     ConstantLevel getConstantLevel(const State&) const override;
+    void getCalls(const State&, std::set<const Function*>&) const override;
+    void link(State&) override;
     void optimize(State& state) override;
+    void compile(BytecodeBuilder&) const override;
+    size_t inlineCalls(Inliner&, size_t depth) override;
+    StatementPtr clone(size_t offset) const override;
 };
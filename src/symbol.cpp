@@ -34,18 +34,15 @@ const std::map<Symbol, char> symbolBlocks = {
 };
 
 Token::Token(Symbol symbol, const DebugInfo& info)
-: Debuggable(info), m_symbol(symbol), m_value(0) {}
+: Debuggable(info), m_symbol(symbol), m_packed(0), m_text(""), m_length(0)
+, m_value(0), m_begin(0), m_end(0) {}
 
-Token::Token(Symbol symbol, std::string id, const DebugInfo& info)
+Token::Token(Symbol symbol, const char *text, size_t length,
+    const DebugInfo& info)
 : Token(symbol, info)
 {
-    setIdentifier(id);
-}
-
-Token::Token(Symbol symbol, TokenBlock block, const DebugInfo& info)
-: Token(symbol, info)
-{
-    m_block = block;
+    m_text = text;
+    m_length = length;
 }
 
 Token::Token(Symbol symbol, size_t value, const DebugInfo& info)
@@ -59,9 +56,9 @@ Symbol Token::getSymbol() const
     return m_symbol;
 }
 
-const std::string& Token::getIdentifier() const
+std::string Token::getIdentifier() const
 {
-    return m_identifier;
+    return std::string(m_text, m_length);
 }
 
 size_t Token::getValue() const
@@ -69,21 +66,19 @@ size_t Token::getValue() const
     return m_value;
 }
 
-const TokenBlock& Token::getBlock() const
+size_t Token::getBlockBegin() const
 {
-    return m_block;
+    return m_begin;
 }
 
-TokenBlock Token::takeBlock()
+size_t Token::getBlockEnd() const
 {
-    TokenBlock replacement;
-    std::swap(m_block, replacement);
-    return replacement;
+    return m_end;
 }
 
-void Token::setIdentifier(const std::string& id)
+size_t Token::getPacked() const
 {
-    m_identifier = id;
+    return m_packed;
 }
 
 void Token::setValue(size_t value)
@@ -91,6 +86,17 @@ void Token::setValue(size_t value)
     m_value = value;
 }
 
+void Token::setBlock(size_t begin, size_t end)
+{
+    m_begin = begin;
+    m_end = end;
+}
+
+void Token::setPacked(size_t bits)
+{
+    m_packed = uint8_t(bits);
+}
+
 std::ostream& operator<<(std::ostream& stream, const Symbol& symbol)
 {
     switch (symbol) {
@@ -131,26 +137,41 @@ std::ostream& operator<<(std::ostream& stream, const Token& token)
     return stream;
 }
 
-void printBlock(const TokenBlock& block)
+/// Print out the tokens between begin and end
+void printTokens(const TokenBlock& block, size_t begin, size_t end)
 {
-    for (const auto& t : block) {
+    for (size_t i = begin; i < end; ++i) {
+        const Token& t = block[i];
         switch (t.getSymbol()) {
         case Symbol::BLOCK:
             std::cout << "{" << std::endl;
-            printBlock(t.getBlock());
+            printTokens(block, t.getBlockBegin(), t.getBlockEnd());
             std::cout << "}" << std::endl;
+            i = t.getBlockEnd() - 1;
             break;
         case Symbol::PARENTHESIS:
             std::cout << "(";
-            printBlock(t.getBlock());
+            printTokens(block, t.getBlockBegin(), t.getBlockEnd());
             std::cout << ")";
+            i = t.getBlockEnd() - 1;
             break;
         case Symbol::INDEX:
             std::cout << "[" << t.getValue() << "]";
             break;
         case Symbol::IDENTIFIER: std::cout << t.getIdentifier() << " "; break;
         case Symbol::LINESEP:    std::cout << ";" << std::endl;         break;
-        case Symbol::LITERAL:    std::cout << t.getValue() << " ";      break;
+        case Symbol::LITERAL:
+            if (t.getPacked()) {
+                for (size_t bit = t.getPacked(); bit-- > 0;) {
+                    std::cout << ((t.getValue() >> bit) & 1) << " ";
+                    if (bit) {
+                        std::cout << ",";
+                    }
+                }
+            } else {
+                std::cout << t.getValue() << " ";
+            }
+            break;
         case Symbol::FUNCTION:   std::cout << "function "; break;
         case Symbol::WHILE:      std::cout << "while ";    break;
         case Symbol::NONE:       std::cout << "ERROR";     break;
@@ -165,3 +186,8 @@ void printBlock(const TokenBlock& block)
         }
     }
 }
+
+void printBlock(const TokenBlock& block)
+{
+    printTokens(block, 0, block.size());
+}
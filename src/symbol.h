@@ -1,7 +1,8 @@
 #pragma once
 #include <string>
 #include <map>
-#include <deque>
+#include <vector>
+#include <cstdint>
 #include <iostream>
 #include "debug.h"
 
@@ -28,41 +29,52 @@ extern const std::map<std::string, Symbol> keywordMap;
 extern const std::map<Symbol, char> symbolBlocks;
 
 class Token;
-/// A type that represents a block of tokens. Useful in case I want to change
-/// the collection type to something else.
-typedef std::deque<Token> TokenBlock;
+/// The tokens of a whole script, stored in one array. The tokens inside a
+/// block symbol follow it, and the block symbol holds their positions.
+typedef std::vector<Token> TokenBlock;
 
 /// Represents a Token. A Token is a symbol that potentially has an associated
 /// value. For example, an IDENTIFIER symbol also has a string, and a LITERAL
 /// symbol has a boolean value.
+/// Identifiers refer to the source text that they were read from, which must
+/// outlive the token.
 class Token : public Debuggable {
     Symbol m_symbol;
-    std::string m_identifier; // for Identifier symbols
-    TokenBlock m_block;       // Used for enclosing symbols, e.g. braces
+    /// Number of bits packed into a character literal, or 0
+    uint8_t m_packed;
+    const char *m_text;       // for Identifier symbols
+    size_t m_length;
     size_t m_value;           // for Literal symbols and indexes
+    size_t m_begin;           // Used for enclosing symbols, e.g. braces
+    size_t m_end;
 public:
     Token(Symbol, const DebugInfo&);
-    Token(Symbol, std::string, const DebugInfo&);
-    Token(Symbol, TokenBlock, const DebugInfo&);
+    Token(Symbol, const char *text, size_t length, const DebugInfo&);
     Token(Symbol, size_t, const DebugInfo&);
     /// Get the symbol
     Symbol getSymbol() const;
     /// Get this token's identifier
-    const std::string& getIdentifier() const;
+    std::string getIdentifier() const;
     /// Get index
     size_t getValue() const;
-    /// Get this token's block
-    const TokenBlock& getBlock() const;
-    /// Get a mutable reference to the token block
-    TokenBlock takeBlock();
-    /// Set identifier
-    void setIdentifier(const std::string&);
+    /// Get the position of the first token inside this block
+    size_t getBlockBegin() const;
+    /// Get the position after the last token inside this block
+    size_t getBlockEnd() const;
+    /// Get the number of bits packed into this literal. A literal with packed
+    /// bits stands for that many single bit literals separated by commas, most
+    /// significant bit first. Returns 0 for other tokens.
+    size_t getPacked() const;
     /// Set literal value
     void setValue(size_t);
+    /// Set the positions of the tokens inside this block
+    void setBlock(size_t begin, size_t end);
+    /// Pack the lowest bits of the value into this literal
+    void setPacked(size_t bits);
 };
 
 std::ostream& operator<<(std::ostream&, const Symbol&);
 std::ostream& operator<<(std::ostream&, const Token&);
 
-/// Print out the given token block
+/// Print out the given tokens
 void printBlock(const TokenBlock& block);
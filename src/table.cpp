@@ -0,0 +1,68 @@
+#include "table.h"
+#include "batch.h"
+#include "function.h"
+#include <algorithm>
+#include <stdexcept>
+
+bool buildTable(const Function& function, const TableOptions& options,
+    TruthTable& table)
+{
+    typedef BatchEvaluator<4> Evaluator;
+    try {
+        Evaluator evaluator(function);
+        // calls nested too deeply for the stack are taken to be endless
+        // recursion, and throw StackOverflow
+        evaluator.setLimits(options.maxSteps);
+        size_t inputs = evaluator.getInputNum();
+        size_t outputs = evaluator.getOutputNum();
+        size_t count = size_t(1) << inputs;
+        table.inputs = inputs;
+        table.outputs = outputs;
+        table.entries.resize(count * outputs);
+        std::vector<Evaluator::Word> in(inputs);
+        std::vector<Evaluator::Word> out(outputs);
+        for (size_t start = 0; start < count; start += Evaluator::laneCount) {
+            // Lane l evaluates the index start + l. The first input is the
+            // most significant bit of the index.
+            size_t num = std::min(Evaluator::laneCount, count - start);
+            Evaluator::Word active;
+            for (size_t w = 0; w < 4; ++w) {
+                active.words[w] = 0;
+                for (size_t i = 0; i < inputs; ++i) {
+                    in[i].words[w] = 0;
+                }
+                for (size_t l = 0; l < 64; ++l) {
+                    size_t index = start + 64 * w + l;
+                    if (index - start >= num) {
+                        break;
+                    }
+                    active.words[w] |= uint64_t(1) << l;
+                    for (size_t i = 0; i < inputs; ++i) {
+                        uint64_t bit = (index >> (inputs - 1 - i)) & 1;
+                        in[i].words[w] |= bit << l;
+                    }
+                }
+            }
+            evaluator.evaluate(in.data(), out.data(), active);
+            for (size_t l = 0; l < num; ++l) {
+                for (size_t i = 0; i < outputs; ++i) {
+                    table.entries.set((start + l) * outputs + i,
+                        (out[i].words[l / 64] >> (l % 64)) & 1);
+                }
+            }
+        }
+    } catch (const std::runtime_error&) {
+        return false;
+    }
+    return true;
+}
+
+Bytecode lowerTable(const State& state, TruthTable&& table)
+{
+    size_t inputs = table.inputs;
+    size_t outputs = table.outputs;
+    BytecodeBuilder builder(state, inputs + outputs);
+    builder.emitTable(std::move(table), 0);
+    builder.emit(Opcode::STORE_ARRAY, inputs, outputs);
+    return builder.finish();
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include "bytecode.h"
+
+class State;
+class Function;
+
+/// Limits on which functions are compiled into truth tables
+struct TableOptions {
+    /// Functions with more input bits than this are left alone
+    size_t maxInputs = 16;
+    /// Functions whose table would take more bytes than this are left alone.
+    /// 0 disables truth tables.
+    size_t maxBytes = 1 << 18;
+    /// Functions with at most this many bytecode instructions are cheaper to
+    /// run than to look up, and are left alone.
+    size_t minSize = 8;
+    /// Maximum number of instructions to run for each batch of inputs, so
+    /// that loops that never end are given up on.
+    size_t maxSteps = 1 << 18;
+    /// Number of threads that build tables. 0 uses one per processor.
+    size_t threads = 0;
+};
+
+/// Size of a function that has been compiled into a truth table
+struct TableStats {
+    std::string function;
+    /// Number of bytes taken by the table's entries
+    size_t bytes;
+};
+
+/// Build the truth table of a function by running it on every input, many
+/// inputs at a time. Returns false if the function can not be evaluated in a
+/// batch, or goes past the limits for some input.
+bool buildTable(const Function& function, const TableOptions& options,
+    TruthTable& table);
+
+/// Lower a truth table into bytecode for a function whose inputs index it
+Bytecode lowerTable(const State& state, TruthTable&& table);
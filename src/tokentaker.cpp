@@ -2,63 +2,120 @@
 #include <stdexcept>
 #include <sstream>
 
-TokenTaker::TokenTaker(TokenBlock&& block)
-: m_tokens(block) {}
+TokenTaker::TokenTaker(const TokenBlock& block)
+: m_tokens(&block), m_pos(0), m_end(block.size() * partsPerToken) {}
 
-TokenTaker::TokenTaker() {}
+TokenTaker::TokenTaker()
+: m_tokens(nullptr), m_pos(0), m_end(0) {}
 
-void TokenTaker::push(Token&& token)
+size_t TokenTaker::next(size_t pos) const
 {
-    m_tokens.push_back(std::move(token));
+    size_t index = pos / partsPerToken;
+    size_t part = pos % partsPerToken;
+    const Token& token = (*m_tokens)[index];
+    // a packed literal has a part for each bit, and one for each comma
+    // between them
+    if (part + 2 < 2 * token.getPacked()) {
+        return pos + 1;
+    }
+    Symbol symbol = token.getSymbol();
+    if (symbol == Symbol::BLOCK || symbol == Symbol::PARENTHESIS) {
+        return token.getBlockEnd() * partsPerToken;
+    }
+    return (index + 1) * partsPerToken;
 }
 
 void TokenTaker::clear()
 {
-    m_tokens.clear();
+    m_pos = m_end;
 }
 
 Token TokenTaker::pop()
 {
     if (*this) {
-        Token ret = m_tokens.front();
-        m_tokens.pop_front();
+        Token ret = get(m_pos);
+        m_pos = next(m_pos);
         return ret;
     } else {
         throw std::runtime_error("Attempt to pop from an empty TokenTaker");
     }
 }
 
-Symbol TokenTaker::peek() const
+void TokenTaker::skip()
 {
     if (*this) {
-        return m_tokens.front().getSymbol();
+        m_pos = next(m_pos);
     } else {
-        return Symbol::NONE;
+        throw std::runtime_error("Attempt to pop from an empty TokenTaker");
     }
 }
 
-const Token& TokenTaker::front() const
+Symbol TokenTaker::peek() const
 {
     if (*this) {
-        return m_tokens.front();
+        const Token& token = (*m_tokens)[m_pos / partsPerToken];
+        if (token.getPacked() && m_pos % 2) {
+            return Symbol::COMMA;
+        }
+        return token.getSymbol();
     } else {
-        throw std::runtime_error("Attempt to peek into an empty TokenTaker");
+        return Symbol::NONE;
     }
 }
 
-const Token& TokenTaker::back() const
+Token TokenTaker::front() const
 {
     if (*this) {
-        return m_tokens.back();
+        return get(m_pos);
     } else {
         throw std::runtime_error("Attempt to peek into an empty TokenTaker");
     }
 }
 
+Token TokenTaker::get(size_t pos) const
+{
+    const Token& token = (*m_tokens)[pos / partsPerToken];
+    size_t bits = token.getPacked();
+    if (!bits) {
+        return token;
+    }
+    // bits are at even parts, and commas between them at odd parts
+    size_t part = pos % partsPerToken;
+    if (part % 2) {
+        return Token(Symbol::COMMA, token.getDebugInfo());
+    }
+    size_t bit = bits - 1 - part / 2;
+    return Token(Symbol::LITERAL, (token.getValue() >> bit) & 1,
+        token.getDebugInfo());
+}
+
+size_t TokenTaker::getPosition() const
+{
+    return m_pos;
+}
+
+TokenTaker TokenTaker::slice(size_t begin, size_t end) const
+{
+    TokenTaker ret;
+    ret.m_tokens = m_tokens;
+    ret.m_pos = begin;
+    ret.m_end = end;
+    return ret;
+}
+
+TokenTaker TokenTaker::takeBlock(const Token& token) const
+{
+    return slice(token.getBlockBegin() * partsPerToken,
+        token.getBlockEnd() * partsPerToken);
+}
+
 bool TokenTaker::contains(Symbol s) const
 {
-    for (const auto& token : m_tokens) {
-        if (s == token.getSymbol()) {
+    for (size_t pos = m_pos; pos < m_end; pos = next(pos)) {
+        const Token& token = (*m_tokens)[pos / partsPerToken];
+        Symbol symbol = token.getPacked() && pos % 2
+            ? Symbol::COMMA : token.getSymbol();
+        if (s == symbol) {
             return true;
         }
     }
@@ -67,7 +124,7 @@ bool TokenTaker::contains(Symbol s) const
 
 bool TokenTaker::empty() const
 {
-    return m_tokens.empty();
+    return m_pos >= m_end;
 }
 
 TokenTaker::operator bool() const
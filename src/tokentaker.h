@@ -1,28 +1,44 @@
 #pragma once
 #include "symbol.h"
 
-/// A class that allows for Tokens to be taken from a TokenBlock in FIFO order,
-/// as well as some other useful functions.
+/// A class that allows for Tokens to be taken from a range of a TokenBlock in
+/// FIFO order, as well as some other useful functions.
+/// The tokens are never copied; a TokenTaker only refers to them, so the
+/// TokenBlock must outlive it. Positions count the tokens that a packed
+/// literal stands for separately, so that it can be taken bit by bit.
 class TokenTaker {
-    TokenBlock m_tokens;
+    const TokenBlock *m_tokens;
+    size_t m_pos;
+    size_t m_end;
+    /// Number of positions used by each token. A packed literal uses one
+    /// position for each of its bits and the commas between them.
+    static const size_t partsPerToken = 16;
+    /// Get the position after the token at the given position
+    size_t next(size_t pos) const;
 public:
-    TokenTaker(TokenBlock&& block);
+    /// Take every token at the top level of the block
+    TokenTaker(const TokenBlock& block);
     TokenTaker();
-    /// Push a symbol to this taker
-    void push(Token&& token);
     /// Clear this TokenTaker's tokens
     void clear();
     /// Get the front-most token
     Token pop();
+    /// Remove the front-most token
+    void skip();
     /// Get the front-most token's without removing it.
     /// If the TokenTaker is empty, will return Symbol::NONE
     Symbol peek() const;
-    /// Get the back-most token without removing it.
+    /// Get the front-most token without removing it.
     /// Will do bounds checking, use at your own risk.
-    const Token& front() const;
-    /// Get the back-most token without removing it.
-    /// Will do bounds checking, use at your own risk.
-    const Token& back() const;
+    Token front() const;
+    /// Get the token at the given position
+    Token get(size_t pos) const;
+    /// Get the position of the front-most token
+    size_t getPosition() const;
+    /// Get a TokenTaker for the tokens between two positions of this one
+    TokenTaker slice(size_t begin, size_t end) const;
+    /// Get a TokenTaker for the tokens inside a block token
+    TokenTaker takeBlock(const Token& token) const;
     /// Returns true if this TokenTaker contains the given symbol
     bool contains(Symbol) const;
     /// Returns true if this TokenTaker is out of tokens
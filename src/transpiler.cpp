@@ -0,0 +1,380 @@
+#include "transpiler.h"
+#include "function.h"
+#include "symbol.h"
+#include "idiom.h"
+#include <set>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+/// Start of the runtime for the standard library. Helpers are inline, so
+/// that the C compiler does not warn about the ones that are not used.
+const char *runtimeHeader =
+"#include <stdint.h>\n"
+"#include <stddef.h>\n"
+"#include <stdio.h>\n"
+"#include <stdlib.h>\n"
+"#include <string.h>\n"
+"\n"
+"/* Read n bits, most significant bit first */\n"
+"static inline uint64_t nlrt_get(const uint8_t *f, size_t n)\n"
+"{\n"
+"    uint64_t value = 0;\n"
+"    size_t i;\n"
+"    for (i = 0; i < n; ++i) {\n"
+"        value = (value << 1) | f[i];\n"
+"    }\n"
+"    return value;\n"
+"}\n"
+"\n"
+"/* Write n bits, most significant bit first */\n"
+"static inline void nlrt_set(uint8_t *f, size_t n, uint64_t value)\n"
+"{\n"
+"    size_t i;\n"
+"    for (i = n; i > 0; --i) {\n"
+"        f[i - 1] = value & 1;\n"
+"        value >>= 1;\n"
+"    }\n"
+"}\n"
+"\n"
+"/* Write n bits of a packed truth table, starting at bit pos */\n"
+"static inline void nlrt_lookup(uint8_t *f, const uint64_t *t, size_t pos,\n"
+"    size_t n)\n"
+"{\n"
+"    size_t i;\n"
+"    for (i = 0; i < n; ++i) {\n"
+"        f[i] = (t[(pos + i) / 64] >> ((pos + i) % 64)) & 1;\n"
+"    }\n"
+"}\n";
+
+/// Functions of the runtime, by the name of the external function that they
+/// implement. Every function takes a pointer to its frame, which holds one
+/// byte per bit. The inputs are at the start of the frame, and the outputs
+/// are written to the start of the frame. Only the functions that are called
+/// are written.
+const std::map<std::string, const char*> runtimeFunctions = {
+{"putb",
+"static void nlrt_putb(uint8_t *f)\n"
+"{\n"
+"    putchar(f[0] ? '1' : '0');\n"
+"}\n"},
+{"endl",
+"static void nlrt_endl(uint8_t *f)\n"
+"{\n"
+"    (void)f;\n"
+"    putchar('\\n');\n"
+"    fflush(stdout);\n"
+"}\n"},
+{"puti8",
+"static void nlrt_puti8(uint8_t *f)\n"
+"{\n"
+"    printf(\"%d\", (int)nlrt_get(f, 8));\n"
+"}\n"},
+{"putc",
+"static void nlrt_putc(uint8_t *f)\n"
+"{\n"
+"    putchar((int)nlrt_get(f, 8));\n"
+"}\n"},
+{"getc",
+"static void nlrt_getc(uint8_t *f)\n"
+"{\n"
+"    int c = getchar();\n"
+"    if (c == EOF) {\n"
+"        nlrt_eof = 1;\n"
+"        c = 0;\n"
+"    }\n"
+"    nlrt_set(f, 8, (uint8_t)c);\n"
+"}\n"},
+{"iogood",
+"static void nlrt_iogood(uint8_t *f)\n"
+"{\n"
+"    f[0] = !nlrt_eof;\n"
+"}\n"},
+{"malloc",
+"static void nlrt_malloc(uint8_t *f)\n"
+"{\n"
+"    void *ptr = malloc(nlrt_get(f, NLRT_PTR));\n"
+"    nlrt_set(f, NLRT_PTR, (uintptr_t)ptr);\n"
+"}\n"},
+{"free",
+"static void nlrt_free(uint8_t *f)\n"
+"{\n"
+"    free((void*)(uintptr_t)nlrt_get(f, NLRT_PTR));\n"
+"}\n"},
+{"deref",
+"static void nlrt_deref(uint8_t *f)\n"
+"{\n"
+"    f[0] = *(uint8_t*)(uintptr_t)nlrt_get(f, NLRT_PTR) != 0;\n"
+"}\n"},
+{"assign",
+"static void nlrt_assign(uint8_t *f)\n"
+"{\n"
+"    *(uint8_t*)(uintptr_t)nlrt_get(f, NLRT_PTR) = f[NLRT_PTR];\n"
+"}\n"}
+};
+
+/// C operators of the integer operations
+const std::map<IntOp, const char*> intOpOperators = {
+    {IntOp::ADD, "+"}, {IntOp::SUB, "-"}, {IntOp::NEG, "-"},
+    {IntOp::EQ, "=="}, {IntOp::NE, "!="}, {IntOp::LT, "<"},
+    {IntOp::LE, "<="}, {IntOp::GT, ">"}, {IntOp::GE, ">="}
+};
+
+void Transpiler::addInternal(const std::string& name, const Function& function,
+    const Bytecode& bytecode)
+{
+    m_internals.push_back({name, &function, &bytecode});
+    m_names[&function] = "nl_" + name;
+}
+
+void Transpiler::addExternal(const std::string& name, const Function& function)
+{
+    if (runtimeFunctions.count(name) == 0) {
+        std::stringstream s;
+        s << "External function " << name << " has no C implementation";
+        throw std::runtime_error(s.str());
+    }
+    m_externals.push_back({name, &function, nullptr});
+    m_names[&function] = "nlrt_" + name;
+}
+
+void Transpiler::writeFunction(std::ostream& stream, const Entry& entry) const
+{
+    size_t inputs = entry.function->getInputNum();
+    size_t outputs = entry.function->getOutputNum();
+    const auto& code = entry.bytecode->getCode();
+    const auto& calls = entry.bytecode->getCalls();
+    const BitStack& literals = entry.bytecode->getLiterals();
+    std::vector<size_t> depths = entry.bytecode->getDepths(inputs + outputs);
+    // only jump targets get labels
+    std::set<size_t> targets;
+    size_t levels = 0;
+    size_t level = 0;
+    for (const auto& inst : code) {
+        switch (inst.op) {
+        case Opcode::JUMP:
+        case Opcode::JUMP_IF_ZERO:
+        case Opcode::FOR_NEXT:
+            targets.insert(inst.a);
+            break;
+        case Opcode::FOR_BEGIN:
+            levels = std::max(levels, ++level);
+            break;
+        default:
+            break;
+        }
+        if (inst.op == Opcode::FOR_NEXT) {
+            --level;
+        }
+    }
+    stream << "static void " << m_names.at(entry.function) << "(uint8_t *f)\n"
+           << "{\n"
+           << "    uint8_t s[" << std::max<size_t>(depths.back(), 1) << "];\n";
+    for (size_t i = 0; i < levels; ++i) {
+        stream << "    size_t c" << i << ";\n";
+    }
+    if (literals.size() > 0) {
+        stream << "    static const uint8_t l[" << literals.size() << "] = {";
+        for (size_t i = 0; i < literals.size(); ++i) {
+            stream << (i % 32 == 0 ? "\n        " : "") << literals.get(i)
+                   << (i + 1 < literals.size() ? "," : "");
+        }
+        stream << "\n    };\n";
+    }
+    const auto& tables = entry.bytecode->getTables();
+    for (size_t t = 0; t < tables.size(); ++t) {
+        // tables are packed 64 bits to a word
+        const BitStack& entries = tables[t].entries;
+        size_t words = (entries.size() + 63) / 64;
+        stream << "    static const uint64_t t" << t << "[" << words
+               << "] = {";
+        for (size_t i = 0; i < words; ++i) {
+            size_t pos = 64 * i;
+            stream << (i % 4 == 0 ? "\n        " : " ") << "0x" << std::hex
+                   << entries.getBits(pos,
+                          std::min<size_t>(64, entries.size() - pos))
+                   << std::dec << "u" << (i + 1 < words ? "," : "");
+        }
+        stream << "\n    };\n";
+    }
+    stream << "    memcpy(s, f, " << inputs << ");\n"
+           << "    memset(s + " << inputs << ", 0, " << outputs << ");\n";
+    level = 0;
+    for (size_t i = 0; i < code.size(); ++i) {
+        const Instruction& inst = code[i];
+        size_t d = depths[i];
+        if (targets.count(i)) {
+            stream << "L" << i << ":\n";
+        }
+        stream << "    ";
+        switch (inst.op) {
+        case Opcode::PUSH:
+            stream << "s[" << d << "] = " << inst.a << ";\n";
+            break;
+        case Opcode::PUSH_ARRAY:
+            stream << "memcpy(s + " << d << ", l + " << inst.a << ", "
+                   << inst.b << ");\n";
+            break;
+        case Opcode::ALLOC:
+            stream << "memset(s + " << d << ", 0, " << inst.a << ");\n";
+            break;
+        case Opcode::LOAD:
+            stream << "s[" << d << "] = s[" << inst.a << "];\n";
+            break;
+        case Opcode::LOAD_ARRAY:
+            stream << "memmove(s + " << d << ", s + " << inst.a << ", "
+                   << inst.b << ");\n";
+            break;
+        case Opcode::STORE:
+            stream << "s[" << inst.a << "] = s[" << d - 1 << "];\n";
+            break;
+        case Opcode::STORE_ARRAY:
+            stream << "memmove(s + " << inst.a << ", s + " << d - inst.b
+                   << ", " << inst.b << ");\n";
+            break;
+        case Opcode::DROP:
+            stream << "/* drop " << inst.a << " */\n";
+            break;
+        case Opcode::TRUNCATE:
+            if (inst.a > d) {
+                stream << "memset(s + " << d << ", 0, " << inst.a - d
+                       << ");\n";
+            } else {
+                stream << "/* truncate to " << inst.a << " */\n";
+            }
+            break;
+        case Opcode::NAND:
+            stream << "s[" << d - 2 << "] = !(s[" << d - 2 << "] & s["
+                   << d - 1 << "]);\n";
+            break;
+        case Opcode::NAND_VARS:
+            stream << "s[" << d << "] = !(s[" << inst.a << "] & s["
+                   << inst.b << "]);\n";
+            break;
+        case Opcode::CALL: {
+            const Function *func = calls[inst.a];
+            stream << m_names.at(func) << "(s + " << d - func->getInputNum()
+                   << ");\n";
+            break;
+        }
+        case Opcode::JUMP:
+            stream << "goto L" << inst.a << ";\n";
+            break;
+        case Opcode::JUMP_IF_ZERO:
+            stream << "if (!s[" << d - 1 << "]) goto L" << inst.a << ";\n";
+            break;
+        case Opcode::FOR_BEGIN:
+            stream << "c" << level++ << " = 0;\n";
+            break;
+        case Opcode::FOR_LOAD:
+            stream << "memmove(s + " << d << ", s + " << inst.a << " + (ptrdiff_t)c"
+                   << level - 1 << " * " << inst.c << ", " << inst.b << ");\n";
+            break;
+        case Opcode::FOR_STORE:
+            stream << "memmove(s + " << inst.a << " + (ptrdiff_t)c" << level - 1
+                   << " * " << inst.c << ", s + " << d - inst.b << ", "
+                   << inst.b << ");\n";
+            break;
+        case Opcode::FOR_NEXT:
+            --level;
+            stream << "if (++c" << level << " < " << inst.b << ") goto L"
+                   << inst.a << ";\n";
+            break;
+        case Opcode::INT_OP: {
+            IntOp op = IntOp(inst.c);
+            std::stringstream value;
+            if (op != IntOp::NEG) {
+                value << "nlrt_get(s + " << inst.a << ", " << inst.b << ") ";
+            }
+            value << intOpOperators.at(op) << " nlrt_get(s + "
+                  << inst.a + (op == IntOp::NEG ? 0 : inst.b) << ", "
+                  << inst.b << ")";
+            if (getIntOpOutputs(op, inst.b) == 1) {
+                stream << "s[" << d << "] = " << value.str() << ";\n";
+            } else {
+                stream << "nlrt_set(s + " << d << ", " << inst.b << ", "
+                       << value.str() << ");\n";
+            }
+            break;
+        }
+        case Opcode::TABLE: {
+            const TruthTable& table = tables[inst.b];
+            stream << "nlrt_lookup(s + " << d << ", t" << inst.b
+                   << ", nlrt_get(s + " << inst.a << ", " << table.inputs
+                   << ") * " << table.outputs << ", " << table.outputs
+                   << ");\n";
+            break;
+        }
+        case Opcode::RETURN:
+            stream << "goto done;\n";
+            break;
+        }
+    }
+    stream << "done:\n"
+           << "    memcpy(f, s + " << inputs << ", " << outputs << ");\n"
+           << "}\n\n";
+}
+
+std::set<const Function*> Transpiler::findReachable() const
+{
+    std::map<const Function*, const Bytecode*> bytecodes;
+    std::vector<const Function*> pending;
+    for (const auto& entry : m_internals) {
+        bytecodes[entry.function] = entry.bytecode;
+        if (entry.name == "main") {
+            pending.push_back(entry.function);
+        }
+    }
+    std::set<const Function*> reachable;
+    while (!pending.empty()) {
+        const Function *function = pending.back();
+        pending.pop_back();
+        if (!reachable.insert(function).second) {
+            continue;
+        }
+        auto iter = bytecodes.find(function);
+        if (iter != bytecodes.end()) {
+            const auto& calls = iter->second->getCalls();
+            pending.insert(pending.end(), calls.begin(), calls.end());
+        }
+    }
+    return reachable;
+}
+
+void Transpiler::write(std::ostream& stream) const
+{
+    std::set<const Function*> reachable = findReachable();
+    stream << "/* Generated by nandlang */\n"
+           << "#define NLRT_PTR " << pointerSize << "\n"
+           << runtimeHeader << "\n";
+    std::set<std::string> externals;
+    for (const auto& entry : m_externals) {
+        if (reachable.count(entry.function)) {
+            externals.insert(entry.name);
+        }
+    }
+    if (externals.count("getc") || externals.count("iogood")) {
+        stream << "static int nlrt_eof = 0;\n\n";
+    }
+    for (const auto& name : externals) {
+        stream << runtimeFunctions.at(name) << "\n";
+    }
+    for (const auto& entry : m_internals) {
+        if (reachable.count(entry.function)) {
+            stream << "static void " << m_names.at(entry.function)
+                   << "(uint8_t *f);\n";
+        }
+    }
+    stream << "\n";
+    for (const auto& entry : m_internals) {
+        if (reachable.count(entry.function)) {
+            writeFunction(stream, entry);
+        }
+    }
+    stream << "int main(void)\n"
+           << "{\n"
+           << "    uint8_t f[1];\n"
+           << "    nl_main(f);\n"
+           << "    return 0;\n"
+           << "}\n";
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <iostream>
+
+class Function;
+class Bytecode;
+
+/// Translates lowered functions into a self-contained C program.
+/// Every internal function that main can call becomes a C function that keeps
+/// its variables and temporaries in a local array, one byte per bit, with all
+/// stack positions resolved at compile time. Bits are not packed into words.
+/// External functions map to a small runtime, of which only the functions
+/// that are called are written along with the program.
+class Transpiler {
+    struct Entry {
+        std::string name;
+        const Function *function;
+        const Bytecode *bytecode;
+    };
+    std::vector<Entry> m_internals;
+    std::vector<Entry> m_externals;
+    std::map<const Function*, std::string> m_names;
+    /// Write the definition of an internal function
+    void writeFunction(std::ostream& stream, const Entry& entry) const;
+    /// Get the functions that main calls, directly or through other
+    /// functions, along with main itself
+    std::set<const Function*> findReachable() const;
+public:
+    /// Add an internal function that has been lowered into bytecode
+    void addInternal(const std::string& name, const Function& function,
+        const Bytecode& bytecode);
+    /// Add an external function. Throws an exception if the runtime does
+    /// not provide it.
+    void addExternal(const std::string& name, const Function& function);
+    /// Write the program
+    void write(std::ostream& stream) const;
+};
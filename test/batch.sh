@@ -0,0 +1,35 @@
+# Evaluates functions over more input vectors than fit into one batch, and
+# checks that every way of evaluating them agrees
+
+i=0
+while [ $i -lt 300 ]; do
+    echo "$((i % 2))$((i / 2 % 2))$((i / 4 % 2))"
+    i=$((i + 1))
+done > "$TEST_TMP/in.txt"
+
+batch() {
+    "$NANDLANG" batched.nand --batch-input "$TEST_TMP/in.txt" --batch "$@"
+}
+
+for function in add pick; do
+    echo "$function:"
+    batch $function > "$TEST_TMP/expected"
+    head -n 8 "$TEST_TMP/expected"
+    # the inputs repeat every 8 vectors, and so must the outputs
+    awk 'NR <= 8 { first[NR % 8] = $0 }
+         NR > 8 && $0 != first[NR % 8] { wrong = NR }
+         END { print NR " vectors, " (wrong ? "wrong at " wrong : "ok") }' \
+        "$TEST_TMP/expected"
+    for args in "--lanes 256" "--no-optimize" "--max-gates 0" \
+            "--table-size 0"; do
+        batch $function $args | cmp -s - "$TEST_TMP/expected" \
+            && echo "$args: same" || echo "$args: differs"
+    done
+    batch $function --batch-output "$TEST_TMP/out.txt"
+    cmp -s "$TEST_TMP/out.txt" "$TEST_TMP/expected" \
+        && echo "--batch-output: same" || echo "--batch-output: differs"
+done
+
+echo "errors:"
+batch main
+batch add --lanes 100
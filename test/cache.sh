@@ -0,0 +1,31 @@
+# Caches a compiled program in a directory that does not exist yet, then
+# loads it, checks that damaged files are compiled again rather than loaded,
+# and that a directory that can not be made is reported
+
+run() {
+    "$NANDLANG" control.nand "$@" 2>&1 | sed "s|$TEST_TMP|TMP|g"
+}
+
+echo "first run:"
+run --cache "$TEST_TMP/cache/programs"
+ls "$TEST_TMP/cache/programs" | grep -c '\.nandc$'
+echo "second run:"
+run --cache "$TEST_TMP/cache/programs" --bench | grep -v '|'
+run --cache "$TEST_TMP/cache/programs" --bench | grep -c '^Loading'
+for damage in "flip a byte" "cut short"; do
+    echo "$damage:"
+    for file in "$TEST_TMP"/cache/programs/*.nandc; do
+        if [ "$damage" = "flip a byte" ]; then
+            printf 'X' | dd of="$file" bs=1 seek=100 conv=notrunc 2> /dev/null
+        else
+            head -c 300 "$file" > "$TEST_TMP/cut"
+            mv "$TEST_TMP/cut" "$file"
+        fi
+    done
+    run --cache "$TEST_TMP/cache/programs" --bench | grep -c '^Loading'
+    run --cache "$TEST_TMP/cache/programs" | cmp -s - control.out && echo ok
+    run --cache "$TEST_TMP/cache/programs" --bench | grep -c '^Loading'
+done
+echo "with a file in the way:"
+touch "$TEST_TMP/file"
+run --cache "$TEST_TMP/file/programs" | sed 's|/[0-9a-f]*\.nandc|/KEY.nandc|'
@@ -0,0 +1,132 @@
+/* Calls functions of a program through the C API, with each way of
+ * compiling it, and prints what they return */
+#include "nandlang.h"
+#include <stdio.h>
+#include <string.h>
+
+static const char source[] =
+    "function not(a : o) {\n"
+    "    o = a ! a;\n"
+    "}\n"
+    "function xor(a, b : o) {\n"
+    "    var n = a ! b;\n"
+    "    o = (a ! n) ! (b ! n);\n"
+    "}\n"
+    "function add8(a[8], b[8] : o[8]) {\n"
+    "    var carry = 0;\n"
+    "    for (:a, :b, :o) {\n"
+    "        o = xor(xor(a, b), carry);\n"
+    "        carry = (a ! b) ! (carry ! xor(a, b));\n"
+    "    }\n"
+    "}\n"
+    "function flip3(a[3] : o[3], last) {\n"
+    "    for (a, :o) {\n"
+    "        o = not(a);\n"
+    "    }\n"
+    "    last = a[2];\n"
+    "}\n"
+    "function echo() {\n"
+    "    var c[8] = getc();\n"
+    "    while iogood() {\n"
+    "        putc(c);\n"
+    "        c = getc();\n"
+    "    }\n"
+    "    endl();\n"
+    "}\n"
+    "function forever(a : o) {\n"
+    "    o = forever(a);\n"
+    "}\n";
+
+static const char *input;
+
+static int readInput(void *user)
+{
+    (void)user;
+    if (*input == '\0') {
+        return -1;
+    }
+    return (unsigned char)*input++;
+}
+
+static void writeOutput(void *user, const char *data, size_t size)
+{
+    (void)user;
+    printf("[%.*s]", (int)size, data);
+}
+
+static void run(const char *name, int flags)
+{
+    nand_program *program = nand_load_buffer(source, sizeof(source) - 1,
+        "api.nand", flags);
+    if (!program) {
+        printf("%s: %s\n", name, nand_get_error());
+        return;
+    }
+    nand_state *state = nand_state_new(program);
+    const nand_function *add8 = nand_find_function(program, "add8");
+    const nand_function *flip3 = nand_find_function(program, "flip3");
+    const nand_function *echo = nand_find_function(program, "echo");
+    const nand_function *forever = nand_find_function(program, "forever");
+    printf("%s:\n", name);
+    printf("add8 takes %zu bits and gives %zu\n",
+        nand_function_inputs(add8), nand_function_outputs(add8));
+    printf("missing is %s\n",
+        nand_find_function(program, "missing") ? "found" : "not found");
+
+    int wrong = 0;
+    for (int a = 0; a < 256; ++a) {
+        for (int b = 0; b < 256; ++b) {
+            uint8_t in[2] = {(uint8_t)a, (uint8_t)b};
+            uint8_t out[1];
+            if (nand_call(state, add8, in, out) != 0
+             || out[0] != (uint8_t)(a + b)) {
+                ++wrong;
+            }
+            uint64_t words[1] = {(uint64_t)a << 56 | (uint64_t)b << 48};
+            uint64_t sum[1];
+            if (nand_call_words(state, add8, words, sum) != 0
+             || sum[0] != (uint64_t)(uint8_t)(a + b) << 56) {
+                ++wrong;
+            }
+        }
+    }
+    printf("add8 is wrong %d times\n", wrong);
+
+    /* the unused low bits of the input are ignored, and those of the output
+     * are 0 */
+    uint8_t in[1] = {0xbf};
+    uint8_t out[1];
+    nand_call(state, flip3, in, out);
+    printf("flip3 of 101 gives %02x\n", out[0]);
+
+    input = "abc";
+    nand_state_set_io(state, readInput, writeOutput, NULL);
+    nand_call(state, echo, NULL, NULL);
+    printf("\n");
+
+    uint8_t bit[1] = {0};
+    if (nand_call(state, forever, bit, bit) != 0) {
+        printf("forever: %s\n", nand_get_error());
+    }
+    /* the state can still be used after an error */
+    uint8_t two[2] = {2, 3};
+    nand_call(state, add8, two, out);
+    printf("add8 of 2 and 3 gives %d\n", out[0]);
+
+    nand_state_free(state);
+    nand_program_free(program);
+}
+
+int main(void)
+{
+    printf("version %s\n", nand_version());
+    const char bad[] = "function main() {\n    x = 1;\n}\n";
+    if (!nand_load_buffer(bad, sizeof(bad) - 1, "bad.nand", NAND_OPTIMIZE)) {
+        printf("bad: %s\n", nand_get_error());
+    }
+    run("plain", 0);
+    run("optimized", NAND_OPTIMIZE);
+    run("native", NAND_OPTIMIZE | NAND_JIT);
+    run("checked", NAND_CHECKED);
+    return 0;
+}
@@ -0,0 +1,15 @@
+# Builds a C program against the library next to the interpreter, and checks
+# what its calls through the C API return
+
+CC=${CC:-cc}
+LIBRARY=$(dirname "$NANDLANG")/libnandlang.a
+if ! command -v "$CC" > /dev/null || [ ! -f "$LIBRARY" ]; then
+    exit 77
+fi
+
+if ! "$CC" -Wall -Wextra -Werror -I../src -o "$TEST_TMP/capi" capi.c \
+        "$LIBRARY" -lstdc++ -lm -pthread; then
+    echo "capi.c: does not build"
+    exit 1
+fi
+"$TEST_TMP/capi"
@@ -0,0 +1,119 @@
+/* Runs one program on several threads at once, each with a state of its
+ * own, and prints whether every thread got what it should have */
+#include "nandlang.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREADS 4
+
+static const char source[] =
+    "function xor(a, b : o) {\n"
+    "    var n = a ! b;\n"
+    "    o = (a ! n) ! (b ! n);\n"
+    "}\n"
+    "function add8(a[8], b[8] : o[8]) {\n"
+    "    var carry = 0;\n"
+    "    for (:a, :b, :o) {\n"
+    "        o = xor(xor(a, b), carry);\n"
+    "        carry = (a ! b) ! (carry ! xor(a, b));\n"
+    "    }\n"
+    "}\n"
+    "function upper(c[8] : o[8]) {\n"
+    "    o = c;\n"
+    "    o[2] = 0;\n"
+    "}\n"
+    "function shout() {\n"
+    "    var c[8] = getc();\n"
+    "    while iogood() {\n"
+    "        putc(upper(c));\n"
+    "        c = getc();\n"
+    "    }\n"
+    "}\n";
+
+/* What one thread does, and what it got */
+struct job {
+    nand_program *program;
+    int number;
+    const char *input;
+    char output[64];
+    size_t size;
+    int wrong;
+};
+
+static int readInput(void *user)
+{
+    struct job *job = user;
+    if (*job->input == '\0') {
+        return -1;
+    }
+    return (unsigned char)*job->input++;
+}
+
+static void writeOutput(void *user, const char *data, size_t size)
+{
+    struct job *job = user;
+    if (job->size + size < sizeof(job->output)) {
+        memcpy(job->output + job->size, data, size);
+        job->size += size;
+    }
+}
+
+static void *work(void *arg)
+{
+    struct job *job = arg;
+    nand_state *state = nand_state_new(job->program);
+    const nand_function *add8 = nand_find_function(job->program, "add8");
+    const nand_function *shout = nand_find_function(job->program, "shout");
+    nand_state_set_io(state, readInput, writeOutput, job);
+    for (int round = 0; round < 4; ++round) {
+        for (int a = 0; a < 256; ++a) {
+            /* each thread adds its own numbers */
+            uint8_t in[2] = {(uint8_t)a, (uint8_t)(job->number * 37)};
+            uint8_t out[1];
+            if (nand_call(state, add8, in, out) != 0
+             || out[0] != (uint8_t)(in[0] + in[1])) {
+                ++job->wrong;
+            }
+        }
+    }
+    nand_call(state, shout, NULL, NULL);
+    nand_state_free(state);
+    return NULL;
+}
+
+static void run(const char *name, int flags)
+{
+    static const char *inputs[THREADS] = {"one", "two", "three", "four"};
+    nand_program *program = nand_load_buffer(source, sizeof(source) - 1,
+        "threads.nand", flags);
+    if (!program) {
+        printf("%s: %s\n", name, nand_get_error());
+        return;
+    }
+    struct job jobs[THREADS];
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; ++i) {
+        memset(&jobs[i], 0, sizeof(jobs[i]));
+        jobs[i].program = program;
+        jobs[i].number = i;
+        jobs[i].input = inputs[i];
+        pthread_create(&threads[i], NULL, work, &jobs[i]);
+    }
+    printf("%s:", name);
+    for (int i = 0; i < THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+        printf(" %d %.*s", jobs[i].wrong, (int)jobs[i].size, jobs[i].output);
+    }
+    printf("\n");
+    nand_program_free(program);
+}
+
+int main(void)
+{
+    run("plain", 0);
+    run("optimized", NAND_OPTIMIZE);
+    run("native", NAND_OPTIMIZE | NAND_JIT);
+    run("checked", NAND_CHECKED);
+    return 0;
+}
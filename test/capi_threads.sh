@@ -0,0 +1,15 @@
+# Builds a C program against the library next to the interpreter, and runs
+# one program from several threads at once
+
+CC=${CC:-cc}
+LIBRARY=$(dirname "$NANDLANG")/libnandlang.a
+if ! command -v "$CC" > /dev/null || [ ! -f "$LIBRARY" ]; then
+    exit 77
+fi
+
+if ! "$CC" -Wall -Wextra -Werror -I../src -o "$TEST_TMP/capi_threads" \
+        capi_threads.c "$LIBRARY" -lstdc++ -lm -pthread; then
+    echo "capi_threads.c: does not build"
+    exit 1
+fi
+"$TEST_TMP/capi_threads"
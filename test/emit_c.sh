@@ -0,0 +1,25 @@
+# Compiles scripts into C with every warning turned into an error, and checks
+# that the programs print what the scripts print
+
+CC=${CC:-cc}
+if ! command -v "$CC" > /dev/null; then
+    exit 77
+fi
+
+for name in control io; do
+    input=/dev/null
+    if [ -f "$name.in" ]; then
+        input=$name.in
+    fi
+    for args in "" "--no-optimize"; do
+        "$NANDLANG" "$name.nand" $args --emit-c "$TEST_TMP/$name.c"
+        if ! "$CC" -Wall -Wextra -Werror -o "$TEST_TMP/$name" \
+                "$TEST_TMP/$name.c"; then
+            echo "$name.nand: does not compile with options '$args'"
+        elif ! "$TEST_TMP/$name" < "$input" | cmp -s - "$name.out"; then
+            echo "$name.nand: differs with options '$args'"
+        else
+            echo "$name.nand: ok"
+        fi
+    done
+done
@@ -0,0 +1,18 @@
+# Runs every example in each way that scripts can be run, and checks that
+# they all print what the syntax tree interpreter prints without optimizing
+
+cd ../example || exit 1
+for script in *.nand; do
+    printf 'hello\nworld\n' | "$NANDLANG" "$script" --no-optimize --interpret \
+        > "$TEST_TMP/expected" 2>&1
+    result=ok
+    for args in "" "--interpret" "--no-optimize" "--checked" "--jit" \
+            "--memoize" "--threads 1"; do
+        printf 'hello\nworld\n' | "$NANDLANG" "$script" $args \
+            > "$TEST_TMP/actual" 2>&1
+        if ! cmp -s "$TEST_TMP/expected" "$TEST_TMP/actual"; then
+            result="differs with options '$args'"
+        fi
+    done
+    echo "$script: $result"
+done
@@ -0,0 +1,41 @@
+# Checks when output is written out under each flush policy: at the end of a
+# line with --flush line, even while the script waits for input from a pipe,
+# and in full, in order, with every policy
+
+# A line of 100 characters, and 1000 of them, more than the output buffer
+line=0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789
+i=0
+while [ $i -lt 1000 ]; do
+    echo "$line"
+    i=$((i + 1))
+done > "$TEST_TMP/input"
+{ echo "name?"; cat "$TEST_TMP/input"; } > "$TEST_TMP/expected"
+
+for policy in full line exit; do
+    "$NANDLANG" prompt.nand --flush $policy < "$TEST_TMP/input" \
+        > "$TEST_TMP/output"
+    if cmp -s "$TEST_TMP/expected" "$TEST_TMP/output"; then
+        echo "$policy: all output"
+    else
+        echo "$policy: output differs"
+    fi
+done
+
+# The prompt must come out before the input is written
+mkfifo "$TEST_TMP/pipe" || exit 77
+"$NANDLANG" prompt.nand --flush line < "$TEST_TMP/pipe" > "$TEST_TMP/prompted" &
+exec 3> "$TEST_TMP/pipe"
+tries=0
+while [ ! -s "$TEST_TMP/prompted" ] && [ $tries -lt 100 ]; do
+    sleep 0.1
+    tries=$((tries + 1))
+done
+echo "line: before input:"
+cat "$TEST_TMP/prompted"
+echo "typed" >&3
+exec 3>&-
+wait
+echo "line: after input:"
+cat "$TEST_TMP/prompted"
+
+"$NANDLANG" prompt.nand --flush sometimes < /dev/null
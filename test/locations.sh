@@ -0,0 +1,44 @@
+# Reports errors in scripts laid out in unusual ways, and checks the line and
+# column that each one is found at
+
+check() {
+    (cd "$TEST_TMP" && "$NANDLANG" bad.nand)
+}
+
+echo "line endings of carriage return and line feed:"
+printf 'function main() {\r\n    putb(1);\r\n    putb(x);\r\n}\r\n' \
+    > "$TEST_TMP/bad.nand"
+check | tr -d '\r'
+
+echo "indented by tabs:"
+printf 'function main() {\n\tvar a = 1;\n\t\tputb(a, b);\n}\n' \
+    > "$TEST_TMP/bad.nand"
+check
+
+echo "no line feed at the end:"
+printf 'function main() {\n    putb(1);\n}\nfunction f(a : o) {\n    o = g(a);\n}' \
+    > "$TEST_TMP/bad.nand"
+check
+
+echo "far into the file:"
+{
+    i=0
+    while [ $i -lt 2000 ]; do
+        printf 'function f%d(a : o) {\n    o = a ! a;\n}\n' $i
+        i=$((i + 1))
+    done
+    printf 'function main() {\n    putb(f1999(1, 0));\n}\n'
+} > "$TEST_TMP/bad.nand"
+check
+
+echo "far along a line:"
+{
+    printf 'function main() {\n    putb('
+    i=0
+    while [ $i -lt 300 ]; do
+        printf '1 ! '
+        i=$((i + 1))
+    done
+    printf 'y);\n}\n'
+} > "$TEST_TMP/bad.nand"
+check | head -n 2
@@ -0,0 +1,54 @@
+# Parses scripts with syntax errors, and checks the error and location that
+# each one reports
+
+parse() {
+    printf '%s\n' "$1" > "$TEST_TMP/bad.nand"
+    (cd "$TEST_TMP" && "$NANDLANG" bad.nand)
+}
+
+parse 'function main() {
+    putb(1)
+}'
+parse 'function main() {
+    putb(1);'
+parse 'function main( {
+}'
+parse 'function (a : b) {
+}'
+parse 'function main() {
+    putb(1 ! );
+}'
+parse 'function main() {
+    putb((1 ! 0);
+}'
+parse 'function main() {
+    if {
+    }
+}'
+parse 'function main() {
+    while 1
+        putb(1);
+}'
+parse 'function f(a b : c) {
+    c = a;
+}'
+parse 'function f(a : c[) {
+    c = a;
+}'
+parse 'function main() {
+    putb(1);
+} }'
+parse 'function main() {
+    putb(1 $ 0);
+}'
+parse 'function main() {
+    var a = 1;
+    a b = 1, 0;
+}'
+parse 'function main() {
+    putb(0b);
+}'
+parse 'function main() {
+    putb(1);
+}
+function'
@@ -0,0 +1,104 @@
+#!/bin/sh
+# Runs the regression tests.
+#
+# A test is a script, name.nand, and the output that it is expected to print,
+# name.out. Its standard input is name.in if there is one, and nothing
+# otherwise. The script is run once with each line of name.args as its
+# options, or once with each of the default options below if there is no
+# name.args, and must print the expected output every time.
+#
+# Tests that need more than running a script are shell scripts, name.sh, that
+# print what name.out holds. They are run with $NANDLANG set to the
+# interpreter and $TEST_TMP set to an empty directory, and exit with 77 if
+# they can not be run on this system.
+#
+# Scripts are run from the test directory, so errors name them as name.nand.
+#
+# Usage: test/run.sh [path to nandlang]
+
+cd "$(dirname "$0")" || exit 1
+NANDLANG=${1:-../nandlang}
+case $NANDLANG in
+    /*) ;;
+    *) NANDLANG=$OLDPWD/$NANDLANG ;;
+esac
+if [ ! -x "$NANDLANG" ]; then
+    echo "Can not run $NANDLANG; build it first or give its path" >&2
+    exit 1
+fi
+export NANDLANG
+
+# Every way of running a script. They must all print the same output.
+default_args='
+--no-optimize
+--interpret
+--no-optimize --interpret
+--checked
+--no-optimize --checked
+--jit
+--memoize
+--threads 1
+--flush exit'
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+passed=0
+failed=0
+skipped=0
+
+# Compare the output of a test with what it should be
+check() {
+    name=$1
+    description=$2
+    if cmp -s "$name.out" "$tmp/actual"; then
+        passed=$((passed + 1))
+    else
+        failed=$((failed + 1))
+        echo "FAIL: $description"
+        diff -u "$name.out" "$tmp/actual" | head -n 20
+    fi
+}
+
+for script in *.nand; do
+    name=${script%.nand}
+    input=/dev/null
+    if [ -f "$name.in" ]; then
+        input=$name.in
+    fi
+    if [ -f "$name.args" ]; then
+        args_list=$(cat "$name.args")
+    else
+        args_list=$default_args
+    fi
+    # the first line of the defaults is empty, which runs without options
+    printf '%s\n' "$args_list" > "$tmp/args"
+    while IFS= read -r args; do
+        TEST_TMP=$tmp/run
+        rm -rf "$TEST_TMP"
+        mkdir "$TEST_TMP"
+        eval "\"\$NANDLANG\" \"\$script\" $args" < "$input" > "$tmp/actual" 2>&1
+        check "$name" "$script $args"
+    done < "$tmp/args"
+done
+
+for test in *.sh; do
+    name=${test%.sh}
+    if [ "$test" = run.sh ]; then
+        continue
+    fi
+    TEST_TMP=$tmp/run
+    rm -rf "$TEST_TMP"
+    mkdir "$TEST_TMP"
+    export TEST_TMP
+    sh "$test" < /dev/null > "$tmp/actual" 2>&1
+    status=$?
+    if [ $status -eq 77 ]; then
+        skipped=$((skipped + 1))
+        echo "SKIP: $test"
+        continue
+    fi
+    check "$name" "$test"
+done
+
+echo "$passed passed, $failed failed, $skipped skipped"
+[ $failed -eq 0 ]